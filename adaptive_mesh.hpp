@@ -0,0 +1,349 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "expr_bytecode.hpp"
+#include "parallel.hpp"
+#include "utils.hpp"
+
+// triangulation of the graph of f(x, y) with samples placed where the formula needs them
+//
+// the domain is covered by a coarse grid of cells, each the root of a quadtree, a cell is split
+// into four while it isn't represented well enough by its samples (see AdaptiveOptions), so flat
+// regions end up with a few large cells and sharp features with many small ones, roots are
+// refined in parallel
+//
+// every cell is sampled at its corners, edge midpoints and center, the children of a cell reuse
+// those 9 samples and only add 5 each, a leaf is drawn as a fan around its center through its
+// corners and every corner of a smaller neighbouring leaf lying on its edges, so leaves of
+// different sizes share their edges exactly and the mesh is crack-free without balancing the tree
+//
+// positions are (x, f(x, y), y) like the tesselated plane, colors are normals mapped to [0, 1]
+// like marching_cubes.hpp, so the mesh is drawn with the surface shaders
+
+struct AdaptiveOptions {
+    // cells per side of the coarse grid
+    size_t resolution = 16;
+    // splits below the coarse grid, the smallest cells are resolution * 2^maxDepth per side
+    size_t maxDepth = 6;
+    // largest difference between a sample and the bilinear interpolation of the corners of its
+    // cell, in formula units, 0 disables
+    double tolerance = 0.01;
+    // largest change of the value across a cell estimated from the corners, 0 disables
+    double gradientTolerance = 0.0;
+    // largest part of the interval bounds of the cell not covered by its samples, catches
+    // features between the samples, but is pessimistic for formulas with repeated variables
+    double intervalTolerance = 0.0;
+    // animation time the formula is sampled at
+    double t = 0.0;
+    // 0 uses all hardware threads
+    size_t threads = 0;
+};
+
+class AdaptiveSampler {
+    // a cell of the quadtree on the integer lattice of the smallest cells' samples, 3x3 samples,
+    // bottom row first
+    struct Cell {
+        int64_t x;
+        int64_t y;
+        int64_t size;
+        double values[9];
+    };
+
+    const Bytecode& bytecode;
+    glm::dvec2 min;
+    // distance between lattice points
+    glm::dvec2 unit;
+    AdaptiveOptions options;
+    // lattice points per side of a coarse cell, every cell has a center and edge midpoints
+    int64_t rootSize;
+    mutable std::atomic<size_t> samples { 0 };
+
+    // all samples are taken at lattice points, so a point shared by cells is always computed and
+    // evaluated identically
+    glm::dvec2 lattice_point(int64_t x, int64_t y) const {
+        return glm::dvec2 { min.x + x * unit.x, min.y + y * unit.y };
+    }
+
+    static uint64_t point_key(int64_t x, int64_t y) {
+        return (uint64_t)y << 32 | (uint64_t)x;
+    }
+
+    bool needs_split(const Cell& cell) const {
+        const double* v = cell.values;
+        size_t finite = std::count_if(v, v + 9, [](double value) { return std::isfinite(value); });
+        // poles, discontinuities and edges of the domain of the formula
+        if (finite != 9)
+            return finite != 0;
+
+        if (options.tolerance > 0.0) {
+            double error = std::max({
+                std::abs((v[0] + v[2]) * 0.5 - v[1]),
+                std::abs((v[0] + v[6]) * 0.5 - v[3]),
+                std::abs((v[2] + v[8]) * 0.5 - v[5]),
+                std::abs((v[6] + v[8]) * 0.5 - v[7]),
+                std::abs((v[0] + v[2] + v[6] + v[8]) * 0.25 - v[4]),
+            });
+            if (error > options.tolerance)
+                return true;
+        }
+
+        if (options.gradientTolerance > 0.0) {
+            double dx = (v[2] + v[8] - v[0] - v[6]) * 0.5;
+            double dy = (v[6] + v[8] - v[0] - v[2]) * 0.5;
+            if (std::sqrt(dx * dx + dy * dy) > options.gradientTolerance)
+                return true;
+        }
+
+        if (options.intervalTolerance > 0.0) {
+            glm::dvec2 lo = lattice_point(cell.x, cell.y);
+            glm::dvec2 hi = lattice_point(cell.x + cell.size, cell.y + cell.size);
+            Interval bounds = evaluate_interval(bytecode, Interval { lo.x, hi.x }, Interval { lo.y, hi.y },
+                Interval { 0.0, 0.0 }, options.t);
+            double sampled = *std::max_element(v, v + 9) - *std::min_element(v, v + 9);
+            // also true for infinite or NaN bounds
+            if (!(bounds.hi - bounds.lo - sampled <= options.intervalTolerance))
+                return true;
+        }
+
+        return false;
+    }
+
+    void refine(const Cell& cell, size_t depth, std::vector<Cell>& leaves) const {
+        if (depth == options.maxDepth || !needs_split(cell)) {
+            leaves.push_back(cell);
+            return;
+        }
+
+        const int64_t half = cell.size / 2;
+        const int64_t quarter = cell.size / 4;
+        Cell children[4];
+        // the 5 new samples of each child, its edge midpoints and center
+        const int NEW[5] = { 1, 3, 4, 5, 7 };
+        double xs[20], ys[20], values[20];
+        for (int c=0; c != 4; c++) {
+            int cx = c % 2, cy = c / 2;
+            children[c] = Cell { cell.x + cx * half, cell.y + cy * half, half, {} };
+            for (int j=0; j != 2; j++) {
+                for (int i=0; i != 2; i++) {
+                    children[c].values[j * 6 + i * 2] = cell.values[(cy + j) * 3 + cx + i];
+                }
+            }
+            for (int k=0; k != 5; k++) {
+                glm::dvec2 p = lattice_point(children[c].x + NEW[k] % 3 * quarter, children[c].y + NEW[k] / 3 * quarter);
+                xs[c * 5 + k] = p.x;
+                ys[c * 5 + k] = p.y;
+            }
+        }
+        evaluate_batch(bytecode, xs, ys, nullptr, values, 20, options.t);
+        samples += 20;
+
+        for (int c=0; c != 4; c++) {
+            for (int k=0; k != 5; k++) {
+                children[c].values[NEW[k]] = values[c * 5 + k];
+            }
+            refine(children[c], depth + 1, leaves);
+        }
+    }
+
+    std::vector<Cell> refine_root(size_t rx, size_t ry) const {
+        Cell root { (int64_t)rx * rootSize, (int64_t)ry * rootSize, rootSize, {} };
+        double xs[9], ys[9];
+        for (int k=0; k != 9; k++) {
+            glm::dvec2 p = lattice_point(root.x + k % 3 * rootSize / 2, root.y + k / 3 * rootSize / 2);
+            xs[k] = p.x;
+            ys[k] = p.y;
+        }
+        // corners and edge midpoints shared with neighbouring roots are sampled by both
+        evaluate_batch(bytecode, xs, ys, nullptr, root.values, 9, options.t);
+        samples += 9;
+
+        std::vector<Cell> leaves;
+        refine(root, 0, leaves);
+        return leaves;
+    }
+
+    // drops the vertices no triangle uses, e.g. the corners where the formula isn't defined
+    static void compact(GLMesh& mesh) {
+        const GLuint unused = ~(GLuint)0;
+        std::vector<GLuint> remap(mesh.vertices.size(), unused);
+        std::vector<Vertex> vertices;
+        for (auto&& index: mesh.indices) {
+            if (remap[index] == unused) {
+                remap[index] = vertices.size();
+                vertices.push_back(mesh.vertices[index]);
+            }
+            index = remap[index];
+        }
+        mesh.vertices = std::move(vertices);
+    }
+
+    // normals from the area weighted normals of the triangles around each vertex
+    static void shade(GLMesh& mesh) {
+        std::vector<glm::vec3> normals(mesh.vertices.size(), glm::vec3 { 0.0f, 0.0f, 0.0f });
+        for (size_t i=0; i + 2 < mesh.indices.size(); i += 3) {
+            glm::vec3 a = mesh.vertices[mesh.indices[i]].position;
+            glm::vec3 b = mesh.vertices[mesh.indices[i + 1]].position;
+            glm::vec3 c = mesh.vertices[mesh.indices[i + 2]].position;
+            glm::vec3 normal = glm::cross(c - a, b - a);
+            for (size_t k=0; k != 3; k++) {
+                normals[mesh.indices[i + k]] = normals[mesh.indices[i + k]] + normal;
+            }
+        }
+        for (size_t i=0; i != mesh.vertices.size(); i++) {
+            float length = glm::length(normals[i]);
+            glm::vec3 normal = length > 0.0f && std::isfinite(length) ? normals[i] / length : glm::vec3 { 0.0f, 1.0f, 0.0f };
+            mesh.vertices[i].color = normal * 0.5f + glm::vec3 { 0.5f, 0.5f, 0.5f };
+        }
+    }
+
+public:
+    AdaptiveSampler(const Bytecode& bytecode, glm::dvec2 min, glm::dvec2 max, AdaptiveOptions options):
+            bytecode(bytecode), min(min), options(options) {
+        // lattice coordinates are packed into 32 bits, see point_key
+        if (options.resolution == 0 || options.maxDepth > 24 || (options.resolution << (options.maxDepth + 1)) >= ((size_t)1 << 32))
+            throw std::invalid_argument("invalid adaptive sampling resolution");
+        rootSize = (int64_t)2 << options.maxDepth;
+        unit = (max - min) / (double)(options.resolution * rootSize);
+    }
+
+    GLMesh extract() const {
+        const size_t roots = options.resolution * options.resolution;
+        std::vector<std::vector<Cell>> results(roots);
+        parallel_for(roots, options.threads, [&](size_t i) {
+            results[i] = refine_root(i % options.resolution, i / options.resolution);
+        });
+
+        // vertices at the leaf corners, merged in root order, so the output doesn't depend on
+        // scheduling, and for each lattice row and column the vertices lying on it
+        GLMesh mesh;
+        std::unordered_map<uint64_t, GLuint> vertices;
+        std::unordered_map<int64_t, std::vector<int64_t>> rows, columns;
+        auto add_vertex = [&](int64_t x, int64_t y, double value) -> GLuint {
+            auto [it, inserted] = vertices.emplace(point_key(x, y), (GLuint)mesh.vertices.size());
+            if (inserted) {
+                glm::dvec2 p = lattice_point(x, y);
+                mesh.vertices.push_back(Vertex {
+                    .position = glm::vec3 { p.x, value, p.y },
+                    .color = glm::vec3 { 1.0f, 1.0f, 1.0f },
+                });
+                rows[y].push_back(x);
+                columns[x].push_back(y);
+            }
+            return it->second;
+        };
+
+        for (auto&& leaves: results) {
+            for (auto&& cell: leaves) {
+                for (int k: { 0, 2, 6, 8 }) {
+                    add_vertex(cell.x + k % 3 / 2 * cell.size, cell.y + k / 3 / 2 * cell.size, cell.values[k]);
+                }
+            }
+        }
+        for (auto&& [_, xs]: rows) {
+            std::sort(xs.begin(), xs.end());
+        }
+        for (auto&& [_, ys]: columns) {
+            std::sort(ys.begin(), ys.end());
+        }
+
+        // appends the vertices strictly between from and to along a row or column, in order
+        std::vector<GLuint> boundary;
+        auto add_edge = [&](const std::vector<int64_t>& line, int64_t from, int64_t to, auto&& key) {
+            if (from < to) {
+                auto begin = std::upper_bound(line.begin(), line.end(), from);
+                for (auto it = begin; it != line.end() && *it < to; ++it) {
+                    boundary.push_back(vertices.at(key(*it)));
+                }
+            } else {
+                auto end = std::lower_bound(line.begin(), line.end(), from);
+                for (auto it = end; it != line.begin() && *(it - 1) > to; --it) {
+                    boundary.push_back(vertices.at(key(*(it - 1))));
+                }
+            }
+        };
+
+        for (auto&& leaves: results) {
+            for (auto&& cell: leaves) {
+                const int64_t x0 = cell.x, y0 = cell.y, x1 = cell.x + cell.size, y1 = cell.y + cell.size;
+                auto row_key = [](int64_t y) { return [y](int64_t x) { return point_key(x, y); }; };
+                auto column_key = [](int64_t x) { return [x](int64_t y) { return point_key(x, y); }; };
+
+                // counterclockwise in the domain
+                boundary.clear();
+                boundary.push_back(vertices.at(point_key(x0, y0)));
+                add_edge(rows[y0], x0, x1, row_key(y0));
+                boundary.push_back(vertices.at(point_key(x1, y0)));
+                add_edge(columns[x1], y0, y1, column_key(x1));
+                boundary.push_back(vertices.at(point_key(x1, y1)));
+                add_edge(rows[y1], x1, x0, row_key(y1));
+                boundary.push_back(vertices.at(point_key(x0, y1)));
+                add_edge(columns[x0], y1, y0, column_key(x0));
+
+                double value = cell.values[4];
+                if (!std::isfinite(value))
+                    continue;
+                glm::dvec2 p = lattice_point(x0 + cell.size / 2, y0 + cell.size / 2);
+                mesh.vertices.push_back(Vertex {
+                    .position = glm::vec3 { p.x, value, p.y },
+                    .color = glm::vec3 { 1.0f, 1.0f, 1.0f },
+                });
+                GLuint center = mesh.vertices.size() - 1;
+
+                for (size_t i=0; i != boundary.size(); i++) {
+                    GLuint a = boundary[i], b = boundary[(i + 1) % boundary.size()];
+                    // holes where the formula isn't defined
+                    if (!std::isfinite(mesh.vertices[a].position.y) || !std::isfinite(mesh.vertices[b].position.y))
+                        continue;
+                    mesh.indices.insert(mesh.indices.end(), { center, a, b });
+                }
+            }
+        }
+
+        compact(mesh);
+        shade(mesh);
+        return mesh;
+    }
+
+    // samples taken by extract, a uniform grid with the resolution of the smallest cells takes
+    // (resolution * 2^(maxDepth + 1) + 1)^2
+    size_t get_samples() const {
+        return samples;
+    }
+};
+
+GLMesh sample_adaptive(const Bytecode& bytecode, glm::dvec2 min, glm::dvec2 max, AdaptiveOptions options = {}) {
+    return AdaptiveSampler(bytecode, min, max, options).extract();
+}
+
+// writes the mesh as a Wavefront OBJ, y pointing up
+void write_mesh_obj(const std::string &path, const GLMesh &mesh) {
+    std::ofstream stream(path, std::ios::out);
+    if (!stream.is_open()) {
+        throw std::runtime_error("failed to open obj file " + path);
+    }
+
+    for (auto&& vertex: mesh.vertices) {
+        stream << "v " << vertex.position.x << " " << vertex.position.y << " " << vertex.position.z << "\n";
+    }
+    for (auto&& vertex: mesh.vertices) {
+        glm::vec3 normal = vertex.color * 2.0f - glm::vec3 { 1.0f, 1.0f, 1.0f };
+        stream << "vn " << normal.x << " " << normal.y << " " << normal.z << "\n";
+    }
+    for (size_t i=0; i + 2 < mesh.indices.size(); i += 3) {
+        stream << "f";
+        for (size_t k=0; k != 3; k++) {
+            stream << " " << mesh.indices[i + k] + 1 << "//" << mesh.indices[i + k] + 1;
+        }
+        stream << "\n";
+    }
+}
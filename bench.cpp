@@ -0,0 +1,327 @@
+// benchmarks of the formula pipeline: tokenizer, parser, code generation and CPU evaluators
+// build and run with `make bench && ./bench [filter]`
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "expr_parser.hpp"
+#include "expr_bytecode.hpp"
+#include "bytecode_format.hpp"
+#include "formula_batch.hpp"
+
+struct Formula {
+    std::string name;
+    std::string source;
+};
+
+// left-deep sum of random terms, so the evaluation stack stays shallow regardless of length
+std::string generate_formula(size_t min_length, unsigned seed) {
+    std::mt19937 rng(seed);
+    const std::vector<std::string> funcs = {"sin", "cos", "exp", "sqrt", "abs", "atan", "tanh", "log"};
+    const std::vector<std::string> vars = {"x", "y", "pi", "1.5", "0.25", "3"};
+    const std::vector<std::string> ops = {"+", "-", "*", "/"};
+
+    auto pick = [&](const std::vector<std::string>& from) {
+        return from[rng() % from.size()];
+    };
+
+    std::string result = "x";
+    while (result.size() < min_length) {
+        std::string term = pick(funcs) + "(" + pick(vars) + pick(ops) + pick(vars) + ")";
+        if (rng() % 3 == 0) {
+            term = "max(" + term + ", " + pick(vars) + "**2)";
+        }
+        result += pick(ops) + term;
+    }
+
+    return result;
+}
+
+std::vector<Formula> corpus() {
+    std::string nested = "x";
+    for (int i=0; i != 64; i++) {
+        nested = (i % 2 ? "sin(" : "cos(") + nested + "+y)";
+    }
+
+    std::string wide = "0";
+    for (int i=0; i != 64; i++) {
+        wide += "+min(sin(x*" + std::to_string(i) + "), cos(y/" + std::to_string(i + 1) + "))";
+    }
+
+    return {
+        {"short", "sin(x)+cos(y)"},
+        {"ripple", "sin(sqrt(x*x+y*y))/sqrt(x*x+y*y)"},
+        {"gaussian", "exp(-(x*x+y*y)/10)*cos(x)*2.5"},
+        {"polynomial", "x**3-3*x*y**2+0.5*x**2-y+1"},
+        {"let", "let r = sqrt(x*x+y*y) in sin(r)/r*exp(-r/10)"},
+        {"functions", "f(t)=sin(t)*t; g(a,b)=f(a)*f(b); g(x,y)+g(y,x)"},
+        {"nested", nested},
+        {"wide", wide},
+        {"generated_1k", generate_formula(1000, 1)},
+        {"generated_10k", generate_formula(10000, 2)},
+    };
+}
+
+size_t count_nodes(const Expression* expr) {
+    if (auto binary = dynamic_cast<const BinaryExpression*>(expr)) {
+        return 1 + count_nodes(binary->left.get()) + count_nodes(binary->right.get());
+    } else if (auto unary = dynamic_cast<const UnaryExpression*>(expr)) {
+        return 1 + count_nodes(unary->expr.get());
+    } else if (auto call = dynamic_cast<const FunctionCall*>(expr)) {
+        size_t result = 1;
+        for (auto&& arg: call->exprs) {
+            result += count_nodes(arg.get());
+        }
+        return result;
+    } else if (auto grouping = dynamic_cast<const Grouping*>(expr)) {
+        return 1 + count_nodes(grouping->expr.get());
+    } else if (auto let = dynamic_cast<const Let*>(expr)) {
+        return 1 + count_nodes(let->value.get()) + count_nodes(let->body.get());
+    } else if (auto call = dynamic_cast<const UserCall*>(expr)) {
+        size_t result = 1;
+        for (auto&& arg: call->exprs) {
+            result += count_nodes(arg.get());
+        }
+        return result;
+    }
+    return 1;
+}
+
+// keeps results alive so that the benchmarked code isn't optimized out
+volatile double sink;
+
+// runs f repeatedly for at least min_time, returns the median time of one call in nanoseconds
+double measure(const std::function<void()>& f, double min_time = 0.2) {
+    using clock = std::chrono::steady_clock;
+
+    // calibrate the number of calls per sample so that a sample takes ~1ms
+    size_t iterations = 1;
+    while (true) {
+        auto start = clock::now();
+        for (size_t i=0; i != iterations; i++) {
+            f();
+        }
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        if (elapsed > 1e-3 || iterations > (1 << 24))
+            break;
+        iterations *= 2;
+    }
+
+    std::vector<double> samples;
+    auto begin = clock::now();
+    while (samples.size() < 5 || std::chrono::duration<double>(clock::now() - begin).count() < min_time) {
+        auto start = clock::now();
+        for (size_t i=0; i != iterations; i++) {
+            f();
+        }
+        samples.push_back(std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations);
+    }
+
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    return samples[samples.size() / 2];
+}
+
+void report(const std::string& name, const std::string& formula, double ns, double per, const char* unit) {
+    std::printf("%-22s %-14s %12.1f ns %12.2f %s\n", name.c_str(), formula.c_str(), ns, per, unit);
+}
+
+int main(int argc, char** argv) {
+    std::string filter = argc > 1 ? argv[1] : "";
+    auto enabled = [&](const std::string& name) {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    };
+
+    // side of the evaluated grid
+    const int side = 128;
+    const double points = side * side;
+
+    std::printf("%-22s %-14s %15s %15s\n", "benchmark", "formula", "time", "rate");
+
+    for (auto&& formula: corpus()) {
+        auto tokens = tokenize(formula.source);
+        auto expr = Parser(tokens).parse();
+        size_t nodes = count_nodes(expr.get());
+
+        if (enabled("tokenize")) {
+            double ns = measure([&]() { sink = tokenize(formula.source).size(); });
+            report("tokenize", formula.name, ns, ns / tokens.size(), "ns/token");
+        }
+
+        if (enabled("Parser::parse")) {
+            double ns = measure([&]() { sink = (double)(size_t)Parser(tokens).parse().get(); });
+            report("Parser::parse", formula.name, ns, ns / nodes, "ns/node");
+        }
+
+        if (enabled("to_string")) {
+            double ns = measure([&]() { sink = expr->to_string().size(); });
+            report("Expression::to_string", formula.name, ns, ns / nodes, "ns/node");
+        }
+
+        if (enabled("canonical")) {
+            double ns = measure([&]() { sink = expr->canonical().size(); });
+            report("Expression::canonical", formula.name, ns, ns / nodes, "ns/node");
+        }
+
+        if (enabled("equals")) {
+            auto copy = Parser(tokens).parse();
+            double ns = measure([&]() { sink = expr->equals(*copy); });
+            report("Expression::equals", formula.name, ns, ns / nodes, "ns/node");
+        }
+
+        Bytecode bytecode;
+        try {
+            bytecode = compile_bytecode(*expr);
+        } catch (const BytecodeError& e) {
+            std::printf("%-22s %-14s skipped: %s\n", "bytecode", formula.name.c_str(), e.what.c_str());
+            continue;
+        }
+
+        if (enabled("compile_bytecode")) {
+            double ns = measure([&]() { sink = compile_bytecode(*expr).code.size(); });
+            report("compile_bytecode", formula.name, ns, ns / nodes, "ns/node");
+        }
+
+        if (enabled("load_bytecode")) {
+            std::vector<uint8_t> library = write_bytecode_library({ bytecode }, { expr->hash });
+            double ns = measure([&]() {
+                sink = BytecodeLibraryView(library.data(), library.size()).load(0).code.size();
+            });
+            report("load_bytecode", formula.name, ns, ns / nodes, "ns/node");
+        }
+
+        if (enabled("evaluate")) {
+            double ns = measure([&]() {
+                double sum = 0;
+                for (int y=0; y != side; y++) {
+                    for (int x=0; x != side; x++) {
+                        sum += evaluate(bytecode, -10.0 + 20.0 * x / side, -10.0 + 20.0 * y / side);
+                    }
+                }
+                sink = sum;
+            });
+            report("evaluate", formula.name, ns, points / ns * 1e9, "points/s");
+        }
+
+        for (MathTier tier: { MathTier::Exact, MathTier::Medium, MathTier::Fast }) {
+            std::string name = tier == MathTier::Exact ? "evaluate_batch" : std::string("evaluate_batch_") + math_tier_name(tier);
+            if (!enabled(name))
+                continue;
+
+            std::vector<double> xs(points), ys(points), out(points);
+            for (int y=0; y != side; y++) {
+                for (int x=0; x != side; x++) {
+                    xs[y * side + x] = -10.0 + 20.0 * x / side;
+                    ys[y * side + x] = -10.0 + 20.0 * y / side;
+                }
+            }
+
+            double ns = measure([&]() {
+                evaluate_batch(bytecode, xs.data(), ys.data(), nullptr, out.data(), out.size(), 0.0, tier);
+                sink = out[0];
+            });
+            report(name, formula.name, ns, points / ns * 1e9, "points/s");
+        }
+    }
+
+    // bulk validation, half of the inputs are invalid like in user input
+    std::vector<std::string> sources;
+    for (unsigned i=0; i != 1024; i++) {
+        std::string source = generate_formula(200, i);
+        sources.push_back(i % 2 ? source.substr(0, source.size() / 2) + ")" : source);
+    }
+
+    // both sides tokenize, parse and compile bytecode only, without GLSL and constant folding,
+    // so they differ just in how errors are reported
+    if (enabled("compile_throwing")) {
+        double ns = measure([&]() {
+            size_t valid = 0;
+            for (auto&& source: sources) {
+                try {
+                    compile_bytecode(*Parser(tokenize(source)).parse());
+                    valid++;
+                } catch (const ParserError&) {
+                } catch (const TokenizerError&) {
+                } catch (const BytecodeError&) {
+                }
+            }
+            sink = valid;
+        });
+        report("compile_throwing", "mixed_1k", ns, ns / sources.size(), "ns/formula");
+    }
+
+    for (size_t threads: { 1, 0 }) {
+        std::string name = threads == 1 ? "compile_formulas_st" : "compile_formulas_mt";
+        if (enabled(name)) {
+            FormulaOptions options { .glsl = false, .bytecode = true, .optimize = false, .threads = threads };
+            double ns = measure([&]() { sink = compile_formulas(sources, options).size(); });
+            report(name, "mixed_1k", ns, ns / sources.size(), "ns/formula");
+        }
+    }
+
+    // speed and largest error of the approximations of fast_math.hpp against double precision,
+    // sin, cos and tan within the range of their polynomials, see the table in fast_math.hpp,
+    // the tiers run the vectorized kernels of evaluate_batch, exact calls the float builtin
+    if (enabled("fast_math")) {
+        struct MathFunction {
+            const char* name;
+            OpCode op;
+            float (*single)(float);
+            double (*reference)(double);
+            double lo, hi;
+            bool logarithmic;
+        };
+        const MathFunction functions[] = {
+            {"sin", OpCode::Sin, [](float x) { return std::sin(x); }, [](double x) { return std::sin(x); }, -M_PI / 4, M_PI / 4, false},
+            {"cos", OpCode::Cos, [](float x) { return std::cos(x); }, [](double x) { return std::cos(x); }, -M_PI / 4, M_PI / 4, false},
+            {"tan", OpCode::Tan, [](float x) { return std::tan(x); }, [](double x) { return std::tan(x); }, -M_PI / 4, M_PI / 4, false},
+            {"exp", OpCode::Exp, [](float x) { return std::exp(x); }, [](double x) { return std::exp(x); }, -87.0, 87.0, false},
+            {"exp2", OpCode::Exp2, [](float x) { return std::exp2(x); }, [](double x) { return std::exp2(x); }, -126.0, 126.0, false},
+            {"log", OpCode::Log, [](float x) { return std::log(x); }, [](double x) { return std::log(x); }, -80.0, 80.0, true},
+            {"log2", OpCode::Log2, [](float x) { return std::log2(x); }, [](double x) { return std::log2(x); }, -80.0, 80.0, true},
+        };
+
+        const size_t n = 1 << 20;
+        std::vector<float> inputs(n);
+        std::vector<double> outputs(n);
+        for (auto&& function: functions) {
+            for (size_t i=0; i != n; i++) {
+                double x = function.lo + (function.hi - function.lo) * i / (n - 1);
+                inputs[i] = function.logarithmic ? std::exp(x) : x;
+            }
+
+            for (MathTier tier: { MathTier::Exact, MathTier::Medium, MathTier::Fast }) {
+                double ns = measure([&]() {
+                    std::copy(inputs.begin(), inputs.end(), outputs.begin());
+                    if (tier == MathTier::Exact) {
+                        for (size_t i=0; i != n; i++) {
+                            outputs[i] = function.single((float)outputs[i]);
+                        }
+                    } else {
+                        fast_math_batch(tier, function.op, nullptr, outputs.data(), n);
+                    }
+                    sink = outputs[0];
+                });
+
+                // in units in the last place of the exact result, at least the smallest subnormal
+                double error = 0.0;
+                for (size_t i=0; i != n; i++) {
+                    double reference = function.reference(inputs[i]);
+                    int exponent;
+                    std::frexp(reference, &exponent);
+                    double ulp = std::max(std::ldexp(1.0, exponent - 24), 1.4e-45);
+                    error = std::max(error, std::abs(outputs[i] - reference) / ulp);
+                }
+
+                std::string name = std::string("fast_math_") + math_tier_name(tier);
+                report(name, function.name, ns / n, error, "ulp");
+            }
+        }
+    }
+
+    return 0;
+}
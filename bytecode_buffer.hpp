@@ -0,0 +1,77 @@
+#pragma once
+#include <vector>
+
+#include <glm/glm.hpp>
+#include "GL/glew.h"
+
+#include "expr_bytecode.hpp"
+#include "shader_pipeline.hpp"
+
+// GPU copy of compiled formulas, read by plane_bytecode.tese through texture buffers
+// https://www.khronos.org/opengl/wiki/Buffer_Texture
+class GLBytecodeBuffer {
+    // instructions of all formulas, one RG32F texel (opcode, value) per instruction
+    GLuint codeBuffer;
+    GLuint codeTexture;
+    // one RG32I texel (first instruction, instruction count) per formula
+    GLuint formulasBuffer;
+    GLuint formulasTexture;
+
+public:
+    GLBytecodeBuffer() {
+        glGenBuffers(1, &codeBuffer);
+        glGenTextures(1, &codeTexture);
+        glGenBuffers(1, &formulasBuffer);
+        glGenTextures(1, &formulasTexture);
+
+        upload({});
+    }
+
+    GLBytecodeBuffer(GLBytecodeBuffer&&) = delete;
+    GLBytecodeBuffer(GLBytecodeBuffer&) = delete;
+
+    // replaces all formulas, formula id i refers to bytecodes[i]
+    void upload(const std::vector<Bytecode> &bytecodes) {
+        std::vector<glm::vec2> code;
+        std::vector<glm::ivec2> formulas;
+
+        for (auto&& bytecode: bytecodes) {
+            formulas.push_back(glm::ivec2 { (int)code.size(), (int)bytecode.code.size() });
+            for (auto&& ins: bytecode.code) {
+                code.push_back(glm::vec2 { (float)ins.op, (float)ins.value });
+            }
+        }
+
+        // texture buffers can't be empty
+        if (code.empty())
+            code.push_back(glm::vec2 { 0.0f, 0.0f });
+        if (formulas.empty())
+            formulas.push_back(glm::ivec2 { 0, 0 });
+
+        glBindBuffer(GL_TEXTURE_BUFFER, codeBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::vec2) * code.size(), code.data(), GL_DYNAMIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, codeTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32F, codeBuffer);
+
+        glBindBuffer(GL_TEXTURE_BUFFER, formulasBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::ivec2) * formulas.size(), formulas.data(), GL_DYNAMIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, formulasTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32I, formulasBuffer);
+
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    // makes the buffers visible to the code and formulas samplers of the pipeline
+    void attach(GLShaderPipeline &pipeline, GLuint codeUnit = 1, GLuint formulasUnit = 2) {
+        pipeline.setTexture("code", codeUnit, GL_TEXTURE_BUFFER, codeTexture);
+        pipeline.setTexture("formulas", formulasUnit, GL_TEXTURE_BUFFER, formulasTexture);
+    }
+
+    ~GLBytecodeBuffer() {
+        glDeleteTextures(1, &codeTexture);
+        glDeleteBuffers(1, &codeBuffer);
+        glDeleteTextures(1, &formulasTexture);
+        glDeleteBuffers(1, &formulasBuffer);
+    }
+};
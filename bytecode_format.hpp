@@ -0,0 +1,254 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "expr_bytecode.hpp"
+
+// binary format of compiled formulas, loaded into Bytecode without tokenizing or parsing
+//
+// all fields are in host byte order (checked by byteOrder) and naturally aligned, so a
+// library can be used straight from a memory mapped file
+//
+//   BytecodeFileHeader
+//   BytecodeFileEntry[formulas]
+//   double[constants]     constant pool, shared by all formulas, without duplicates
+//   uint32_t[words]       instructions, opcode in the low 8 bits, constant pool index of
+//                         OpCode::Const or local of OpCode::Load and OpCode::Store in the upper 24 bits
+//
+// entries refer to their instructions by offset into the instruction words
+
+const char BYTECODE_FILE_MAGIC[4] = { 'G', 'C', 'B', 'C' };
+const uint16_t BYTECODE_FILE_VERSION = 1;
+const uint32_t BYTECODE_FILE_BYTE_ORDER = 0x01020304;
+const uint32_t BYTECODE_FILE_MAX_CONSTANTS = 1 << 24;
+
+struct BytecodeFileHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t byteOrder;
+    uint32_t formulas;
+    uint32_t constants;
+    uint32_t words;
+};
+
+struct BytecodeFileEntry {
+    // structural hash of the formula, see Expression::hash
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t count;
+    uint32_t stackSize;
+    uint32_t locals;
+};
+
+static_assert(sizeof(BytecodeFileHeader) == 24, "BytecodeFileHeader must not be padded");
+static_assert(sizeof(BytecodeFileEntry) == 24, "BytecodeFileEntry must not be padded");
+
+struct BytecodeFormatError: public std::exception {
+    std::string what;
+
+    BytecodeFormatError(std::string what): what(what) {
+    }
+};
+
+// hashes[i] is stored with bytecodes[i]
+std::vector<uint8_t> write_bytecode_library(const std::vector<Bytecode> &bytecodes, const std::vector<uint64_t> &hashes) {
+    std::vector<BytecodeFileEntry> entries;
+    std::vector<double> constants;
+    std::vector<uint32_t> words;
+    // keyed by bit pattern, so that -0.0 and NaNs round-trip exactly
+    std::unordered_map<uint64_t, uint32_t> constantIds;
+
+    for (size_t i=0; i != bytecodes.size(); i++) {
+        entries.push_back(BytecodeFileEntry {
+            .hash = i < hashes.size() ? hashes[i] : 0,
+            .offset = (uint32_t)words.size(),
+            .count = (uint32_t)bytecodes[i].code.size(),
+            .stackSize = (uint32_t)bytecodes[i].stack_size,
+            .locals = (uint32_t)bytecodes[i].locals,
+        });
+
+        for (auto&& ins: bytecodes[i].code) {
+            uint32_t operand = 0;
+            if (ins.op == OpCode::Const) {
+                uint64_t bits;
+                std::memcpy(&bits, &ins.value, sizeof(bits));
+                auto it = constantIds.find(bits);
+                if (it == constantIds.end()) {
+                    if (constants.size() == BYTECODE_FILE_MAX_CONSTANTS)
+                        throw BytecodeFormatError("too many constants");
+                    it = constantIds.emplace(bits, constants.size()).first;
+                    constants.push_back(ins.value);
+                }
+                operand = it->second;
+            } else if (ins.op == OpCode::Load || ins.op == OpCode::Store) {
+                operand = (uint32_t)ins.value;
+            }
+            words.push_back((uint32_t)ins.op | operand << 8);
+        }
+    }
+
+    BytecodeFileHeader header {
+        .magic = { BYTECODE_FILE_MAGIC[0], BYTECODE_FILE_MAGIC[1], BYTECODE_FILE_MAGIC[2], BYTECODE_FILE_MAGIC[3] },
+        .version = BYTECODE_FILE_VERSION,
+        .flags = 0,
+        .byteOrder = BYTECODE_FILE_BYTE_ORDER,
+        .formulas = (uint32_t)entries.size(),
+        .constants = (uint32_t)constants.size(),
+        .words = (uint32_t)words.size(),
+    };
+
+    std::vector<uint8_t> result(sizeof(header) + sizeof(BytecodeFileEntry) * entries.size()
+        + sizeof(double) * constants.size() + sizeof(uint32_t) * words.size());
+    uint8_t* out = result.data();
+    auto append = [&](const void* data, size_t size) {
+        if (size != 0)
+            std::memcpy(out, data, size);
+        out += size;
+    };
+    append(&header, sizeof(header));
+    append(entries.data(), sizeof(BytecodeFileEntry) * entries.size());
+    append(constants.data(), sizeof(double) * constants.size());
+    append(words.data(), sizeof(uint32_t) * words.size());
+
+    return result;
+}
+
+// read-only view of a library in memory, which must outlive it and be 8 byte aligned,
+// the layout is validated once on construction and every formula when it's loaded
+class BytecodeLibraryView {
+    const BytecodeFileHeader* header;
+    const BytecodeFileEntry* entries;
+    const double* constants;
+    const uint32_t* words;
+
+public:
+    BytecodeLibraryView(const void* data, size_t size) {
+        if (size < sizeof(BytecodeFileHeader))
+            throw BytecodeFormatError("truncated header");
+        if ((uintptr_t)data % alignof(double) != 0)
+            throw BytecodeFormatError("misaligned data");
+
+        header = static_cast<const BytecodeFileHeader*>(data);
+        if (std::memcmp(header->magic, BYTECODE_FILE_MAGIC, sizeof(BYTECODE_FILE_MAGIC)) != 0)
+            throw BytecodeFormatError("not a bytecode library");
+        if (header->byteOrder != BYTECODE_FILE_BYTE_ORDER)
+            throw BytecodeFormatError("wrong byte order");
+        if (header->version != BYTECODE_FILE_VERSION)
+            throw BytecodeFormatError("unsupported version " + std::to_string(header->version));
+
+        uint64_t expected = sizeof(BytecodeFileHeader) + sizeof(BytecodeFileEntry) * (uint64_t)header->formulas
+            + sizeof(double) * (uint64_t)header->constants + sizeof(uint32_t) * (uint64_t)header->words;
+        if (size < expected)
+            throw BytecodeFormatError("truncated library");
+
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        entries = reinterpret_cast<const BytecodeFileEntry*>(bytes + sizeof(BytecodeFileHeader));
+        constants = reinterpret_cast<const double*>(entries + header->formulas);
+        words = reinterpret_cast<const uint32_t*>(constants + header->constants);
+    }
+
+    size_t size() const {
+        return header->formulas;
+    }
+
+    const BytecodeFileEntry& entry(size_t i) const {
+        if (i >= header->formulas)
+            throw BytecodeFormatError("formula " + std::to_string(i) + " out of bounds");
+        return entries[i];
+    }
+
+    uint64_t hash(size_t i) const {
+        return entry(i).hash;
+    }
+
+    // decodes and verifies formula i
+    Bytecode load(size_t i) const {
+        const BytecodeFileEntry& entry = this->entry(i);
+        if ((uint64_t)entry.offset + entry.count > header->words)
+            throw BytecodeFormatError("instructions out of bounds");
+
+        Bytecode result { .stack_size = entry.stackSize, .locals = entry.locals };
+        result.code.reserve(entry.count);
+        for (uint32_t j=0; j != entry.count; j++) {
+            uint32_t word = words[entry.offset + j];
+            Instruction ins { .op = (OpCode)(word & 0xff), .value = 0.0 };
+            if (ins.op == OpCode::Const) {
+                if ((word >> 8) >= header->constants)
+                    throw BytecodeFormatError("constant out of bounds");
+                ins.value = constants[word >> 8];
+            } else if (ins.op == OpCode::Load || ins.op == OpCode::Store) {
+                ins.value = word >> 8;
+            }
+            result.code.push_back(ins);
+        }
+
+        try {
+            verify_bytecode(result);
+        } catch (const BytecodeError& e) {
+            throw BytecodeFormatError("invalid formula " + std::to_string(i) + ": " + e.what);
+        }
+        return result;
+    }
+
+    std::vector<Bytecode> load_all() const {
+        std::vector<Bytecode> result;
+        for (size_t i=0; i != size(); i++) {
+            result.push_back(load(i));
+        }
+        return result;
+    }
+};
+
+// read-only memory mapping of a whole file, e.g. for BytecodeLibraryView
+class MappedFile {
+    void* data = nullptr;
+    size_t size = 0;
+
+public:
+    MappedFile(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("failed to open " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("failed to stat " + path);
+        }
+
+        size = st.st_size;
+        if (size != 0) {
+            data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+
+        if (data == MAP_FAILED)
+            throw std::runtime_error("failed to map " + path);
+    }
+
+    MappedFile(MappedFile&&) = delete;
+    MappedFile(MappedFile&) = delete;
+
+    const void* get_data() const {
+        return data;
+    }
+
+    size_t get_size() const {
+        return size;
+    }
+
+    ~MappedFile() {
+        if (data != nullptr)
+            munmap(data, size);
+    }
+};
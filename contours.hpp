@@ -0,0 +1,344 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "expr_bytecode.hpp"
+#include "parallel.hpp"
+#include "tile_cache.hpp"
+#include "utils.hpp"
+
+// contour lines f(x, y) = level of height field formulas, extracted with marching squares
+// https://en.wikipedia.org/wiki/Marching_squares
+//
+// the formula is sampled once into ContourGrid, directly or from TileCache, and every level
+// reuses the samples, levels and tiles of CONTOUR_TILE^2 cells are processed in parallel,
+// segments are stitched into polylines through the grid edges they cross, so the output is
+// usable for export as well as for drawing
+
+const size_t CONTOUR_TILE = 32;
+
+struct ContourLine {
+    double level;
+    // formula coordinates, the last point repeats the first one if closed
+    std::vector<glm::dvec2> points;
+    bool closed;
+};
+
+// edges of a cell crossed by its segments, per case (bit i set if corner i is >= level)
+// corners 0 (x, y), 1 (x+1, y), 2 (x+1, y+1), 3 (x, y+1)
+// edges 0 bottom (0-1), 1 right (1-2), 2 top (3-2), 3 left (0-3)
+const int MARCHING_SQUARES[16][4] = {
+    {-1, -1, -1, -1},
+    { 3,  0, -1, -1},
+    { 0,  1, -1, -1},
+    { 3,  1, -1, -1},
+    { 1,  2, -1, -1},
+    // saddle, corners 0 and 2 separated, swapped to {0, 1, 2, 3} if the center is >= level
+    { 3,  0,  1,  2},
+    { 0,  2, -1, -1},
+    { 3,  2, -1, -1},
+    { 2,  3, -1, -1},
+    { 0,  2, -1, -1},
+    // saddle, corners 1 and 3 separated, swapped to {3, 0, 1, 2} if the center is >= level
+    { 0,  1,  2,  3},
+    { 1,  2, -1, -1},
+    { 1,  3, -1, -1},
+    { 0,  1, -1, -1},
+    { 3,  0, -1, -1},
+    {-1, -1, -1, -1},
+};
+
+class ContourGrid {
+    glm::dvec2 min;
+    glm::dvec2 cell;
+    // cells in x and y
+    size_t columns;
+    size_t rows;
+    // (columns + 1) * (rows + 1) samples, row by row
+    std::vector<double> values;
+    Interval range { std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity() };
+
+    // segments of one level in one tile, as pairs of edge keys
+    using Segments = std::vector<std::pair<uint64_t, uint64_t>>;
+
+    size_t point_id(size_t x, size_t y) const {
+        return y * (columns + 1) + x;
+    }
+
+    // horizontal edges (x, y)-(x+1, y) are even, vertical edges (x, y)-(x, y+1) are odd
+    uint64_t edge_key(size_t x, size_t y, int edge) const {
+        switch (edge) {
+            case 0: return 2 * (uint64_t)point_id(x, y);
+            case 1: return 2 * (uint64_t)point_id(x + 1, y) + 1;
+            case 2: return 2 * (uint64_t)point_id(x, y + 1);
+            default: return 2 * (uint64_t)point_id(x, y) + 1;
+        }
+    }
+
+    glm::dvec2 edge_point(uint64_t key, double level) const {
+        size_t a = key / 2;
+        size_t b = key % 2 ? a + columns + 1 : a + 1;
+        double t = (level - values[a]) / (values[b] - values[a]);
+
+        glm::dvec2 pa { min.x + (a % (columns + 1)) * cell.x, min.y + (a / (columns + 1)) * cell.y };
+        glm::dvec2 pb { min.x + (b % (columns + 1)) * cell.x, min.y + (b / (columns + 1)) * cell.y };
+        return pa + (pb - pa) * t;
+    }
+
+    Segments march_tile(size_t tx, size_t ty, double level) const {
+        Segments result;
+
+        const size_t x0 = tx * CONTOUR_TILE, y0 = ty * CONTOUR_TILE;
+        const size_t x1 = std::min(x0 + CONTOUR_TILE, columns), y1 = std::min(y0 + CONTOUR_TILE, rows);
+
+        for (size_t y=y0; y != y1; y++) {
+            for (size_t x=x0; x != x1; x++) {
+                double v[4] = {
+                    values[point_id(x, y)],
+                    values[point_id(x + 1, y)],
+                    values[point_id(x + 1, y + 1)],
+                    values[point_id(x, y + 1)],
+                };
+                if (!std::isfinite(v[0]) || !std::isfinite(v[1]) || !std::isfinite(v[2]) || !std::isfinite(v[3]))
+                    continue;
+
+                int index = (v[0] >= level) | (v[1] >= level) << 1 | (v[2] >= level) << 2 | (v[3] >= level) << 3;
+                const int* edges = MARCHING_SQUARES[index];
+                if (edges[0] < 0)
+                    continue;
+
+                // ambiguous saddles are resolved by the average of the corners
+                int saddle[4];
+                if ((index == 5 || index == 10) && (v[0] + v[1] + v[2] + v[3]) / 4.0 >= level) {
+                    for (int i=0; i != 4; i++) {
+                        saddle[i] = MARCHING_SQUARES[15 - index][i];
+                    }
+                    edges = saddle;
+                }
+
+                for (int i=0; i != 4 && edges[i] >= 0; i += 2) {
+                    result.emplace_back(edge_key(x, y, edges[i]), edge_key(x, y, edges[i + 1]));
+                }
+            }
+        }
+
+        return result;
+    }
+
+    // joins segments sharing an edge, every edge is shared by at most two segments
+    std::vector<ContourLine> stitch(const Segments &segments, double level) const {
+        std::unordered_map<uint64_t, std::array<int32_t, 2>> edges;
+        edges.reserve(segments.size() * 2);
+        for (int32_t i=0; i != (int32_t)segments.size(); i++) {
+            for (uint64_t key: {segments[i].first, segments[i].second}) {
+                auto it = edges.try_emplace(key, std::array<int32_t, 2> { -1, -1 }).first;
+                it->second[it->second[0] < 0 ? 0 : 1] = i;
+            }
+        }
+
+        std::vector<bool> visited(segments.size());
+        std::vector<ContourLine> result;
+
+        auto walk = [&](int32_t segment, uint64_t from) {
+            ContourLine line { .level = level, .points = { edge_point(from, level) }, .closed = false };
+            uint64_t start = from;
+
+            while (segment >= 0) {
+                visited[segment] = true;
+                from = segments[segment].first == from ? segments[segment].second : segments[segment].first;
+                line.points.push_back(edge_point(from, level));
+
+                auto&& next = edges[from];
+                segment = next[0] != segment && next[0] >= 0 && !visited[next[0]] ? next[0]
+                    : next[1] != segment && next[1] >= 0 && !visited[next[1]] ? next[1] : -1;
+            }
+
+            line.closed = from == start;
+            result.push_back(std::move(line));
+        };
+
+        // open lines start at the edges with a single segment, the rest are loops
+        for (int32_t i=0; i != (int32_t)segments.size(); i++) {
+            if (visited[i])
+                continue;
+            if (edges[segments[i].first][1] < 0) {
+                walk(i, segments[i].first);
+            } else if (edges[segments[i].second][1] < 0) {
+                walk(i, segments[i].second);
+            }
+        }
+        for (int32_t i=0; i != (int32_t)segments.size(); i++) {
+            if (!visited[i])
+                walk(i, segments[i].first);
+        }
+
+        return result;
+    }
+
+    void compute_range() {
+        for (double v: values) {
+            if (std::isfinite(v)) {
+                range.lo = std::min(range.lo, v);
+                range.hi = std::max(range.hi, v);
+            }
+        }
+    }
+
+public:
+    // samples the formula on a resolution^2 cell grid over [min, max], threads = 0 uses all hardware threads
+    ContourGrid(const Bytecode& bytecode, glm::dvec2 min, glm::dvec2 max, size_t resolution, size_t threads = 0):
+        min(min), cell((max - min) / (double)resolution), columns(resolution), rows(resolution),
+        values((resolution + 1) * (resolution + 1)) {
+
+        // rows of points in chunks of CONTOUR_TILE
+        const size_t side = resolution + 1;
+        const size_t chunks = (side + CONTOUR_TILE - 1) / CONTOUR_TILE;
+
+        parallel_for(chunks, threads, [&](size_t chunk) {
+            const size_t begin = point_id(0, chunk * CONTOUR_TILE);
+            const size_t end = point_id(0, std::min((chunk + 1) * CONTOUR_TILE, side));
+
+            std::vector<double> xs(end - begin), ys(end - begin);
+            for (size_t i=begin; i != end; i++) {
+                xs[i - begin] = min.x + (i % side) * cell.x;
+                ys[i - begin] = min.y + (i / side) * cell.y;
+            }
+            evaluate_batch(bytecode, xs.data(), ys.data(), nullptr, values.data() + begin, end - begin);
+        });
+
+        compute_range();
+    }
+
+    // takes the samples from the tile lattice of level lod, only tiles missing from cache are sampled,
+    // the grid covers the lattice points inside [min, max], so it may be up to a cell smaller
+    ContourGrid(TileCache &cache, const Bytecode& bytecode, uint64_t formula, glm::dvec2 min, glm::dvec2 max,
+            int lod, size_t threads = 0) {
+        const double c = tile_cell(lod);
+        glm::ivec2 first { (int)std::ceil(min.x / c), (int)std::ceil(min.y / c) };
+        glm::ivec2 last { (int)std::floor(max.x / c), (int)std::floor(max.y / c) };
+        last = glm::max(last, first);
+
+        this->min = glm::dvec2 { first.x * c, first.y * c };
+        cell = glm::dvec2 { c, c };
+        columns = last.x - first.x;
+        rows = last.y - first.y;
+        values.resize((columns + 1) * (rows + 1));
+
+        std::vector<glm::ivec2> tiles = tiles_covering(this->min, glm::dvec2 { last.x * c, last.y * c }, lod);
+        std::vector<const float*> samples = cache.fetch(bytecode, formula, lod, tiles, threads);
+
+        for (size_t t=0; t != tiles.size(); t++) {
+            // lattice points of the tile inside the grid
+            glm::ivec2 origin = tiles[t] * TILE_SIZE;
+            glm::ivec2 lo = glm::max(first, origin);
+            glm::ivec2 hi = glm::min(last, origin + TILE_SIZE);
+
+            for (int y=lo.y; y <= hi.y; y++) {
+                for (int x=lo.x; x <= hi.x; x++) {
+                    values[point_id(x - first.x, y - first.y)] = samples[t][(y - origin.y) * TILE_SAMPLES + (x - origin.x)];
+                }
+            }
+        }
+
+        compute_range();
+    }
+
+    // range of the finite samples, lo > hi if there are none
+    Interval get_range() const {
+        return range;
+    }
+
+    std::vector<ContourLine> extract(const std::vector<double> &levels, size_t threads = 0) const {
+        const size_t tilesX = (columns + CONTOUR_TILE - 1) / CONTOUR_TILE;
+        const size_t tilesY = (rows + CONTOUR_TILE - 1) / CONTOUR_TILE;
+        const size_t tileCount = tilesX * tilesY;
+        std::vector<Segments> segments(levels.size() * tileCount);
+
+        parallel_for(segments.size(), threads, [&](size_t i) {
+            size_t tile = i % tileCount;
+            segments[i] = march_tile(tile % tilesX, tile / tilesX, levels[i / tileCount]);
+        });
+
+        // tiles are merged in order, so the output doesn't depend on scheduling
+        std::vector<std::vector<ContourLine>> lines(levels.size());
+        parallel_for(levels.size(), threads, [&](size_t level) {
+            Segments merged;
+            for (size_t tile=0; tile != tileCount; tile++) {
+                auto&& s = segments[level * tileCount + tile];
+                merged.insert(merged.end(), s.begin(), s.end());
+            }
+            lines[level] = stitch(merged, levels[level]);
+        });
+
+        std::vector<ContourLine> result;
+        for (auto&& l: lines) {
+            result.insert(result.end(), std::make_move_iterator(l.begin()), std::make_move_iterator(l.end()));
+        }
+        return result;
+    }
+};
+
+// count levels evenly spaced inside range, excluding its ends
+std::vector<double> contour_levels(Interval range, size_t count) {
+    std::vector<double> result;
+    if (range.lo > range.hi)
+        return result;
+
+    for (size_t i=0; i != count; i++) {
+        result.push_back(range.lo + (range.hi - range.lo) * (i + 1) / (count + 1));
+    }
+    return result;
+}
+
+// line strips separated by PRIMITIVE_RESTART_INDEX, at height level in the plane mesh space
+// (x - offset.x, level, y - offset.y), colored by level from blue at range.lo to yellow at range.hi
+GLMesh contour_mesh(const std::vector<ContourLine> &lines, glm::dvec2 offset, Interval range) {
+    GLMesh mesh;
+
+    for (auto&& line: lines) {
+        float t = range.hi > range.lo ? (line.level - range.lo) / (range.hi - range.lo) : 0.5f;
+        glm::vec3 color = glm::mix(glm::vec3 { 0.0f, 0.0f, 1.0f }, glm::vec3 { 1.0f, 1.0f, 0.0f }, t);
+
+        if (!mesh.indices.empty())
+            mesh.indices.push_back(PRIMITIVE_RESTART_INDEX);
+
+        for (auto&& p: line.points) {
+            mesh.indices.push_back(mesh.vertices.size());
+            mesh.vertices.push_back(Vertex {
+                .position = glm::vec3 { p.x - offset.x, line.level, p.y - offset.y },
+                .color = color,
+            });
+        }
+    }
+
+    return mesh;
+}
+
+// writes the lines as SVG polylines, y pointing up
+void write_contours_svg(const std::string &path, const std::vector<ContourLine> &lines, glm::dvec2 min, glm::dvec2 max) {
+    std::ofstream stream(path, std::ios::out);
+    if (!stream.is_open()) {
+        throw std::runtime_error("failed to open svg file " + path);
+    }
+
+    stream << "<svg xmlns=\"http://www.w3.org/2000/svg\" viewBox=\""
+        << min.x << " " << -max.y << " " << max.x - min.x << " " << max.y - min.y << "\">\n";
+    for (auto&& line: lines) {
+        stream << "<polyline fill=\"none\" stroke=\"black\" stroke-width=\"0.1\" data-level=\"" << line.level << "\" points=\"";
+        for (auto&& p: line.points) {
+            stream << p.x << "," << -p.y << " ";
+        }
+        stream << "\"/>\n";
+    }
+    stream << "</svg>\n";
+}
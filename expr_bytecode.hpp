@@ -0,0 +1,672 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expr_parser.hpp"
+#include "fast_math.hpp"
+
+// stack based bytecode for compiled expressions, interpreted on the CPU by evaluate
+// and on the GPU by shaders/plane_bytecode.tese, see OpCode in functions.hpp
+
+// change of the stack depth caused by op
+int stack_effect(OpCode op) {
+    if (op == OpCode::Const || op == OpCode::X || op == OpCode::Y || op == OpCode::Z || op == OpCode::T || op == OpCode::Load)
+        return 1;
+    if (op == OpCode::Neg)
+        return 0;
+    if (const FunctionInfo* function = function_of(op))
+        return 1 - (int)function->arity;
+    return -1;
+}
+
+// size of the evaluation stack in plane_bytecode.tese
+const size_t BYTECODE_MAX_STACK = 32;
+// number of locals in plane_bytecode.tese
+const size_t BYTECODE_MAX_LOCALS = 16;
+
+struct Instruction {
+    OpCode op;
+    // the constant of OpCode::Const, the local of OpCode::Load and OpCode::Store
+    double value;
+};
+
+struct Bytecode {
+    std::vector<Instruction> code;
+    // maximum depth of the stack during evaluation
+    size_t stack_size = 0;
+    // number of locals used by OpCode::Load and OpCode::Store
+    size_t locals = 0;
+};
+
+struct BytecodeError: public std::exception {
+    std::string what;
+
+    BytecodeError(std::string what): what(what) {
+    }
+};
+
+// lets are kept in locals, user functions are compiled once with their parameters in locals
+// [0, arity) and the code is copied to every call, with its locals moved past those in use
+class BytecodeCompiler {
+    Bytecode result {};
+    size_t depth = 0;
+    // locals in use by enclosing lets and the parameters of the function being compiled
+    size_t live = 0;
+    std::unordered_map<const UserFunction*, Bytecode> functions {};
+    // the first error, recorded instead of thrown (see formula_batch.hpp)
+    std::optional<BytecodeError> error {};
+
+    void fail(std::string what) {
+        if (!error)
+            error = BytecodeError(what);
+    }
+
+    void emit(OpCode op, double value, int stack_change) {
+        result.code.push_back(Instruction { .op = op, .value = value });
+        depth += stack_change;
+        if (depth > result.stack_size) {
+            result.stack_size = depth;
+        }
+        if (op == OpCode::Load || op == OpCode::Store) {
+            result.locals = std::max(result.locals, (size_t)value + 1);
+        }
+    }
+
+    const Bytecode& function_code(const UserFunction &function) {
+        auto it = functions.find(&function);
+        if (it != functions.end())
+            return it->second;
+
+        Bytecode caller = std::move(result);
+        size_t callerDepth = depth, callerLive = live;
+
+        result = Bytecode { .locals = function.arity };
+        depth = 0;
+        live = function.arity;
+        compile(function.body.get());
+        Bytecode body = std::move(result);
+
+        result = std::move(caller);
+        depth = callerDepth;
+        live = callerLive;
+        return functions.emplace(&function, std::move(body)).first->second;
+    }
+
+    void compile(const Expression* expr) {
+        if (auto binary = dynamic_cast<const BinaryExpression*>(expr)) {
+            // a > b is compiled as b < a
+            bool swap = binary->op == BinaryOperator::Greater || binary->op == BinaryOperator::GreaterEqual;
+            compile(swap ? binary->right.get() : binary->left.get());
+            compile(swap ? binary->left.get() : binary->right.get());
+            switch (binary->op) {
+                case BinaryOperator::Plus:
+                    return emit(OpCode::Add, 0, -1);
+                case BinaryOperator::Minus:
+                    return emit(OpCode::Sub, 0, -1);
+                case BinaryOperator::Mult:
+                    return emit(OpCode::Mul, 0, -1);
+                case BinaryOperator::Div:
+                    return emit(OpCode::Div, 0, -1);
+                case BinaryOperator::Power:
+                    return emit(OpCode::Pow, 0, -1);
+                case BinaryOperator::Less:
+                case BinaryOperator::Greater:
+                    return emit(OpCode::Less, 0, -1);
+                case BinaryOperator::LessEqual:
+                case BinaryOperator::GreaterEqual:
+                    return emit(OpCode::LessEqual, 0, -1);
+            }
+        } else if (auto unary = dynamic_cast<const UnaryExpression*>(expr)) {
+            compile(unary->expr.get());
+            switch (unary->op) {
+                case UnaryOperator::Minus:
+                    return emit(OpCode::Neg, 0, 0);
+            }
+        } else if (auto call = dynamic_cast<const FunctionCall*>(expr)) {
+            for (auto&& arg: call->exprs) {
+                compile(arg.get());
+            }
+
+            return emit(call->function->op, 0, 1 - (int)call->exprs.size());
+        } else if (auto call = dynamic_cast<const UserCall*>(expr)) {
+            for (auto&& arg: call->exprs) {
+                compile(arg.get());
+            }
+            for (size_t i=call->exprs.size(); i != 0; i--) {
+                emit(OpCode::Store, live + i - 1, -1);
+            }
+
+            const Bytecode& body = function_code(*call->function);
+            for (auto&& ins: body.code) {
+                bool local = ins.op == OpCode::Load || ins.op == OpCode::Store;
+                emit(ins.op, local ? ins.value + live : ins.value, stack_effect(ins.op));
+            }
+            return;
+        } else if (auto let = dynamic_cast<const Let*>(expr)) {
+            compile(let->value.get());
+            emit(OpCode::Store, let->slot, -1);
+
+            size_t enclosing = live;
+            live = let->slot + 1;
+            compile(let->body.get());
+            live = enclosing;
+            return;
+        } else if (auto local = dynamic_cast<const Local*>(expr)) {
+            return emit(OpCode::Load, local->slot, 1);
+        } else if (auto cnst = dynamic_cast<const Const*>(expr)) {
+            if (const ConstantInfo* constant = find_constant(cnst->name))
+                return emit(constant->op, constant->value, 1);
+
+            return fail("unsupported constant " + cnst->name);
+        } else if (auto number = dynamic_cast<const Number*>(expr)) {
+            return emit(OpCode::Const, number->get_value(), 1);
+        } else if (auto grouping = dynamic_cast<const Grouping*>(expr)) {
+            return compile(grouping->expr.get());
+        }
+
+        fail("unsupported expression " + expr->to_string());
+    }
+
+public:
+    std::optional<BytecodeError> try_compile(const Expression& expr, Bytecode& out) {
+        result = Bytecode {};
+        depth = 0;
+        live = 0;
+        functions.clear();
+        error.reset();
+
+        compile(&expr);
+
+        if (result.stack_size > BYTECODE_MAX_STACK) {
+            fail("expression too deeply nested, needs stack of size " +
+                    std::to_string(result.stack_size) + " max " + std::to_string(BYTECODE_MAX_STACK));
+        }
+        if (result.locals > BYTECODE_MAX_LOCALS) {
+            fail("too many nested lets and function calls, needs " +
+                    std::to_string(result.locals) + " locals max " + std::to_string(BYTECODE_MAX_LOCALS));
+        }
+
+        if (!error)
+            out = std::move(result);
+        return error;
+    }
+
+    Bytecode compile(const Expression& expr) {
+        Bytecode bytecode;
+        if (auto error = try_compile(expr, bytecode))
+            throw *error;
+        return bytecode;
+    }
+};
+
+Bytecode compile_bytecode(const Expression& expr) {
+    return BytecodeCompiler().compile(expr);
+}
+
+double evaluate(const Bytecode& bytecode, double x, double y, double z, double t);
+
+// operations fold_constants may evaluate ahead of time: those GLSL defines exactly (correctly
+// rounded arithmetic, min, max, rounding, comparisons), so the folded constant, computed in double
+// and rounded once to float on the GPU, is within float rounding of what the GPU would compute.
+// the gc_ wrappers (sin, pow, exp, ...) are approximated on the GPU depending on the math tier and
+// division and sqrt aren't correctly rounded in GLSL, folding them would bake in values of the CPU
+bool is_foldable(OpCode op) {
+    switch (op) {
+        case OpCode::Add: case OpCode::Sub: case OpCode::Mul: case OpCode::Neg:
+        case OpCode::Min: case OpCode::Max: case OpCode::Floor: case OpCode::Ceil:
+        case OpCode::Abs: case OpCode::Sign:
+        case OpCode::Less: case OpCode::LessEqual: case OpCode::Select:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// replaces operations whose operands are all constants with their results (see is_foldable),
+// evaluated by evaluate in double precision, e.g. 2*pi*x compiles to (Const 2, Const pi, Mul, X, Mul)
+// and folds to (Const 2pi, X, Mul), while sin(1)*x keeps the Sin
+Bytecode fold_constants(const Bytecode& bytecode) {
+    Bytecode result {};
+
+    for (auto&& ins: bytecode.code) {
+        int effect = stack_effect(ins.op);
+        // operands of the operation are the values pushed by the last 1 - effect instructions
+        size_t operands = effect == 1 ? 0 : 1 - effect;
+        bool constant = is_foldable(ins.op) && operands != 0 && result.code.size() >= operands;
+        for (size_t i=0; constant && i != operands; i++) {
+            constant = result.code[result.code.size() - 1 - i].op == OpCode::Const;
+        }
+
+        if (constant) {
+            Bytecode operation { .code = { result.code.end() - operands, result.code.end() }, .stack_size = operands };
+            operation.code.push_back(ins);
+            double value = evaluate(operation, 0.0, 0.0, 0.0, 0.0);
+            result.code.resize(result.code.size() - operands);
+            result.code.push_back(Instruction { .op = OpCode::Const, .value = value });
+        } else {
+            result.code.push_back(ins);
+        }
+    }
+
+    // folded constants never deepen the stack, but they may have been the deepest point
+    result.locals = bytecode.locals;
+    size_t depth = 0;
+    for (auto&& ins: result.code) {
+        depth += stack_effect(ins.op);
+        result.stack_size = std::max(result.stack_size, depth);
+    }
+
+    return result;
+}
+
+// checks bytecode which didn't come from BytecodeCompiler (e.g. loaded from a file) before it's
+// evaluated, the interpreters don't check opcodes or stack bounds
+void verify_bytecode(const Bytecode& bytecode) {
+    size_t depth = 0, max_depth = 0;
+    for (auto&& ins: bytecode.code) {
+        if ((int32_t)ins.op < 0 || (int32_t)ins.op >= OPCODE_COUNT)
+            throw BytecodeError("invalid opcode " + std::to_string((int32_t)ins.op));
+
+        if (ins.op == OpCode::Load || ins.op == OpCode::Store) {
+            if (!(ins.value >= 0.0 && ins.value < bytecode.locals && ins.value == std::floor(ins.value)))
+                throw BytecodeError("invalid local " + std::to_string(ins.value));
+        }
+
+        int effect = stack_effect(ins.op);
+        // operations pop 1 - effect operands and push the result, stores pop one
+        size_t needed = ins.op == OpCode::Store ? 1 : effect <= 0 ? 1 - effect : 0;
+        if (depth < needed)
+            throw BytecodeError("stack underflow");
+
+        depth += effect;
+        max_depth = std::max(max_depth, depth);
+    }
+
+    if (depth != 1)
+        throw BytecodeError("expression leaves " + std::to_string(depth) + " values on the stack");
+    if (max_depth != bytecode.stack_size)
+        throw BytecodeError("wrong stack size");
+    if (max_depth > BYTECODE_MAX_STACK)
+        throw BytecodeError("expression too deep, needs stack of " + std::to_string(max_depth));
+    if (bytecode.locals > BYTECODE_MAX_LOCALS)
+        throw BytecodeError("too many locals " + std::to_string(bytecode.locals));
+}
+
+bool uses_op(const Bytecode& bytecode, OpCode op) {
+    for (auto&& ins: bytecode.code) {
+        if (ins.op == op)
+            return true;
+    }
+    return false;
+}
+
+// formulas using z describe implicit surfaces f(x, y, z) = 0 instead of height fields
+bool is_implicit(const Bytecode& bytecode) {
+    return uses_op(bytecode, OpCode::Z);
+}
+
+// formulas using t change over time and have to be drawn again every frame while playing
+bool is_animated(const Bytecode& bytecode) {
+    return uses_op(bytecode, OpCode::T);
+}
+
+// scalar reference interpreter, mirrors plane_bytecode.tese but evaluates in double precision
+double evaluate(const Bytecode& bytecode, double x, double y, double z = 0.0, double t = 0.0) {
+    double stack[BYTECODE_MAX_STACK];
+    double locals[BYTECODE_MAX_LOCALS];
+    size_t sp = 0;
+
+    for (auto&& ins: bytecode.code) {
+        double b;
+        switch (ins.op) {
+            case OpCode::Const: stack[sp++] = ins.value; break;
+            case OpCode::X: stack[sp++] = x; break;
+            case OpCode::Y: stack[sp++] = y; break;
+            case OpCode::Z: stack[sp++] = z; break;
+            case OpCode::T: stack[sp++] = t; break;
+            case OpCode::Load: stack[sp++] = locals[(size_t)ins.value]; break;
+            case OpCode::Store: locals[(size_t)ins.value] = stack[--sp]; break;
+
+            case OpCode::Add: b = stack[--sp]; stack[sp-1] += b; break;
+            case OpCode::Sub: b = stack[--sp]; stack[sp-1] -= b; break;
+            case OpCode::Mul: b = stack[--sp]; stack[sp-1] *= b; break;
+            case OpCode::Div: b = stack[--sp]; stack[sp-1] /= b; break;
+            case OpCode::Pow: b = stack[--sp]; stack[sp-1] = std::pow(stack[sp-1], b); break;
+            // GLSL mod, the result has the sign of the divisor
+            case OpCode::Mod: b = stack[--sp]; stack[sp-1] -= b * std::floor(stack[sp-1] / b); break;
+            case OpCode::Min: b = stack[--sp]; stack[sp-1] = std::min(stack[sp-1], b); break;
+            case OpCode::Max: b = stack[--sp]; stack[sp-1] = std::max(stack[sp-1], b); break;
+            case OpCode::Less: b = stack[--sp]; stack[sp-1] = stack[sp-1] < b ? 1.0 : 0.0; break;
+            case OpCode::LessEqual: b = stack[--sp]; stack[sp-1] = stack[sp-1] <= b ? 1.0 : 0.0; break;
+            case OpCode::Select: sp -= 2; stack[sp-1] = stack[sp-1] != 0.0 ? stack[sp] : stack[sp+1]; break;
+
+            case OpCode::Neg: stack[sp-1] = -stack[sp-1]; break;
+            case OpCode::Sin: stack[sp-1] = std::sin(stack[sp-1]); break;
+            case OpCode::Cos: stack[sp-1] = std::cos(stack[sp-1]); break;
+            case OpCode::Tan: stack[sp-1] = std::tan(stack[sp-1]); break;
+            case OpCode::Asin: stack[sp-1] = std::asin(stack[sp-1]); break;
+            case OpCode::Acos: stack[sp-1] = std::acos(stack[sp-1]); break;
+            case OpCode::Atan: stack[sp-1] = std::atan(stack[sp-1]); break;
+            case OpCode::Sinh: stack[sp-1] = std::sinh(stack[sp-1]); break;
+            case OpCode::Cosh: stack[sp-1] = std::cosh(stack[sp-1]); break;
+            case OpCode::Tanh: stack[sp-1] = std::tanh(stack[sp-1]); break;
+            case OpCode::Asinh: stack[sp-1] = std::asinh(stack[sp-1]); break;
+            case OpCode::Acosh: stack[sp-1] = std::acosh(stack[sp-1]); break;
+            case OpCode::Atanh: stack[sp-1] = std::atanh(stack[sp-1]); break;
+            case OpCode::Exp: stack[sp-1] = std::exp(stack[sp-1]); break;
+            case OpCode::Log: stack[sp-1] = std::log(stack[sp-1]); break;
+            case OpCode::Exp2: stack[sp-1] = std::exp2(stack[sp-1]); break;
+            case OpCode::Log2: stack[sp-1] = std::log2(stack[sp-1]); break;
+            case OpCode::Floor: stack[sp-1] = std::floor(stack[sp-1]); break;
+            case OpCode::Ceil: stack[sp-1] = std::ceil(stack[sp-1]); break;
+            case OpCode::Abs: stack[sp-1] = std::abs(stack[sp-1]); break;
+            case OpCode::InverseSqrt: stack[sp-1] = 1.0 / std::sqrt(stack[sp-1]); break;
+            case OpCode::Sqrt: stack[sp-1] = std::sqrt(stack[sp-1]); break;
+
+            // functions without a case of their own go through their kernel
+            default: {
+                const FunctionInfo* function = function_of(ins.op);
+                if (function->arity == 3) {
+                    sp -= 2;
+                    stack[sp-1] = function->ternary(stack[sp-1], stack[sp], stack[sp+1]);
+                } else if (function->arity == 2) {
+                    b = stack[--sp];
+                    stack[sp-1] = function->binary(stack[sp-1], b);
+                } else {
+                    stack[sp-1] = function->unary(stack[sp-1]);
+                }
+                break;
+            }
+        }
+    }
+
+    return sp == 0 ? 0.0 : stack[0];
+}
+
+// number of points evaluate_batch processes per instruction
+const size_t BATCH_SIZE = 64;
+
+// evaluates n points at once, executing each instruction over a whole batch of points so
+// that the per-instruction loops are vectorized by the compiler, tiers other than exact evaluate
+// transcendental functions like the GPU pipelines of the same tier, see fast_math.hpp
+void evaluate_batch(const Bytecode& bytecode, const double* x, const double* y, const double* z, double* out, size_t n,
+        double t = 0.0, MathTier tier = MathTier::Exact) {
+    double stack[BYTECODE_MAX_STACK][BATCH_SIZE];
+    double locals[BYTECODE_MAX_LOCALS][BATCH_SIZE];
+
+    for (size_t start=0; start < n; start += BATCH_SIZE) {
+        const size_t count = std::min(BATCH_SIZE, n - start);
+        size_t sp = 0;
+
+        for (auto&& ins: bytecode.code) {
+            // b is the top of the stack, the operand of unary ops and the right operand of binary ones
+            double* a = sp >= 2 ? stack[sp-2] : nullptr;
+            double* b = sp >= 1 ? stack[sp-1] : nullptr;
+
+            if (tier != MathTier::Exact && fast_math_batch(tier, ins.op, a, b, count)) {
+                if (ins.op == OpCode::Pow)
+                    sp--;
+                continue;
+            }
+
+#define BATCH_LOAD(expr) do { double* r = stack[sp++]; for (size_t i=0; i != count; i++) r[i] = (expr); } while (0)
+#define BATCH_BINARY(expr) do { for (size_t i=0; i != count; i++) a[i] = (expr); sp--; } while (0)
+#define BATCH_UNARY(expr) do { for (size_t i=0; i != count; i++) b[i] = (expr); } while (0)
+            switch (ins.op) {
+                case OpCode::Const: BATCH_LOAD(ins.value); break;
+                case OpCode::X: BATCH_LOAD(x[start + i]); break;
+                case OpCode::Y: BATCH_LOAD(y[start + i]); break;
+                case OpCode::Z: BATCH_LOAD(z ? z[start + i] : 0.0); break;
+                case OpCode::T: BATCH_LOAD(t); break;
+                case OpCode::Load: BATCH_LOAD(locals[(size_t)ins.value][i]); break;
+                case OpCode::Store: std::copy(b, b + count, locals[(size_t)ins.value]); sp--; break;
+
+                case OpCode::Add: BATCH_BINARY(a[i] + b[i]); break;
+                case OpCode::Sub: BATCH_BINARY(a[i] - b[i]); break;
+                case OpCode::Mul: BATCH_BINARY(a[i] * b[i]); break;
+                case OpCode::Div: BATCH_BINARY(a[i] / b[i]); break;
+                case OpCode::Pow: BATCH_BINARY(std::pow(a[i], b[i])); break;
+                case OpCode::Mod: BATCH_BINARY(a[i] - b[i] * std::floor(a[i] / b[i])); break;
+                case OpCode::Min: BATCH_BINARY(std::min(a[i], b[i])); break;
+                case OpCode::Max: BATCH_BINARY(std::max(a[i], b[i])); break;
+                // compiled to vector compares and masks, or blends for Select
+                case OpCode::Less: BATCH_BINARY(a[i] < b[i] ? 1.0 : 0.0); break;
+                case OpCode::LessEqual: BATCH_BINARY(a[i] <= b[i] ? 1.0 : 0.0); break;
+                case OpCode::Select: {
+                    double* c = stack[sp-3];
+                    for (size_t i=0; i != count; i++) c[i] = c[i] != 0.0 ? a[i] : b[i];
+                    sp -= 2;
+                    break;
+                }
+
+                case OpCode::Neg: BATCH_UNARY(-b[i]); break;
+                case OpCode::Sin: BATCH_UNARY(std::sin(b[i])); break;
+                case OpCode::Cos: BATCH_UNARY(std::cos(b[i])); break;
+                case OpCode::Tan: BATCH_UNARY(std::tan(b[i])); break;
+                case OpCode::Asin: BATCH_UNARY(std::asin(b[i])); break;
+                case OpCode::Acos: BATCH_UNARY(std::acos(b[i])); break;
+                case OpCode::Atan: BATCH_UNARY(std::atan(b[i])); break;
+                case OpCode::Sinh: BATCH_UNARY(std::sinh(b[i])); break;
+                case OpCode::Cosh: BATCH_UNARY(std::cosh(b[i])); break;
+                case OpCode::Tanh: BATCH_UNARY(std::tanh(b[i])); break;
+                case OpCode::Asinh: BATCH_UNARY(std::asinh(b[i])); break;
+                case OpCode::Acosh: BATCH_UNARY(std::acosh(b[i])); break;
+                case OpCode::Atanh: BATCH_UNARY(std::atanh(b[i])); break;
+                case OpCode::Exp: BATCH_UNARY(std::exp(b[i])); break;
+                case OpCode::Log: BATCH_UNARY(std::log(b[i])); break;
+                case OpCode::Exp2: BATCH_UNARY(std::exp2(b[i])); break;
+                case OpCode::Log2: BATCH_UNARY(std::log2(b[i])); break;
+                case OpCode::Floor: BATCH_UNARY(std::floor(b[i])); break;
+                case OpCode::Ceil: BATCH_UNARY(std::ceil(b[i])); break;
+                case OpCode::Abs: BATCH_UNARY(std::abs(b[i])); break;
+                case OpCode::InverseSqrt: BATCH_UNARY(1.0 / std::sqrt(b[i])); break;
+                case OpCode::Sqrt: BATCH_UNARY(std::sqrt(b[i])); break;
+
+                default: {
+                    const FunctionInfo* function = function_of(ins.op);
+                    if (function->arity == 3) {
+                        auto kernel = function->ternary;
+                        double* c = stack[sp-3];
+                        for (size_t i=0; i != count; i++) c[i] = kernel(c[i], a[i], b[i]);
+                        sp -= 2;
+                    } else if (function->arity == 2) {
+                        auto kernel = function->binary;
+                        BATCH_BINARY(kernel(a[i], b[i]));
+                    } else {
+                        auto kernel = function->unary;
+                        BATCH_UNARY(kernel(b[i]));
+                    }
+                    break;
+                }
+            }
+#undef BATCH_LOAD
+#undef BATCH_BINARY
+#undef BATCH_UNARY
+        }
+
+        for (size_t i=0; i != count; i++) {
+            out[start + i] = sp == 0 ? 0.0 : stack[0][i];
+        }
+    }
+}
+
+// closed interval [lo, hi], possibly unbounded
+struct Interval {
+    double lo;
+    double hi;
+
+    static Interval entire() {
+        return Interval { -INFINITY, INFINITY };
+    }
+
+    bool contains(double v) const {
+        return lo <= v && v <= hi;
+    }
+};
+
+Interval interval_monotone(Interval a, double (*f)(double), bool increasing) {
+    double lo = f(a.lo), hi = f(a.hi);
+    if (std::isnan(lo) || std::isnan(hi))
+        return Interval::entire();
+    return increasing ? Interval { lo, hi } : Interval { hi, lo };
+}
+
+Interval interval_mul(Interval a, Interval b) {
+    double p[] = { a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi };
+    for (double v: p) {
+        // 0 * inf
+        if (std::isnan(v))
+            return Interval::entire();
+    }
+    return Interval { *std::min_element(p, p + 4), *std::max_element(p, p + 4) };
+}
+
+Interval interval_sin(Interval a) {
+    if (!(a.hi - a.lo < 2.0 * M_PI))
+        return Interval { -1.0, 1.0 };
+
+    double lo = std::min(std::sin(a.lo), std::sin(a.hi));
+    double hi = std::max(std::sin(a.lo), std::sin(a.hi));
+    // maxima at pi/2 + 2k*pi, minima at -pi/2 + 2k*pi
+    if (std::floor((a.hi - M_PI / 2.0) / (2.0 * M_PI)) != std::floor((a.lo - M_PI / 2.0) / (2.0 * M_PI)))
+        hi = 1.0;
+    if (std::floor((a.hi + M_PI / 2.0) / (2.0 * M_PI)) != std::floor((a.lo + M_PI / 2.0) / (2.0 * M_PI)))
+        lo = -1.0;
+    return Interval { lo, hi };
+}
+
+// conservative bounds of the formula over a box, used to skip regions that can't contain a root
+Interval evaluate_interval(const Bytecode& bytecode, Interval x, Interval y, Interval z = Interval { 0.0, 0.0 }, double t = 0.0) {
+    Interval stack[BYTECODE_MAX_STACK];
+    Interval locals[BYTECODE_MAX_LOCALS];
+    size_t sp = 0;
+
+    for (auto&& ins: bytecode.code) {
+        Interval b, &a = stack[sp > 0 ? sp - 1 : 0];
+        switch (ins.op) {
+            case OpCode::Const: stack[sp++] = Interval { ins.value, ins.value }; break;
+            case OpCode::X: stack[sp++] = x; break;
+            case OpCode::Y: stack[sp++] = y; break;
+            case OpCode::Z: stack[sp++] = z; break;
+            case OpCode::T: stack[sp++] = Interval { t, t }; break;
+            case OpCode::Load: stack[sp++] = locals[(size_t)ins.value]; break;
+            case OpCode::Store: locals[(size_t)ins.value] = stack[--sp]; break;
+
+            case OpCode::Add: b = stack[--sp]; stack[sp-1] = Interval { stack[sp-1].lo + b.lo, stack[sp-1].hi + b.hi }; break;
+            case OpCode::Sub: b = stack[--sp]; stack[sp-1] = Interval { stack[sp-1].lo - b.hi, stack[sp-1].hi - b.lo }; break;
+            case OpCode::Mul: b = stack[--sp]; stack[sp-1] = interval_mul(stack[sp-1], b); break;
+            case OpCode::Div:
+                b = stack[--sp];
+                stack[sp-1] = b.contains(0.0) ? Interval::entire() : interval_mul(stack[sp-1], Interval { 1.0 / b.hi, 1.0 / b.lo });
+                break;
+            case OpCode::Pow:
+                b = stack[--sp];
+                if (b.lo == b.hi && b.lo == std::floor(b.lo) && b.lo >= 0.0) {
+                    // integer power, even powers are not monotone around 0
+                    double plo = std::pow(stack[sp-1].lo, b.lo), phi = std::pow(stack[sp-1].hi, b.lo);
+                    Interval r { std::min(plo, phi), std::max(plo, phi) };
+                    if (std::fmod(b.lo, 2.0) == 0.0 && stack[sp-1].contains(0.0))
+                        r.lo = 0.0;
+                    stack[sp-1] = r;
+                } else if (stack[sp-1].lo > 0.0) {
+                    double p[] = {
+                        std::pow(stack[sp-1].lo, b.lo), std::pow(stack[sp-1].lo, b.hi),
+                        std::pow(stack[sp-1].hi, b.lo), std::pow(stack[sp-1].hi, b.hi),
+                    };
+                    stack[sp-1] = Interval { *std::min_element(p, p + 4), *std::max_element(p, p + 4) };
+                } else {
+                    stack[sp-1] = Interval::entire();
+                }
+                break;
+            case OpCode::Mod:
+                b = stack[--sp];
+                stack[sp-1] = b.lo > 0.0 ? Interval { 0.0, b.hi } : Interval::entire();
+                break;
+            case OpCode::Min: b = stack[--sp]; stack[sp-1] = Interval { std::min(stack[sp-1].lo, b.lo), std::min(stack[sp-1].hi, b.hi) }; break;
+            case OpCode::Max: b = stack[--sp]; stack[sp-1] = Interval { std::max(stack[sp-1].lo, b.lo), std::max(stack[sp-1].hi, b.hi) }; break;
+
+            case OpCode::Neg: a = Interval { -a.hi, -a.lo }; break;
+            case OpCode::Sin: a = interval_sin(a); break;
+            case OpCode::Cos: a = interval_sin(Interval { a.lo + M_PI / 2.0, a.hi + M_PI / 2.0 }); break;
+            case OpCode::Tan:
+                // poles at pi/2 + k*pi
+                a = std::floor((a.lo - M_PI / 2.0) / M_PI) != std::floor((a.hi - M_PI / 2.0) / M_PI) || !(a.hi - a.lo < M_PI)
+                    ? Interval::entire() : interval_monotone(a, std::tan, true);
+                break;
+            case OpCode::Asin: a = interval_monotone(Interval { std::max(a.lo, -1.0), std::min(a.hi, 1.0) }, std::asin, true); break;
+            case OpCode::Acos: a = interval_monotone(Interval { std::max(a.lo, -1.0), std::min(a.hi, 1.0) }, std::acos, false); break;
+            case OpCode::Atan: a = interval_monotone(a, std::atan, true); break;
+            case OpCode::Sinh: a = interval_monotone(a, std::sinh, true); break;
+            case OpCode::Cosh:
+                a = Interval {
+                    a.contains(0.0) ? 1.0 : std::min(std::cosh(a.lo), std::cosh(a.hi)),
+                    std::max(std::cosh(a.lo), std::cosh(a.hi))
+                };
+                break;
+            case OpCode::Tanh: a = interval_monotone(a, std::tanh, true); break;
+            case OpCode::Asinh: a = interval_monotone(a, std::asinh, true); break;
+            case OpCode::Acosh: a = interval_monotone(Interval { std::max(a.lo, 1.0), std::max(a.hi, 1.0) }, std::acosh, true); break;
+            case OpCode::Atanh: a = interval_monotone(Interval { std::max(a.lo, -1.0), std::min(a.hi, 1.0) }, std::atanh, true); break;
+            case OpCode::Exp: a = interval_monotone(a, std::exp, true); break;
+            case OpCode::Log: a = interval_monotone(Interval { std::max(a.lo, 0.0), std::max(a.hi, 0.0) }, std::log, true); break;
+            case OpCode::Exp2: a = interval_monotone(a, std::exp2, true); break;
+            case OpCode::Log2: a = interval_monotone(Interval { std::max(a.lo, 0.0), std::max(a.hi, 0.0) }, std::log2, true); break;
+            case OpCode::Floor: a = interval_monotone(a, std::floor, true); break;
+            case OpCode::Ceil: a = interval_monotone(a, std::ceil, true); break;
+            case OpCode::Abs:
+                a = a.contains(0.0)
+                    ? Interval { 0.0, std::max(-a.lo, a.hi) }
+                    : Interval { std::min(std::abs(a.lo), std::abs(a.hi)), std::max(std::abs(a.lo), std::abs(a.hi)) };
+                break;
+            case OpCode::InverseSqrt:
+                a = a.hi <= 0.0 ? Interval::entire() : Interval { 1.0 / std::sqrt(a.hi), a.lo <= 0.0 ? INFINITY : 1.0 / std::sqrt(a.lo) };
+                break;
+            case OpCode::Sqrt: a = interval_monotone(Interval { std::max(a.lo, 0.0), std::max(a.hi, 0.0) }, std::sqrt, true); break;
+            case OpCode::Sign: a = Interval { a.lo > 0.0 ? 1.0 : a.lo < 0.0 ? -1.0 : 0.0, a.hi > 0.0 ? 1.0 : a.hi < 0.0 ? -1.0 : 0.0 }; break;
+            case OpCode::Hypot: {
+                b = stack[--sp];
+                Interval& c = stack[sp-1];
+                // distances of the intervals from 0
+                auto nearest = [](Interval v) { return v.contains(0.0) ? 0.0 : std::min(std::abs(v.lo), std::abs(v.hi)); };
+                auto farthest = [](Interval v) { return std::max(std::abs(v.lo), std::abs(v.hi)); };
+                c = Interval { std::hypot(nearest(c), nearest(b)), std::hypot(farthest(c), farthest(b)) };
+                break;
+            }
+
+            case OpCode::Atan2: sp--; stack[sp-1] = Interval { -M_PI, M_PI }; break;
+            case OpCode::Less:
+                b = stack[--sp];
+                stack[sp-1] = stack[sp-1].hi < b.lo ? Interval { 1.0, 1.0 } : stack[sp-1].lo >= b.hi ? Interval { 0.0, 0.0 } : Interval { 0.0, 1.0 };
+                break;
+            case OpCode::LessEqual:
+                b = stack[--sp];
+                stack[sp-1] = stack[sp-1].hi <= b.lo ? Interval { 1.0, 1.0 } : stack[sp-1].lo > b.hi ? Interval { 0.0, 0.0 } : Interval { 0.0, 1.0 };
+                break;
+            case OpCode::Select: {
+                sp -= 2;
+                Interval c = stack[sp-1], t = stack[sp], f = stack[sp+1];
+                if (!c.contains(0.0)) {
+                    stack[sp-1] = t;
+                } else if (c.lo == 0.0 && c.hi == 0.0) {
+                    stack[sp-1] = f;
+                } else {
+                    stack[sp-1] = Interval { std::min(t.lo, f.lo), std::max(t.hi, f.hi) };
+                }
+                break;
+            }
+
+            // functions without interval rules, binary ones still pop their second operand
+            default:
+                sp += stack_effect(ins.op);
+                stack[sp-1] = Interval::entire();
+                break;
+        }
+    }
+
+    return sp == 0 ? Interval { 0.0, 0.0 } : stack[0];
+}
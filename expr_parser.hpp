@@ -1,41 +1,17 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <exception>
+#include <initializer_list>
 #include <memory>
+#include <optional>
 
-const std::vector<std::pair<std::string, size_t>> FUNCTIONS = {
-    {"sin", 1},
-    {"cos", 1},
-    {"tan", 1},
-    {"asin", 1},
-    {"acos", 1},
-    {"atan", 1},
-    {"sinh", 1},
-    {"cosh", 1},
-    {"tanh", 1},
-    {"asinh", 1},
-    {"acosh", 1},
-    {"atanh", 1},
-    {"exp", 1},
-    {"log", 1},
-    {"exp2", 1},
-    {"log2", 1},
-};
-
-const std::vector<std::pair<std::string, size_t>> BUILTIN_FUNCTIONS = {
-    {"mod", 2},
-    {"min", 2},
-    {"max", 2},
-    {"floor", 1},
-    {"ceil", 1},
-    {"abs", 1},
-    {"inversesqrt", 1},
-    {"sqrt", 1},
-};
-
-const std::vector<std::string> BUILTIN_CONSTS = {
-    "x", "y", "pi", "e"
-};
+#include "functions.hpp"
 
 enum class TokenType {
     Identifier,
@@ -48,6 +24,12 @@ enum class TokenType {
     Comma,
     ParenStart,
     ParenEnd,
+    Equals,
+    Semicolon,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
 };
 
 std::string to_string(TokenType tok) {
@@ -72,7 +54,20 @@ std::string to_string(TokenType tok) {
             return "ParenStart";
         case TokenType::ParenEnd:
             return "ParenEnd";
+        case TokenType::Equals:
+            return "Equals";
+        case TokenType::Semicolon:
+            return "Semicolon";
+        case TokenType::Less:
+            return "Less";
+        case TokenType::LessEqual:
+            return "LessEqual";
+        case TokenType::Greater:
+            return "Greater";
+        case TokenType::GreaterEqual:
+            return "GreaterEqual";
     }
+    return "unknown";
 }
 
 struct Token {
@@ -94,17 +89,21 @@ struct TokenizerError: public std::exception {
     }
 };
 
-std::vector<Token> tokenize(std::string expr) {
-    std::vector<Token> result {};
+// appends the tokens of expr to result, returns the error instead of throwing it, so that
+// invalid input is cheap to reject (see formula_batch.hpp)
+std::optional<TokenizerError> try_tokenize(const std::string &expr, std::vector<Token> &result) {
     std::string curr_token = "";
     ExpectedTokenType curr_token_type = ExpectedTokenType::None;
 
     size_t i = 0;
     while (i < expr.size()) {
-        if ((expr[i] >= 'a' && expr[i] <= 'z') || (expr[i] >= 'A' && expr[i] <= 'Z') || expr[i] == '_') {
+        // digits continue identifiers, e.g. log2, but never start them
+        bool digit = expr[i] >= '0' && expr[i] <= '9';
+        if ((expr[i] >= 'a' && expr[i] <= 'z') || (expr[i] >= 'A' && expr[i] <= 'Z') || expr[i] == '_'
+                || (digit && curr_token_type == ExpectedTokenType::Identifier)) {
             if (curr_token_type == ExpectedTokenType::Number) {
                 if (curr_token == ".")
-                    throw TokenizerError("invalid number", i);
+                    return TokenizerError("invalid number", i);
 
                 curr_token_type = ExpectedTokenType::None;
                 result.push_back(Token { .type = TokenType::Number, .token = curr_token });
@@ -123,7 +122,7 @@ std::vector<Token> tokenize(std::string expr) {
 
         if ((expr[i] >= '0' && expr[i] <= '9') || expr[i] == '.') {
             if (expr[i] == '.' && curr_token.find('.') != std::string::npos) {
-                throw TokenizerError("two dots in number", i);
+                return TokenizerError("two dots in number", i);
             }
 
             if (curr_token_type == ExpectedTokenType::Identifier) {
@@ -138,7 +137,7 @@ std::vector<Token> tokenize(std::string expr) {
             continue;
         } else if (curr_token_type == ExpectedTokenType::Number) {
             if (curr_token == ".")
-                throw TokenizerError("invalid number", i);
+                return TokenizerError("invalid number", i);
 
             curr_token_type = ExpectedTokenType::None;
             result.push_back(Token { .type = TokenType::Number, .token = curr_token });
@@ -157,6 +156,19 @@ std::vector<Token> tokenize(std::string expr) {
             result.push_back(Token { .type = TokenType::ParenEnd });
         } else if (expr[i] == ',') {
             result.push_back(Token { .type = TokenType::Comma });
+        } else if (expr[i] == '=') {
+            result.push_back(Token { .type = TokenType::Equals });
+        } else if (expr[i] == ';') {
+            result.push_back(Token { .type = TokenType::Semicolon });
+        } else if (expr[i] == '<' || expr[i] == '>') {
+            bool orEqual = i+1 < expr.size() && expr[i+1] == '=';
+            if (expr[i] == '<') {
+                result.push_back(Token { .type = orEqual ? TokenType::LessEqual : TokenType::Less });
+            } else {
+                result.push_back(Token { .type = orEqual ? TokenType::GreaterEqual : TokenType::Greater });
+            }
+            if (orEqual)
+                i++;
         } else if (expr[i] == '*') {
             if (i+1 < expr.size() && expr[i+1] == '*') {
                 result.push_back(Token { .type = TokenType::Power });
@@ -173,25 +185,86 @@ std::vector<Token> tokenize(std::string expr) {
         result.push_back(Token { .type = TokenType::Identifier, .token = curr_token });
     } else if (curr_token_type == ExpectedTokenType::Number) {
         if (curr_token == ".")
-            throw TokenizerError("invalid number", i);
+            return TokenizerError("invalid number", i);
 
         result.push_back(Token { .type = TokenType::Number, .token = curr_token });
     }
 
+    return std::nullopt;
+}
+
+std::vector<Token> tokenize(std::string expr) {
+    std::vector<Token> result {};
+    if (auto error = try_tokenize(expr, result))
+        throw *error;
     return result;
 }
 
+// hashes of expressions are built up from these, they must not change between runs
+uint64_t hash_mix(uint64_t seed, uint64_t value) {
+    // splitmix64 finalizer
+    uint64_t z = seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// FNV-1a
+uint64_t hash_string(const std::string &s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (char c: s) {
+        h = (h ^ (uint8_t)c) * 0x100000001b3ull;
+    }
+    return h;
+}
+
 struct Expression {
+    // structural hash, equal for expressions which differ only in grouping, spelling of number
+    // literals or order of commutative operands, computed when the node is built by the parser
+    uint64_t hash = 0;
+
     virtual std::string to_string() const = 0;
+    // structural equality, true for expressions with the same canonical form
+    virtual bool equals(const Expression &other) const = 0;
+    // prefix serialization, identical for structurally equal expressions
+    virtual std::string canonical() const = 0;
     virtual ~Expression() {};
 };
 
+struct Grouping;
+const Expression& ungrouped(const Expression &expr);
+
+// canonical forms of operands a and b, ordered by hash if the operation is commutative
+std::string canonical_operands(const Expression &a, const Expression &b, bool commutative) {
+    std::string ca = a.canonical();
+    std::string cb = b.canonical();
+    if (commutative && std::make_pair(b.hash, cb) < std::make_pair(a.hash, ca))
+        std::swap(ca, cb);
+    return ca + " " + cb;
+}
+
+bool equal_operands(const Expression &a, const Expression &b, const Expression &oa, const Expression &ob, bool commutative) {
+    return (a.equals(oa) && b.equals(ob)) || (commutative && a.equals(ob) && b.equals(oa));
+}
+
+// hash of a node with the given tag and operand hashes, independent of their order if commutative
+uint64_t hash_operands(uint64_t tag, uint64_t a, uint64_t b, bool commutative) {
+    if (commutative && b < a)
+        std::swap(a, b);
+    return hash_mix(hash_mix(tag, a), b);
+}
+
 enum class BinaryOperator {
     Plus,
     Minus,
     Mult,
     Div,
     Power,
+    // 1 if true and 0 otherwise
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
 };
 
 struct BinaryExpression: public Expression {
@@ -204,6 +277,22 @@ struct BinaryExpression: public Expression {
         BinaryOperator op,
         std::unique_ptr<Expression> right
     ): op(op), left(std::move(left)), right(std::move(right)) {
+        hash = hash_operands(hash_mix('B', (uint64_t)op), this->left->hash, this->right->hash, is_commutative());
+    }
+
+    bool is_commutative() const {
+        return op == BinaryOperator::Plus || op == BinaryOperator::Mult;
+    }
+
+    virtual bool equals(const Expression &other) const {
+        auto o = dynamic_cast<const BinaryExpression*>(&ungrouped(other));
+        return o != nullptr && o->hash == hash && o->op == op
+            && equal_operands(*left, *right, *o->left, *o->right, is_commutative());
+    }
+
+    virtual std::string canonical() const {
+        const char* names[] = { "+", "-", "*", "/", "**", "<", "<=", ">", ">=" };
+        return std::string("(") + names[(int)op] + " " + canonical_operands(*left, *right, is_commutative()) + ")";
     }
 
     virtual std::string to_string() const {
@@ -220,6 +309,15 @@ struct BinaryExpression: public Expression {
             op_str = "/";
         } else if (op == BinaryOperator::Power) {
             return "gc_pow(" + a + ", " + b + ")";
+        } else if (op == BinaryOperator::Less) {
+            // step(edge, v) is 0 if v < edge and 1 otherwise, doesn't branch
+            return "(1.0lf-step(" + b + ", " + a + "))";
+        } else if (op == BinaryOperator::LessEqual) {
+            return "step(" + a + ", " + b + ")";
+        } else if (op == BinaryOperator::Greater) {
+            return "(1.0lf-step(" + a + ", " + b + "))";
+        } else if (op == BinaryOperator::GreaterEqual) {
+            return "step(" + b + ", " + a + ")";
         }
 
         return "(" + a + op_str + b + ")";
@@ -240,13 +338,23 @@ struct UnaryExpression: public Expression {
         UnaryOperator op,
         std::unique_ptr<Expression> expr
     ): op(op), expr(std::move(expr)) {
+        hash = hash_mix(hash_mix('U', (uint64_t)op), this->expr->hash);
+    }
+
+    virtual bool equals(const Expression &other) const {
+        auto o = dynamic_cast<const UnaryExpression*>(&ungrouped(other));
+        return o != nullptr && o->hash == hash && o->op == op && expr->equals(*o->expr);
+    }
+
+    virtual std::string canonical() const {
+        return "(neg " + expr->canonical() + ")";
     }
 
     virtual std::string to_string() const {
         std::string a = expr->to_string();
         std::string op_str;
         if (op == UnaryOperator::Minus) {
-            op_str = "+";
+            op_str = "-";
         }
 
         return "(" + op_str + a + ")";
@@ -256,14 +364,59 @@ struct UnaryExpression: public Expression {
 };
 
 struct FunctionCall: public Expression {
-    std::string name;
+    const FunctionInfo* function;
     std::vector<std::unique_ptr<Expression>> exprs;
 
-    FunctionCall(std::string name, std::vector<std::unique_ptr<Expression>> exprs):
-        name(name), exprs(std::move(exprs)) {}
+    FunctionCall(const FunctionInfo &function, std::vector<std::unique_ptr<Expression>> exprs):
+        function(&function), exprs(std::move(exprs)) {
+        uint64_t tag = hash_mix('F', hash_string(function.glsl));
+        if (this->exprs.size() == 2) {
+            hash = hash_operands(tag, this->exprs[0]->hash, this->exprs[1]->hash, is_commutative());
+        } else {
+            hash = tag;
+            for (auto&& e: this->exprs) {
+                hash = hash_mix(hash, e->hash);
+            }
+        }
+    }
+
+    bool is_commutative() const {
+        return exprs.size() == 2 && function->commutative;
+    }
+
+    // the same for aliases, e.g. if and select
+    std::string_view canonical_name() const {
+        return function_of(function->op)->name;
+    }
+
+    virtual bool equals(const Expression &other) const {
+        auto o = dynamic_cast<const FunctionCall*>(&ungrouped(other));
+        if (o == nullptr || o->hash != hash || o->function->op != function->op || o->exprs.size() != exprs.size())
+            return false;
+
+        if (exprs.size() == 2)
+            return equal_operands(*exprs[0], *exprs[1], *o->exprs[0], *o->exprs[1], is_commutative());
+
+        for (size_t i=0; i != exprs.size(); i++) {
+            if (!exprs[i]->equals(*o->exprs[i]))
+                return false;
+        }
+        return true;
+    }
+
+    virtual std::string canonical() const {
+        if (exprs.size() == 2)
+            return "(" + std::string(canonical_name()) + " " + canonical_operands(*exprs[0], *exprs[1], is_commutative()) + ")";
+
+        std::string result = "(" + std::string(canonical_name());
+        for (auto&& e: exprs) {
+            result += " " + e->canonical();
+        }
+        return result + ")";
+    }
 
     virtual std::string to_string() const {
-        std::string result = "(" + name + "(";
+        std::string result = "(" + std::string(function->glsl) + "(";
         for (int i=0; i != exprs.size(); i++) {
             result += exprs[i]->to_string();
             if (i+1 < exprs.size()) {
@@ -281,6 +434,16 @@ struct Const: public Expression {
     std::string name;
 
     Const(std::string name): name(name) {
+        hash = hash_mix('C', hash_string(name));
+    }
+
+    virtual bool equals(const Expression &other) const {
+        auto o = dynamic_cast<const Const*>(&ungrouped(other));
+        return o != nullptr && o->name == name;
+    }
+
+    virtual std::string canonical() const {
+        return name;
     }
 
     virtual std::string to_string() const {
@@ -294,6 +457,26 @@ struct Number: public Expression {
     std::string value;
 
     Number(std::string value): value(value) {
+        // 1, 1.0 and 01. are the same number
+        double parsed = std::strtod(value.c_str(), nullptr);
+        uint64_t bits;
+        std::memcpy(&bits, &parsed, sizeof(bits));
+        hash = hash_mix('N', bits);
+    }
+
+    double get_value() const {
+        return std::strtod(value.c_str(), nullptr);
+    }
+
+    virtual bool equals(const Expression &other) const {
+        auto o = dynamic_cast<const Number*>(&ungrouped(other));
+        return o != nullptr && o->get_value() == get_value();
+    }
+
+    virtual std::string canonical() const {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.17g", get_value());
+        return buf;
     }
 
     virtual std::string to_string() const {
@@ -307,6 +490,15 @@ struct Grouping: public Expression {
     std::unique_ptr<Expression> expr;
 
     Grouping(std::unique_ptr<Expression> expr): expr(std::move(expr)) {
+        hash = this->expr->hash;
+    }
+
+    virtual bool equals(const Expression &other) const {
+        return expr->equals(other);
+    }
+
+    virtual std::string canonical() const {
+        return expr->canonical();
     }
 
     virtual std::string to_string() const {
@@ -316,8 +508,150 @@ struct Grouping: public Expression {
     virtual ~Grouping() {}
 };
 
+// strips parentheses, which don't affect structure
+const Expression& ungrouped(const Expression &expr) {
+    const Expression* result = &expr;
+    while (auto grouping = dynamic_cast<const Grouping*>(result)) {
+        result = grouping->expr.get();
+    }
+    return *result;
+}
+
+// reference to a let-bound value or a parameter of a user function, identified by its slot,
+// see Let, two references are structurally equal if they refer to the same slot
+struct Local: public Expression {
+    std::string name;
+    // innermost first, parameters of a function take slots [0, arity), each enclosing let the next one
+    size_t slot;
+    // name of the GLSL local or parameter
+    std::string glsl;
+
+    Local(std::string name, size_t slot, std::string glsl): name(name), slot(slot), glsl(glsl) {
+        hash = hash_mix('V', slot);
+    }
+
+    virtual bool equals(const Expression &other) const {
+        auto o = dynamic_cast<const Local*>(&ungrouped(other));
+        return o != nullptr && o->slot == slot;
+    }
+
+    virtual std::string canonical() const {
+        return "$" + std::to_string(slot);
+    }
+
+    virtual std::string to_string() const {
+        return glsl;
+    }
+
+    virtual ~Local() {}
+};
+
+// let name = value in body, value is computed once, declared as a GLSL local before the
+// formula's return (see generate_glsl) and kept in a bytecode local slot
+struct Let: public Expression {
+    std::string name;
+    size_t slot;
+    std::string glsl;
+    std::unique_ptr<Expression> value;
+    std::unique_ptr<Expression> body;
+
+    Let(std::string name, size_t slot, std::string glsl, std::unique_ptr<Expression> value, std::unique_ptr<Expression> body):
+        name(name), slot(slot), glsl(glsl), value(std::move(value)), body(std::move(body)) {
+        hash = hash_mix(hash_mix(hash_mix('L', slot), this->value->hash), this->body->hash);
+    }
+
+    virtual bool equals(const Expression &other) const {
+        auto o = dynamic_cast<const Let*>(&ungrouped(other));
+        return o != nullptr && o->hash == hash && o->slot == slot && value->equals(*o->value) && body->equals(*o->body);
+    }
+
+    virtual std::string canonical() const {
+        return "(let " + value->canonical() + " " + body->canonical() + ")";
+    }
+
+    // the value is declared separately, see generate_glsl
+    virtual std::string to_string() const {
+        return body->to_string();
+    }
+
+    virtual ~Let() {}
+};
+
+// function defined in the formula, e.g. f(t) = sin(t)*t; f(x) + f(y)
+// emitted once as a GLSL function and compiled once to bytecode, shared by all its calls
+struct UserFunction {
+    std::string name;
+    size_t arity;
+    std::unique_ptr<Expression> body;
+    // structural, independent of the names of the function and its parameters
+    uint64_t hash;
+    // name of the GLSL function, taken from hash so that equal functions of different formulas
+    // share the definition
+    std::string glsl;
+
+    UserFunction(std::string name, size_t arity, std::unique_ptr<Expression> body):
+        name(name), arity(arity), body(std::move(body)) {
+        hash = hash_mix(hash_mix('D', arity), this->body->hash);
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "gc_u%016llx", (unsigned long long)hash);
+        glsl = buf;
+    }
+};
+
+struct UserCall: public Expression {
+    std::shared_ptr<const UserFunction> function;
+    std::vector<std::unique_ptr<Expression>> exprs;
+
+    UserCall(std::shared_ptr<const UserFunction> function, std::vector<std::unique_ptr<Expression>> exprs):
+        function(function), exprs(std::move(exprs)) {
+        hash = hash_mix('A', this->function->hash);
+        for (auto&& e: this->exprs) {
+            hash = hash_mix(hash, e->hash);
+        }
+    }
+
+    virtual bool equals(const Expression &other) const {
+        auto o = dynamic_cast<const UserCall*>(&ungrouped(other));
+        if (o == nullptr || o->hash != hash || o->exprs.size() != exprs.size())
+            return false;
+        if (o->function != function && !(o->function->arity == function->arity && function->body->equals(*o->function->body)))
+            return false;
+
+        for (size_t i=0; i != exprs.size(); i++) {
+            if (!exprs[i]->equals(*o->exprs[i]))
+                return false;
+        }
+        return true;
+    }
+
+    virtual std::string canonical() const {
+        std::string result = "((fn " + std::to_string(function->arity) + " " + function->body->canonical() + ")";
+        for (auto&& e: exprs) {
+            result += " " + e->canonical();
+        }
+        return result + ")";
+    }
+
+    // x and y are passed along, function bodies may use them
+    virtual std::string to_string() const {
+        std::string result = function->glsl + "(x, y";
+        for (auto&& e: exprs) {
+            result += ", " + e->to_string();
+        }
+        return result + ")";
+    }
+
+    virtual ~UserCall() {}
+};
+
 // based on http://www.craftinginterpreters.com/parsing-expressions.html
-// expr :: add ;
+// formula :: definition* equation ;
+// definition :: IDENTIFIER "(" parameters? ")" "=" expr ";" ;
+// parameters :: IDENTIFIER ( "," IDENTIFIER )* ;
+// equation :: expr ( "=" expr )? ;
+// expr :: let | comparison ;
+// comparison :: add ( ("<" | "<=" | ">" | ">=") add )? ;
+// let :: "let" IDENTIFIER "=" expr "in" expr ;
 // add :: mult ( ("-" | "+") mult)*;
 // mult :: pow ( ("*" | "/") pow)*;
 // pow :: unary ( ("**") unary)*;
@@ -330,7 +664,7 @@ struct ParserError: public std::exception {
     std::string what;
     size_t pos;
 
-    ParserError(std::string what): what(what) {
+    ParserError(std::string what): what(what), pos(0) {
     }
 
     ParserError(std::string what, size_t pos): what(what), pos(pos) {
@@ -349,6 +683,14 @@ BinaryOperator token_to_binary_op(TokenType tok, size_t pos) {
             return BinaryOperator::Mult;
         case TokenType::Power:
             return BinaryOperator::Power;
+        case TokenType::Less:
+            return BinaryOperator::Less;
+        case TokenType::LessEqual:
+            return BinaryOperator::LessEqual;
+        case TokenType::Greater:
+            return BinaryOperator::Greater;
+        case TokenType::GreaterEqual:
+            return BinaryOperator::GreaterEqual;
         default:
             throw ParserError("invalid binary operator " + to_string(tok), pos);
     }
@@ -363,11 +705,24 @@ UnaryOperator token_to_unary_op(TokenType tok, size_t pos) {
     }
 }
 
+// errors are recorded in error instead of thrown, every rule returns nullptr once it is set
 class Parser {
     std::vector<Token> tokens {};
     size_t pos = 0;
+    std::optional<ParserError> error {};
+
+    struct Binding {
+        std::string name;
+        std::string glsl;
+    };
 
-    Token prev() {
+    // locals visible at pos, Binding i has slot i
+    std::vector<Binding> scope {};
+    std::vector<std::shared_ptr<const UserFunction>> functions {};
+    // lets parsed so far, numbers their GLSL locals
+    size_t lets = 0;
+
+    const Token& prev() {
         return tokens[pos-1];
     }
 
@@ -383,14 +738,14 @@ class Parser {
         }
     }
 
-    Token advance() {
+    const Token& advance() {
         if (!is_at_end()) {
             pos += 1;
         }
         return prev();
     }
 
-    bool match_tokens(std::vector<TokenType> types) {
+    bool match_tokens(std::initializer_list<TokenType> types) {
         for (auto&& type: types) {
             if (check(type)) {
                 advance();
@@ -401,16 +756,149 @@ class Parser {
         return false;
     }
 
+    std::unique_ptr<Expression> fail(std::string what) {
+        if (!error)
+            error = ParserError(what, pos);
+        return nullptr;
+    }
+
+    bool check_keyword(const char* keyword) {
+        return check(TokenType::Identifier) && tokens[pos].token == keyword;
+    }
+
+    // names of locals and user functions can't hide built-in functions, but locals may shadow
+    // constants (x, t, pi, ...), since the scope is looked up first
+    bool is_reserved(const std::string &name) {
+        return name == "let" || name == "in" || find_function(name) != nullptr;
+    }
+
+    const UserFunction* find_user_function(const std::string &name) {
+        for (auto&& function: functions) {
+            if (function->name == name)
+                return function.get();
+        }
+        return nullptr;
+    }
+
     std::unique_ptr<Expression> expr() {
-        return add();
+        if (check_keyword("let")) {
+            advance();
+            return let();
+        }
+        return comparison();
+    }
+
+    // comparisons don't chain, a < b < c is an error
+    std::unique_ptr<Expression> comparison() {
+        auto expr = add();
+
+        if (expr && match_tokens({TokenType::Less, TokenType::LessEqual, TokenType::Greater, TokenType::GreaterEqual})) {
+            const Token& op = prev();
+            auto right = add();
+            if (!right)
+                return nullptr;
+            expr = std::make_unique<BinaryExpression>(std::move(expr), token_to_binary_op(op.type, pos), std::move(right));
+        }
+
+        return expr;
+    }
+
+    std::unique_ptr<Expression> let() {
+        if (!match_tokens({TokenType::Identifier}))
+            return fail("expected name after let");
+        std::string name = prev().token;
+        if (is_reserved(name))
+            return fail("can't bind reserved name " + name);
+        if (!match_tokens({TokenType::Equals}))
+            return fail("expected = after let " + name);
+
+        auto value = expr();
+        if (!value)
+            return nullptr;
+        if (!check_keyword("in"))
+            return fail("expected in after value of " + name);
+        advance();
+
+        size_t slot = scope.size();
+        std::string glsl = "gc_l" + std::to_string(lets++);
+        scope.push_back(Binding { .name = name, .glsl = glsl });
+        auto body = expr();
+        scope.pop_back();
+        if (!body)
+            return nullptr;
+
+        return std::make_unique<Let>(name, slot, glsl, std::move(value), std::move(body));
+    }
+
+    // parses a definition and adds it to functions, false on error
+    bool definition() {
+        if (!match_tokens({TokenType::Identifier})) {
+            fail("expected function definition");
+            return false;
+        }
+        std::string name = prev().token;
+        if (is_reserved(name) || find_user_function(name) != nullptr) {
+            fail("can't redefine function " + name);
+            return false;
+        }
+        if (!match_tokens({TokenType::ParenStart})) {
+            fail("expected parameters of " + name);
+            return false;
+        }
+
+        std::vector<Binding> parameters;
+        while (!check(TokenType::ParenEnd)) {
+            if (!parameters.empty() && !match_tokens({TokenType::Comma})) {
+                fail("expected comma");
+                return false;
+            }
+            if (!match_tokens({TokenType::Identifier})) {
+                fail("expected parameter name");
+                return false;
+            }
+            std::string parameter = prev().token;
+            for (auto&& p: parameters) {
+                if (p.name == parameter) {
+                    fail("duplicate parameter " + parameter);
+                    return false;
+                }
+            }
+            if (is_reserved(parameter)) {
+                fail("can't bind reserved name " + parameter);
+                return false;
+            }
+            parameters.push_back(Binding { .name = parameter, .glsl = "gc_a" + std::to_string(parameters.size()) });
+        }
+        advance();
+
+        if (!match_tokens({TokenType::Equals})) {
+            fail("expected = after parameters of " + name);
+            return false;
+        }
+
+        scope = parameters;
+        auto body = expr();
+        scope.clear();
+        if (!body)
+            return false;
+
+        if (!match_tokens({TokenType::Semicolon})) {
+            fail("expected ; after definition of " + name);
+            return false;
+        }
+
+        functions.push_back(std::make_shared<UserFunction>(name, parameters.size(), std::move(body)));
+        return true;
     }
 
     std::unique_ptr<Expression> add() {
         auto expr = mult();
 
-        while (match_tokens({TokenType::Plus, TokenType::Minus})) {
-            auto op = prev();
+        while (expr && match_tokens({TokenType::Plus, TokenType::Minus})) {
+            const Token& op = prev();
             auto right = mult();
+            if (!right)
+                return nullptr;
             expr = std::make_unique<BinaryExpression>(std::move(expr), token_to_binary_op(op.type, pos), std::move(right));
         }
 
@@ -420,9 +908,11 @@ class Parser {
     std::unique_ptr<Expression> mult() {
         auto expr = pow();
 
-        while (match_tokens({TokenType::Mult, TokenType::Div})) {
-            auto op = prev();
+        while (expr && match_tokens({TokenType::Mult, TokenType::Div})) {
+            const Token& op = prev();
             auto right = pow();
+            if (!right)
+                return nullptr;
             expr = std::make_unique<BinaryExpression>(std::move(expr), token_to_binary_op(op.type, pos), std::move(right));
         }
 
@@ -432,9 +922,11 @@ class Parser {
     std::unique_ptr<Expression> pow() {
         auto expr = unary();
 
-        while (match_tokens({TokenType::Power})) {
-            auto op = prev();
+        while (expr && match_tokens({TokenType::Power})) {
+            const Token& op = prev();
             auto right = unary();
+            if (!right)
+                return nullptr;
             expr = std::make_unique<BinaryExpression>(std::move(expr), token_to_binary_op(op.type, pos), std::move(right));
         }
 
@@ -442,10 +934,12 @@ class Parser {
     }
 
     std::unique_ptr<Expression> unary() {
-        while (match_tokens({TokenType::Minus})) {
-            auto op = prev();
+        if (match_tokens({TokenType::Minus})) {
+            const Token& op = prev();
             auto right = unary();
-            auto expr = std::make_unique<UnaryExpression>(token_to_unary_op(op.type, pos), std::move(right));
+            if (!right)
+                return nullptr;
+            return std::make_unique<UnaryExpression>(token_to_unary_op(op.type, pos), std::move(right));
         }
 
         return call();
@@ -454,11 +948,11 @@ class Parser {
     std::unique_ptr<Expression> call() {
         auto expr = primary();
 
-        while (true) {
+        while (expr) {
             if (match_tokens({TokenType::ParenStart})) {
                 Const* name = dynamic_cast<Const*>(expr.get());
                 if (name == nullptr) {
-                    throw ParserError("expected function name", pos);
+                    return fail("expected function name");
                 }
 
                 expr = finish_call(name->name);
@@ -469,16 +963,13 @@ class Parser {
 
         Const* cnst = dynamic_cast<Const*>(expr.get());
         if (cnst != nullptr) {
-            bool ok = false;
-            for (auto&& f: BUILTIN_CONSTS) {
-                if (f == cnst->name) {
-                    ok = true;
-                    break;
-                }
+            for (size_t slot=scope.size(); slot != 0; slot--) {
+                if (scope[slot-1].name == cnst->name)
+                    return std::make_unique<Local>(cnst->name, slot - 1, scope[slot-1].glsl);
             }
 
-            if (!ok)
-                throw ParserError("unknown constant " + prev().token, pos);
+            if (find_constant(cnst->name) == nullptr)
+                return fail("unknown constant " + prev().token);
         }
 
         return expr;
@@ -489,40 +980,40 @@ class Parser {
 
         if (!check(TokenType::ParenEnd)) {
             args.push_back(expr());
-            while (match_tokens({TokenType::Comma})) {
+            while (args.back() && match_tokens({TokenType::Comma})) {
                 args.push_back(expr());
             }
+            if (!args.back())
+                return nullptr;
         }
 
         if (check(TokenType::ParenEnd)) {
             advance();
         } else {
-            throw ParserError("expected paren end", pos);
+            return fail("expected paren end");
         }
 
-        for (auto&& f: FUNCTIONS) {
-            if (f.first == name) {
-                if (f.second == args.size()) {
-                    return std::make_unique<FunctionCall>("gc_" + name, std::move(args));
-                } else {
-                    throw ParserError("invalid number of arguments to function " + name +
-                            " expected " + std::to_string(f.second) + " received " + std::to_string(args.size()), pos);
-                }
+        for (auto&& user: functions) {
+            if (user->name != name)
+                continue;
+
+            if (user->arity != args.size()) {
+                return fail("invalid number of arguments to function " + name +
+                        " expected " + std::to_string(user->arity) + " received " + std::to_string(args.size()));
             }
+            return std::make_unique<UserCall>(user, std::move(args));
         }
 
-        for (auto&& f: BUILTIN_FUNCTIONS) {
-            if (f.first == name) {
-                if (f.second == args.size()) {
-                    return std::make_unique<FunctionCall>(name, std::move(args));
-                } else {
-                    throw ParserError("invalid number of arguments to function " + name +
-                            " expected " + std::to_string(f.second) + " received " + std::to_string(args.size()), pos);
-                }
-            }
+        const FunctionInfo* function = find_function(name);
+        if (function == nullptr)
+            return fail("unknown function " + name);
+
+        if (function->arity != args.size()) {
+            return fail("invalid number of arguments to function " + name +
+                    " expected " + std::to_string(function->arity) + " received " + std::to_string(args.size()));
         }
 
-        throw ParserError("unknown function " + name, pos);
+        return std::make_unique<FunctionCall>(*function, std::move(args));
     }
 
     std::unique_ptr<Expression> primary() {
@@ -532,14 +1023,16 @@ class Parser {
             return std::make_unique<Number>(Number(prev().token));
         } else if (match_tokens({TokenType::ParenStart})) {
             auto expr = this->expr();
+            if (!expr)
+                return nullptr;
             if (check(TokenType::ParenEnd)) {
                 advance();
             } else {
-                throw ParserError("expected paren end", pos);
+                return fail("expected paren end");
             }
             return std::make_unique<Grouping>(std::move(expr));
         } else {
-            throw ParserError("expected expression", pos);
+            return fail("expected expression");
         }
     }
 
@@ -547,11 +1040,167 @@ public:
     Parser(std::vector<Token> tokens): tokens(tokens) {
     }
 
-    std::unique_ptr<Expression> parse() {
+    // an equation lhs = rhs is parsed as lhs - rhs, whose zero set is the implicit surface,
+    // returns nullptr and sets the error returned by get_error on failure
+    std::unique_ptr<Expression> try_parse() {
+        // every statement but the last is a definition
+        while (std::find_if(tokens.begin() + pos, tokens.end(), [](const Token &token) {
+            return token.type == TokenType::Semicolon;
+        }) != tokens.end()) {
+            if (!definition())
+                return nullptr;
+        }
+
         auto expr = this->expr();
-        if (!is_at_end()) {
-            throw ParserError("trailing data after expression", pos);
+        if (expr && match_tokens({TokenType::Equals})) {
+            auto right = this->expr();
+            if (!right)
+                return nullptr;
+            expr = std::make_unique<BinaryExpression>(std::move(expr), BinaryOperator::Minus, std::move(right));
+        }
+        if (expr && !is_at_end()) {
+            return fail("trailing data after expression");
         }
         return expr;
     }
+
+    const std::optional<ParserError>& get_error() const {
+        return error;
+    }
+
+    std::unique_ptr<Expression> parse() {
+        auto expr = try_parse();
+        if (!expr)
+            throw *error;
+        return expr;
+    }
+};
+
+// GLSL code of a formula, see generate_glsl
+struct GlslCode {
+    // names and definitions of the functions called by statements, placed before func
+    std::vector<std::pair<std::string, std::string>> functions {};
+    // body of the formula's case in func, ending with its return
+    std::string statements = "return 0.0;";
 };
+
+// lets of expr in the order their values can be computed, each after the lets its value or
+// scope depends on, lets inside user functions belong to the function
+void collect_lets(const Expression* expr, std::vector<const Let*> &result) {
+    if (auto binary = dynamic_cast<const BinaryExpression*>(expr)) {
+        collect_lets(binary->left.get(), result);
+        collect_lets(binary->right.get(), result);
+    } else if (auto unary = dynamic_cast<const UnaryExpression*>(expr)) {
+        collect_lets(unary->expr.get(), result);
+    } else if (auto call = dynamic_cast<const FunctionCall*>(expr)) {
+        for (auto&& arg: call->exprs) {
+            collect_lets(arg.get(), result);
+        }
+    } else if (auto call = dynamic_cast<const UserCall*>(expr)) {
+        for (auto&& arg: call->exprs) {
+            collect_lets(arg.get(), result);
+        }
+    } else if (auto grouping = dynamic_cast<const Grouping*>(expr)) {
+        collect_lets(grouping->expr.get(), result);
+    } else if (auto let = dynamic_cast<const Let*>(expr)) {
+        collect_lets(let->value.get(), result);
+        result.push_back(let);
+        collect_lets(let->body.get(), result);
+    }
+}
+
+// user functions called by expr, each after the functions it calls
+void collect_functions(const Expression* expr, std::vector<const UserFunction*> &result) {
+    if (auto binary = dynamic_cast<const BinaryExpression*>(expr)) {
+        collect_functions(binary->left.get(), result);
+        collect_functions(binary->right.get(), result);
+    } else if (auto unary = dynamic_cast<const UnaryExpression*>(expr)) {
+        collect_functions(unary->expr.get(), result);
+    } else if (auto call = dynamic_cast<const FunctionCall*>(expr)) {
+        for (auto&& arg: call->exprs) {
+            collect_functions(arg.get(), result);
+        }
+    } else if (auto call = dynamic_cast<const UserCall*>(expr)) {
+        for (auto&& arg: call->exprs) {
+            collect_functions(arg.get(), result);
+        }
+        if (std::find(result.begin(), result.end(), call->function.get()) == result.end()) {
+            collect_functions(call->function->body.get(), result);
+            result.push_back(call->function.get());
+        }
+    } else if (auto grouping = dynamic_cast<const Grouping*>(expr)) {
+        collect_functions(grouping->expr.get(), result);
+    } else if (auto let = dynamic_cast<const Let*>(expr)) {
+        collect_functions(let->value.get(), result);
+        collect_functions(let->body.get(), result);
+    }
+}
+
+// declarations of the lets of expr followed by the return of its value
+std::string glsl_statements(const Expression &expr, const std::string &cast) {
+    std::vector<const Let*> lets;
+    collect_lets(&expr, lets);
+
+    std::string result;
+    for (auto&& let: lets) {
+        result += "double " + let->glsl + " = " + let->value->to_string() + "; ";
+    }
+    return result + "return " + cast + "(" + expr.to_string() + ");";
+}
+
+GlslCode generate_glsl(const Expression &expr) {
+    std::vector<const UserFunction*> functions;
+    collect_functions(&expr, functions);
+
+    GlslCode result {};
+    for (auto&& function: functions) {
+        std::string definition = "double " + function->glsl + "(double x, double y";
+        for (size_t i=0; i != function->arity; i++) {
+            definition += ", double gc_a" + std::to_string(i);
+        }
+        definition += ") {\n    " + glsl_statements(*function->body, "double") + "\n}\n";
+        result.functions.emplace_back(function->glsl, definition);
+    }
+    result.statements = glsl_statements(expr, "float");
+    return result;
+}
+
+// prototypes of the gc_ wrappers called by the generated code, which are defined in plane.tese,
+// one per wrapper of FUNCTION_TABLE and gc_pow for the power operator
+std::string glsl_declarations() {
+    std::vector<std::string_view> declared { "gc_pow" };
+    std::string result = "double gc_pow(double a0, double a1);\n";
+    for (auto&& info: FUNCTION_TABLE) {
+        std::string_view glsl = info.glsl;
+        if (glsl.substr(0, 3) != "gc_" || std::find(declared.begin(), declared.end(), glsl) != declared.end())
+            continue;
+        declared.push_back(glsl);
+
+        result += "double " + std::string(glsl) + "(";
+        for (size_t i=0; i != info.arity; i++) {
+            result += (i ? ", double a" : "double a") + std::to_string(i);
+        }
+        result += ");\n";
+    }
+    return result;
+}
+
+// builds the func definition used by plane.tese from the generated code of the formulas,
+// dispatching on the per-instance formula id, user functions shared by several formulas
+// are defined once
+std::string generate_func(const std::vector<GlslCode>& formulas) {
+    std::string definitions;
+    std::vector<std::string> defined;
+    std::string result = "float func(int formula, float x, float y) {\n    switch (formula) {\n";
+    for (size_t i=0; i != formulas.size(); i++) {
+        for (auto&& function: formulas[i].functions) {
+            if (std::find(defined.begin(), defined.end(), function.first) == defined.end()) {
+                defined.push_back(function.first);
+                definitions += function.second;
+            }
+        }
+        result += "        case " + std::to_string(i) + ": { " + formulas[i].statements + " }\n";
+    }
+
+    return glsl_declarations() + definitions + result + "    }\n    return 0.0;\n}\n";
+}
@@ -0,0 +1,499 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "functions.hpp"
+
+// single precision approximations of the transcendental functions of formulas, used by the
+// gc_* wrappers of plane.tese and plane_bytecode.tese and by evaluate_batch, selected per
+// pipeline by MathTier
+//
+// the GPU implementation is generated from the same coefficient tables as the CPU one by
+// fast_math_glsl, and both perform the same float operations in the same order, so they agree up
+// to rounding of contracted multiply-adds, the largest errors measured against double precision
+// (`./bench fast_math`):
+//
+//              sin, cos             tan      exp, exp2    log, log2
+//   medium     2 ulp, 2 * 2^-24     3 ulp    2 ulp        4 ulp
+//   fast       26 ulp, 24 * 2^-24   34 ulp   55 ulp       6 ulp
+//
+// sin, cos and tan in ulp for |x| <= pi / 4, sin and cos as absolute error up to FM_REDUCE_MAX,
+// since the argument reduction in single precision loses the relative accuracy near their zeros,
+// exp for |x| <= 87, outside of these ranges and for the other functions all tiers fall back to
+// the builtins, pow is exp2(y * log2(x)) like in GLSL
+// https://en.wikipedia.org/wiki/Remez_algorithm
+//
+// on the CPU fast_math_batch computes blocks of FM_LANES points without branches or libm calls,
+// floor, ldexp and frexp are done on the bits with the same results, so GCC vectorizes them at -O2,
+// a libm call per point would be slower than the exact builtins
+
+enum class MathTier {
+    // GLSL builtins in single precision on the GPU, double precision on the CPU
+    Exact,
+    // minimax polynomials accurate to a few ulp
+    Medium,
+    // lower degree polynomials, about 2^-18 relative error
+    Fast,
+};
+
+const char* math_tier_name(MathTier tier) {
+    switch (tier) {
+        case MathTier::Exact: return "exact";
+        case MathTier::Medium: return "medium";
+        case MathTier::Fast: return "fast";
+    }
+    return "";
+}
+
+// coefficients of the lowest degree first, only the first *Terms are used
+struct FastMathCoefficients {
+    // sin(r) = r + r^3 * p(r^2), r in [-pi/4, pi/4]
+    float sin[3];
+    size_t sinTerms;
+    // cos(r) = 1 - r^2 / 2 + r^4 * p(r^2)
+    float cos[3];
+    size_t cosTerms;
+    // 2^f = 1 + f * p(f), f in [-1/2, 1/2]
+    float exp2[6];
+    size_t exp2Terms;
+    // log2(m) = t * p(t^2), t = (m - 1) / (m + 1), m in [sqrt(1/2), sqrt(2)]
+    float log2[4];
+    size_t log2Terms;
+};
+
+constexpr FastMathCoefficients FAST_MATH_MEDIUM = {
+    .sin = { -1.666665467e-01f, 8.332100953e-03f, -1.950396313e-04f }, .sinTerms = 3,
+    .cos = { 4.166664568e-02f, -1.388731625e-03f, 2.443315707e-05f }, .cosTerms = 3,
+    .exp2 = { 6.931472150e-01f, 2.402265278e-01f, 5.550310551e-02f, 9.617692973e-03f, 1.340664390e-03f, 1.559467817e-04f }, .exp2Terms = 6,
+    .log2 = { 2.885390080e+00f, 9.617988539e-01f, 5.767138182e-01f, 4.317486414e-01f }, .log2Terms = 4,
+};
+
+constexpr FastMathCoefficients FAST_MATH_FAST = {
+    .sin = { -1.666339038e-01f, 8.163281922e-03f }, .sinTerms = 2,
+    .cos = { 4.166199636e-02f, -1.366123174e-03f }, .cosTerms = 2,
+    .exp2 = { 6.931136044e-01f, 2.402071108e-01f, 5.597688363e-02f, 9.782912638e-03f }, .exp2Terms = 4,
+    .log2 = { 2.885390426e+00f, 9.615878612e-01f, 5.957965116e-01f }, .log2Terms = 3,
+};
+
+constexpr const FastMathCoefficients& fast_math_coefficients(MathTier tier) {
+    return tier == MathTier::Fast ? FAST_MATH_FAST : FAST_MATH_MEDIUM;
+}
+
+// pi / 2 split so that k * FM_PIO2_1 and k * FM_PIO2_2 are exact for the k of |x| <= FM_REDUCE_MAX
+// (Cody-Waite reduction)
+const float FM_PIO2_1 = 1.5703125f;
+const float FM_PIO2_2 = 4.837512969970703125e-4f;
+const float FM_PIO2_3 = 7.54978995489188216e-8f;
+const float FM_2_PI = 0.636619772f;
+const float FM_REDUCE_MAX = 8192.0f;
+const float FM_LN2_1 = 0.693359375f;
+const float FM_LN2_2 = -2.12194440e-4f;
+const float FM_LN2 = 0.693147181f;
+const float FM_LOG2E = 1.44269504f;
+const float FM_SQRT1_2 = 0.707106781f;
+
+// c[terms - 1] * z^(terms - 1) + ... + c[0] from c[i] up, in the order of the generated GLSL,
+// expanded at compile time since -O2 doesn't unroll loops, so the callers stay branch-free
+template<size_t terms, size_t i = 0, size_t N>
+inline float fm_horner(const float (&c)[N], float z) {
+    static_assert(terms >= 1 && terms <= N);
+    if constexpr (i + 1 == terms) {
+        return c[i];
+    } else {
+        return fm_horner<terms, i + 1>(c, z) * z + c[i];
+    }
+}
+
+template<MathTier tier>
+inline float fm_sin_poly(float r) {
+    constexpr const FastMathCoefficients& c = fast_math_coefficients(tier);
+    float z = r * r;
+    return r + r * z * fm_horner<c.sinTerms>(c.sin, z);
+}
+
+template<MathTier tier>
+inline float fm_cos_poly(float r) {
+    constexpr const FastMathCoefficients& c = fast_math_coefficients(tier);
+    float z = r * r;
+    return 1.0f - 0.5f * z + z * z * fm_horner<c.cosTerms>(c.cos, z);
+}
+
+inline uint32_t fm_bits(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+inline float fm_from_bits(uint32_t bits) {
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// all ones if c, 0 otherwise
+inline uint32_t fm_mask(bool c) {
+    return 0u - (uint32_t)c;
+}
+
+// a where mask is all ones and b where it's 0, selected with bit operations, the compiler turns
+// ternaries into jumps it threads through the whole function, which then can't be vectorized
+inline float fm_select(uint32_t mask, float a, float b) {
+    return fm_from_bits((fm_bits(a) & mask) | (fm_bits(b) & ~mask));
+}
+
+// std::floor for |x| < 2^31, truncation corrected for negative non integers, unlike the libm
+// call it vectorizes
+inline float fm_floor(float x) {
+    float t = (float)(int32_t)x;
+    return t - fm_select(fm_mask(t > x), 1.0f, 0.0f);
+}
+
+// 2^n for integer n in [-126, 127], the exponent bits written directly, p * fm_pow2i(n) rounds
+// like ldexp(p, n)
+inline float fm_pow2i(int32_t n) {
+    return fm_from_bits((uint32_t)(n + 127) << 23);
+}
+
+// the *_core functions are branch-free and call no libm functions, so that the loops of
+// fast_math_batch vectorize, their argument must be in the range checked by the *_in_range
+// function, elsewhere the fm_* functions fall back to the builtins
+
+// x = k * pi / 2 + r, returns r and sets quadrant to k mod 4
+inline float fm_reduce(float x, int32_t &quadrant) {
+    float k = fm_floor(x * FM_2_PI + 0.5f);
+    quadrant = (int32_t)k & 3;
+    return ((x - k * FM_PIO2_1) - k * FM_PIO2_2) - k * FM_PIO2_3;
+}
+
+inline bool fm_reduce_in_range(float x) {
+    return std::abs(x) <= FM_REDUCE_MAX;
+}
+
+template<MathTier tier>
+inline float fm_sin_core(float x) {
+    int32_t quadrant;
+    float r = fm_reduce(x, quadrant);
+    float v = fm_select(fm_mask((quadrant & 1) != 0), fm_cos_poly<tier>(r), fm_sin_poly<tier>(r));
+    // negated in quadrants 2 and 3 by flipping the sign bit
+    return fm_from_bits(fm_bits(v) ^ ((uint32_t)(quadrant & 2) << 30));
+}
+
+template<MathTier tier>
+inline float fm_cos_core(float x) {
+    int32_t quadrant;
+    float r = fm_reduce(x, quadrant);
+    quadrant = (quadrant + 1) & 3;
+    float v = fm_select(fm_mask((quadrant & 1) != 0), fm_cos_poly<tier>(r), fm_sin_poly<tier>(r));
+    return fm_from_bits(fm_bits(v) ^ ((uint32_t)(quadrant & 2) << 30));
+}
+
+template<MathTier tier>
+inline float fm_tan_core(float x) {
+    int32_t quadrant;
+    float r = fm_reduce(x, quadrant);
+    float s = fm_sin_poly<tier>(r), c = fm_cos_poly<tier>(r);
+    return fm_select(fm_mask((quadrant & 1) != 0), -c / s, s / c);
+}
+
+inline bool fm_exp2_in_range(float x) {
+    return std::abs(x) <= 126.0f;
+}
+
+template<MathTier tier>
+inline float fm_exp2_core(float x) {
+    constexpr const FastMathCoefficients& c = fast_math_coefficients(tier);
+    float n = fm_floor(x + 0.5f);
+    float f = x - n;
+    return (1.0f + f * fm_horner<c.exp2Terms>(c.exp2, f)) * fm_pow2i((int32_t)n);
+}
+
+inline bool fm_exp_in_range(float x) {
+    return std::abs(x) <= 87.0f;
+}
+
+template<MathTier tier>
+inline float fm_exp_core(float x) {
+    constexpr const FastMathCoefficients& c = fast_math_coefficients(tier);
+    float n = fm_floor(x * FM_LOG2E + 0.5f);
+    // x - n * ln(2), in [-ln(2) / 2, ln(2) / 2], then to the argument of 2^f
+    float f = ((x - n * FM_LN2_1) - n * FM_LN2_2) * FM_LOG2E;
+    return (1.0f + f * fm_horner<c.exp2Terms>(c.exp2, f)) * fm_pow2i((int32_t)n);
+}
+
+// normal positive floats, frexp of subnormals needs a branch
+inline bool fm_log2_in_range(float x) {
+    // & rather than && which would branch
+    return (x >= 1.17549435e-38f) & (x <= 3.40282347e+38f);
+}
+
+template<MathTier tier>
+inline float fm_log2_core(float x) {
+    constexpr const FastMathCoefficients& c = fast_math_coefficients(tier);
+    // frexp from the bits, x = m * 2^e, m in [1/2, 1)
+    uint32_t bits = fm_bits(x);
+    int32_t e = (int32_t)((bits >> 23) & 0xff) - 126;
+    float m = fm_from_bits((bits & 0x007fffff) | 0x3f000000);
+    uint32_t low = fm_mask(m < FM_SQRT1_2);
+    m = fm_select(low, m * 2.0f, m);
+    e = e + (int32_t)low;
+    float t = (m - 1.0f) / (m + 1.0f);
+    return (float)e + t * fm_horner<c.log2Terms>(c.log2, t * t);
+}
+
+template<MathTier tier>
+inline float fm_sin(float x) {
+    return fm_reduce_in_range(x) ? fm_sin_core<tier>(x) : std::sin(x);
+}
+
+template<MathTier tier>
+inline float fm_cos(float x) {
+    return fm_reduce_in_range(x) ? fm_cos_core<tier>(x) : std::cos(x);
+}
+
+template<MathTier tier>
+inline float fm_tan(float x) {
+    return fm_reduce_in_range(x) ? fm_tan_core<tier>(x) : std::tan(x);
+}
+
+template<MathTier tier>
+inline float fm_exp2(float x) {
+    return fm_exp2_in_range(x) ? fm_exp2_core<tier>(x) : std::exp2(x);
+}
+
+template<MathTier tier>
+inline float fm_exp(float x) {
+    return fm_exp_in_range(x) ? fm_exp_core<tier>(x) : std::exp(x);
+}
+
+template<MathTier tier>
+inline float fm_log2(float x) {
+    return fm_log2_in_range(x) ? fm_log2_core<tier>(x) : std::log2(x);
+}
+
+template<MathTier tier>
+inline float fm_log(float x) {
+    return fm_log2<tier>(x) * FM_LN2;
+}
+
+template<MathTier tier>
+inline float fm_log_core(float x) {
+    return fm_log2_core<tier>(x) * FM_LN2;
+}
+
+// like GLSL pow, undefined for x < 0
+template<MathTier tier>
+inline float fm_pow(float x, float y) {
+    return fm_exp2<tier>(y * fm_log2<tier>(x));
+}
+
+// points per block of fast_math_batch, a fixed count so that the loops over a block vectorize
+// without a scalar epilogue
+const size_t FM_LANES = 8;
+
+// b[i] = f(b[i]) in blocks of FM_LANES computed by the core of f, lanes out of its range are
+// given 0 instead and computed again by f afterwards, which falls back to the builtin
+template<float (*core)(float), bool (*in_range)(float), float (*f)(float)>
+void fm_unary_batch(double* b, size_t count) {
+    size_t i = 0;
+    for (; i + FM_LANES <= count; i += FM_LANES) {
+        float in[FM_LANES];
+        int ok = 1;
+        for (size_t l=0; l != FM_LANES; l++) {
+            in[l] = (float)b[i + l];
+            bool lane = in_range(in[l]);
+            b[i + l] = core(fm_select(fm_mask(lane), in[l], 0.0f));
+            ok &= lane;
+        }
+        for (size_t l=0; !ok && l != FM_LANES; l++) {
+            if (!in_range(in[l]))
+                b[i + l] = f(in[l]);
+        }
+    }
+    for (; i != count; i++) {
+        b[i] = f((float)b[i]);
+    }
+}
+
+// a[i] = fm_pow(a[i], b[i]) like fm_unary_batch
+template<MathTier tier>
+void fm_pow_batch(double* a, const double* b, size_t count) {
+    size_t i = 0;
+    for (; i + FM_LANES <= count; i += FM_LANES) {
+        float x[FM_LANES], y[FM_LANES];
+        int in[FM_LANES];
+        int ok = 1;
+        // loaded before storing anything, otherwise the loop would need to check if a and b overlap
+        for (size_t l=0; l != FM_LANES; l++) {
+            x[l] = (float)a[i + l];
+            y[l] = (float)b[i + l];
+        }
+        for (size_t l=0; l != FM_LANES; l++) {
+            bool lane = fm_log2_in_range(x[l]);
+            float e = y[l] * fm_log2_core<tier>(fm_select(fm_mask(lane), x[l], 1.0f));
+            lane &= fm_exp2_in_range(e);
+            a[i + l] = fm_exp2_core<tier>(fm_select(fm_mask(lane), e, 0.0f));
+            in[l] = lane;
+            ok &= lane;
+        }
+        for (size_t l=0; !ok && l != FM_LANES; l++) {
+            if (!in[l])
+                a[i + l] = fm_pow<tier>(x[l], y[l]);
+        }
+    }
+    for (; i != count; i++) {
+        a[i] = fm_pow<tier>((float)a[i], (float)b[i]);
+    }
+}
+
+// executes op over a batch of evaluate_batch at the tier in single precision, b is the operand
+// of unary ops and the right one of binary ones, returns false for ops without approximations
+template<MathTier tier>
+bool fast_math_batch(OpCode op, double* a, double* b, size_t count) {
+    switch (op) {
+        case OpCode::Sin: fm_unary_batch<fm_sin_core<tier>, fm_reduce_in_range, fm_sin<tier>>(b, count); return true;
+        case OpCode::Cos: fm_unary_batch<fm_cos_core<tier>, fm_reduce_in_range, fm_cos<tier>>(b, count); return true;
+        case OpCode::Tan: fm_unary_batch<fm_tan_core<tier>, fm_reduce_in_range, fm_tan<tier>>(b, count); return true;
+        case OpCode::Exp: fm_unary_batch<fm_exp_core<tier>, fm_exp_in_range, fm_exp<tier>>(b, count); return true;
+        case OpCode::Exp2: fm_unary_batch<fm_exp2_core<tier>, fm_exp2_in_range, fm_exp2<tier>>(b, count); return true;
+        case OpCode::Log: fm_unary_batch<fm_log_core<tier>, fm_log2_in_range, fm_log<tier>>(b, count); return true;
+        case OpCode::Log2: fm_unary_batch<fm_log2_core<tier>, fm_log2_in_range, fm_log2<tier>>(b, count); return true;
+        case OpCode::Pow: fm_pow_batch<tier>(a, b, count); return true;
+        default:
+            return false;
+    }
+}
+
+bool fast_math_batch(MathTier tier, OpCode op, double* a, double* b, size_t count) {
+    switch (tier) {
+        case MathTier::Medium: return fast_math_batch<MathTier::Medium>(op, a, b, count);
+        case MathTier::Fast: return fast_math_batch<MathTier::Fast>(op, a, b, count);
+        default: return false;
+    }
+}
+
+// c[terms - 1] * z^(terms - 1) + ... + c[0] as a GLSL expression, exactly as fm_horner computes it
+template<size_t N>
+std::string fm_horner_glsl(const float (&c)[N], size_t terms, const std::string &z) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.9e", c[terms - 1]);
+    std::string result = buf;
+    for (size_t i=terms - 1; i-- > 0;) {
+        std::snprintf(buf, sizeof(buf), "%.9e", c[i]);
+        result = "(" + result + ") * " + z + " + " + buf;
+    }
+    return result;
+}
+
+// definitions of the fm_* functions declared by plane.tese and plane_bytecode.tese, a complete
+// tess eval shader compiled once per tier and linked with them, see GLShaderPipeline::setLibrary
+std::string fast_math_glsl(MathTier tier) {
+    if (tier == MathTier::Exact) {
+        return R"(#version 410 core
+
+// fast_math_glsl(exact), see fast_math.hpp
+float fm_sin(float x) { return sin(x); }
+float fm_cos(float x) { return cos(x); }
+float fm_tan(float x) { return tan(x); }
+float fm_exp(float x) { return exp(x); }
+float fm_exp2(float x) { return exp2(x); }
+float fm_log(float x) { return log(x); }
+float fm_log2(float x) { return log2(x); }
+float fm_pow(float x, float y) { return pow(x, y); }
+)";
+    }
+
+    const FastMathCoefficients& c = fast_math_coefficients(tier);
+    std::string result = std::string("#version 410 core\n\n// fast_math_glsl(") + math_tier_name(tier) + "), see fast_math.hpp\n";
+    for (auto [name, value]: { std::make_pair("FM_PIO2_1", FM_PIO2_1), std::make_pair("FM_PIO2_2", FM_PIO2_2),
+            std::make_pair("FM_PIO2_3", FM_PIO2_3), std::make_pair("FM_2_PI", FM_2_PI),
+            std::make_pair("FM_REDUCE_MAX", FM_REDUCE_MAX), std::make_pair("FM_LN2_1", FM_LN2_1),
+            std::make_pair("FM_LN2_2", FM_LN2_2), std::make_pair("FM_LN2", FM_LN2),
+            std::make_pair("FM_LOG2E", FM_LOG2E), std::make_pair("FM_SQRT1_2", FM_SQRT1_2) }) {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "const float %s = %.9e;\n", name, value);
+        result += buf;
+    }
+    result += "float fm_sin_poly(float r) {\n    float z = r * r;\n    return r + r * z * ("
+        + fm_horner_glsl(c.sin, c.sinTerms, "z") + ");\n}\n";
+    result += "float fm_cos_poly(float r) {\n    float z = r * r;\n    return 1.0 - 0.5 * z + z * z * ("
+        + fm_horner_glsl(c.cos, c.cosTerms, "z") + ");\n}\n";
+    result += "float fm_exp2_poly(float f) {\n    return 1.0 + f * (" + fm_horner_glsl(c.exp2, c.exp2Terms, "f") + ");\n}\n";
+    result += "float fm_log2_poly(float t) {\n    float z = t * t;\n    return t * (" + fm_horner_glsl(c.log2, c.log2Terms, "z") + ");\n}\n";
+    result += R"(
+float fm_reduce(float x, out int quadrant) {
+    float k = floor(x * FM_2_PI + 0.5);
+    quadrant = int(k) & 3;
+    return ((x - k * FM_PIO2_1) - k * FM_PIO2_2) - k * FM_PIO2_3;
+}
+
+float fm_sin(float x) {
+    if (!(abs(x) <= FM_REDUCE_MAX))
+        return sin(x);
+    int quadrant;
+    float r = fm_reduce(x, quadrant);
+    float v = (quadrant & 1) != 0 ? fm_cos_poly(r) : fm_sin_poly(r);
+    return (quadrant & 2) != 0 ? -v : v;
+}
+
+float fm_cos(float x) {
+    if (!(abs(x) <= FM_REDUCE_MAX))
+        return cos(x);
+    int quadrant;
+    float r = fm_reduce(x, quadrant);
+    quadrant = (quadrant + 1) & 3;
+    float v = (quadrant & 1) != 0 ? fm_cos_poly(r) : fm_sin_poly(r);
+    return (quadrant & 2) != 0 ? -v : v;
+}
+
+float fm_tan(float x) {
+    if (!(abs(x) <= FM_REDUCE_MAX))
+        return tan(x);
+    int quadrant;
+    float r = fm_reduce(x, quadrant);
+    float s = fm_sin_poly(r), c = fm_cos_poly(r);
+    return fm_select(fm_mask((quadrant & 1) != 0), -c / s, s / c);
+}
+
+float fm_exp2(float x) {
+    if (!(abs(x) <= 126.0))
+        return exp2(x);
+    float n = floor(x + 0.5);
+    return ldexp(fm_exp2_poly(x - n), int(n));
+}
+
+float fm_exp(float x) {
+    if (!(abs(x) <= 87.0))
+        return exp(x);
+    float n = floor(x * FM_LOG2E + 0.5);
+    float f = ((x - n * FM_LN2_1) - n * FM_LN2_2) * FM_LOG2E;
+    return ldexp(fm_exp2_poly(f), int(n));
+}
+
+float fm_log2(float x) {
+    if (!(x > 0.0 && x <= 3.40282347e+38))
+        return log2(x);
+    int e;
+    float m = frexp(x, e);
+    if (m < FM_SQRT1_2) {
+        m = m * 2.0;
+        e = e - 1;
+    }
+    return float(e) + fm_log2_poly((m - 1.0) / (m + 1.0));
+}
+
+float fm_log(float x) {
+    return fm_log2(x) * FM_LN2;
+}
+
+float fm_pow(float x, float y) {
+    return fm_exp2(y * fm_log2(x));
+}
+)";
+    return result;
+}
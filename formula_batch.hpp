@@ -0,0 +1,121 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "expr_parser.hpp"
+#include "expr_bytecode.hpp"
+#include "parallel.hpp"
+
+// compilation of many formulas at once, e.g. for validating user input in bulk
+//
+// nothing on this path throws, errors of every stage are returned as values, so invalid
+// formulas cost about as much as valid ones and don't serialize threads on the unwinder
+
+enum class FormulaStage {
+    Tokenize,
+    Parse,
+    Compile,
+};
+
+struct FormulaError {
+    FormulaStage stage;
+    std::string what;
+    // offset into the source for Tokenize, token index for Parse, 0 for Compile
+    size_t pos;
+};
+
+std::string to_string(FormulaStage stage) {
+    switch (stage) {
+        case FormulaStage::Tokenize:
+            return "tokenize";
+        case FormulaStage::Parse:
+            return "parse";
+        case FormulaStage::Compile:
+            return "compile";
+    }
+    return "unknown";
+}
+
+struct CompiledFormula {
+    bool ok = false;
+    FormulaError error {};
+    // empty unless FormulaOptions::glsl
+    GlslCode glsl {};
+    // empty unless FormulaOptions::bytecode
+    Bytecode bytecode {};
+    // structural hash, see Expression::hash
+    uint64_t hash = 0;
+    // the parsed formula, e.g. to tell formulas with equal hashes apart with Expression::equals
+    std::shared_ptr<const Expression> expr {};
+};
+
+struct FormulaOptions {
+    bool glsl = true;
+    bool bytecode = true;
+    // fold constant subexpressions of the bytecode
+    bool optimize = true;
+    // 0 uses all hardware threads
+    size_t threads = 0;
+};
+
+// times nothing, see compile_formula
+struct NoStageTimer {
+    NoStageTimer(const char*) {
+    }
+};
+
+// every stage is timed by a Timer constructed with its name for the duration of the stage,
+// e.g. ProfileScope, which this header can't use since it doesn't depend on OpenGL
+template<typename Timer = NoStageTimer>
+CompiledFormula compile_formula(const std::string &source, const FormulaOptions &options = {}) {
+    CompiledFormula result {};
+
+    std::vector<Token> tokens;
+    {
+        Timer timer("tokenize");
+        if (auto error = try_tokenize(source, tokens)) {
+            result.error = FormulaError { .stage = FormulaStage::Tokenize, .what = error->what, .pos = error->pos };
+            return result;
+        }
+    }
+
+    Parser parser(std::move(tokens));
+    std::unique_ptr<Expression> expr;
+    {
+        Timer timer("Parser::parse");
+        expr = parser.try_parse();
+    }
+    if (!expr) {
+        const ParserError &error = *parser.get_error();
+        result.error = FormulaError { .stage = FormulaStage::Parse, .what = error.what, .pos = error.pos };
+        return result;
+    }
+
+    Timer timer("codegen");
+    if (options.bytecode) {
+        if (auto error = BytecodeCompiler().try_compile(*expr, result.bytecode)) {
+            result.error = FormulaError { .stage = FormulaStage::Compile, .what = error->what, .pos = 0 };
+            return result;
+        }
+        if (options.optimize)
+            result.bytecode = fold_constants(result.bytecode);
+    }
+
+    if (options.glsl)
+        result.glsl = generate_glsl(*expr);
+    result.hash = expr->hash;
+    result.expr = std::move(expr);
+    result.ok = true;
+    return result;
+}
+
+// result[i] is sources[i] compiled, formulas are spread across threads
+std::vector<CompiledFormula> compile_formulas(const std::vector<std::string> &sources, const FormulaOptions &options = {}) {
+    std::vector<CompiledFormula> result(sources.size());
+    parallel_for(sources.size(), options.threads, [&](size_t i) {
+        result[i] = compile_formula(sources[i], options);
+    });
+    return result;
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+#include "GL/glew.h"
+
+#include "profiler.hpp"
+
+// offscreen framebuffer whose frames are read back through a ring of pixel buffer objects
+//
+// glReadPixels into a bound GL_PIXEL_PACK_BUFFER returns without waiting for the frame to be
+// drawn, the pixels are mapped only when the buffer comes around again RING frames later,
+// by which time the GPU is long done with them, so rendering and readback overlap
+// https://www.khronos.org/opengl/wiki/Pixel_Buffer_Object
+class GLFrameRecorder {
+    static const size_t RING = 3;
+
+    int width;
+    int height;
+    GLuint fbo;
+    GLuint colorBuffer;
+    GLuint depthBuffer;
+    GLuint pbos[RING];
+    GLsync fences[RING] = {};
+    // frame read into each pbo
+    size_t frames[RING] = {};
+    size_t captured = 0;
+    // called with every frame in order, RGB rows bottom to top, valid only during the call
+    std::function<void(size_t, const uint8_t*)> sink;
+
+    void complete(size_t slot) {
+        ProfileScope scope("GLFrameRecorder::complete");
+        glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fences[slot]);
+        fences[slot] = 0;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+        const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)width * height * 3, GL_MAP_READ_BIT);
+        if (pixels != nullptr) {
+            sink(frames[slot], static_cast<const uint8_t*>(pixels));
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+public:
+    GLFrameRecorder(int width, int height, std::function<void(size_t, const uint8_t*)> sink):
+            width(width), height(height), sink(std::move(sink)) {
+        glGenRenderbuffers(1, &colorBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glGenRenderbuffers(1, &depthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (status != GL_FRAMEBUFFER_COMPLETE)
+            throw std::runtime_error("incomplete recording framebuffer " + std::to_string(status));
+
+        // GL_STREAM_READ - written by the GL once and read by the application once
+        glGenBuffers(RING, pbos);
+        for (size_t i=0; i != RING; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 3, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    GLFrameRecorder(GLFrameRecorder&&) = delete;
+    GLFrameRecorder(GLFrameRecorder&) = delete;
+
+    // directs rendering into the recorded framebuffer
+    void bind() {
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glViewport(0, 0, width, height);
+    }
+
+    // queues readback of what was rendered since bind, the frame RING captures ago is passed to sink
+    void capture() {
+        ProfileScope scope("GLFrameRecorder::capture");
+        size_t slot = captured % RING;
+        if (fences[slot] != 0)
+            complete(slot);
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+        // rows of RGB aren't 4 byte aligned in general
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        frames[slot] = captured++;
+    }
+
+    // passes the frames still in flight to sink
+    void finish() {
+        for (size_t i=captured < RING ? 0 : captured - RING; i != captured; i++) {
+            if (fences[i % RING] != 0)
+                complete(i % RING);
+        }
+    }
+
+    int get_width() const {
+        return width;
+    }
+
+    int get_height() const {
+        return height;
+    }
+
+    ~GLFrameRecorder() {
+        for (size_t i=0; i != RING; i++) {
+            if (fences[i] != 0)
+                glDeleteSync(fences[i]);
+        }
+        glDeleteBuffers(RING, pbos);
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteRenderbuffers(1, &colorBuffer);
+        glDeleteRenderbuffers(1, &depthBuffer);
+    }
+};
+
+// binary PPM of RGB pixels given bottom to top as read by glReadPixels, e.g. for ffmpeg -i frame_%05d.ppm
+void write_ppm(const std::string &path, int width, int height, const uint8_t* rgb) {
+    std::ofstream stream(path, std::ios::out | std::ios::binary);
+    if (!stream.is_open()) {
+        throw std::runtime_error("failed to open ppm file " + path);
+    }
+
+    stream << "P6\n" << width << " " << height << "\n255\n";
+    for (int y=height - 1; y >= 0; y--) {
+        stream.write(reinterpret_cast<const char*>(rgb + (size_t)y * width * 3), (std::streamsize)width * 3);
+    }
+}
@@ -0,0 +1,194 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+
+// registry of the functions and constants available in formulas, the parser, GLSL generation,
+// the bytecode compiler and the CPU evaluators are all driven by these tables
+
+// stack based bytecode instructions, see expr_bytecode.hpp, functions are identified by their opcode
+//
+// opcode values are shared with shaders/plane_bytecode.tese and stored in bytecode libraries
+// (see bytecode_format.hpp), so they must be kept in sync and never renumbered
+enum class OpCode: int32_t {
+    Const = 0,
+    X = 1,
+    Y = 2,
+
+    // binary, pop b, pop a, push a op b
+    Add = 3,
+    Sub = 4,
+    Mul = 5,
+    Div = 6,
+    Pow = 7,
+    Mod = 8,
+    Min = 9,
+    Max = 10,
+
+    // unary, pop a, push op(a)
+    Neg = 11,
+    Sin = 12,
+    Cos = 13,
+    Tan = 14,
+    Asin = 15,
+    Acos = 16,
+    Atan = 17,
+    Sinh = 18,
+    Cosh = 19,
+    Tanh = 20,
+    Asinh = 21,
+    Acosh = 22,
+    Atanh = 23,
+    Exp = 24,
+    Log = 25,
+    Exp2 = 26,
+    Log2 = 27,
+    Floor = 28,
+    Ceil = 29,
+    Abs = 30,
+    InverseSqrt = 31,
+    Sqrt = 32,
+
+    Z = 33,
+
+    // functions added later, arity is given by FUNCTION_TABLE
+    Atan2 = 34,
+    Hypot = 35,
+    Sign = 36,
+
+    // locals of lets and user functions, push locals[value], pop into locals[value]
+    Load = 37,
+    Store = 38,
+
+    // comparisons, binary, push 1 if true and 0 otherwise, > and >= swap the operands
+    Less = 39,
+    LessEqual = 40,
+    // ternary, pop b, pop a, pop c, push c != 0 ? a : b
+    Select = 41,
+
+    // animation time in seconds, the t uniform on the GPU
+    T = 42,
+};
+
+// opcodes are in [0, OPCODE_COUNT)
+const int32_t OPCODE_COUNT = (int32_t)OpCode::T + 1;
+
+struct FunctionInfo {
+    std::string_view name;
+    OpCode op;
+    size_t arity;
+    // called by the generated GLSL, gc_ functions are defined in plane.tese
+    const char* glsl;
+    // double precision implementation for the CPU, the one matching arity is set
+    double (*unary)(double);
+    double (*binary)(double, double);
+    // f(a, b) = f(b, a), such calls hash and compare regardless of argument order
+    bool commutative;
+    double (*ternary)(double, double, double) = nullptr;
+};
+
+// sorted by name, see find_function
+constexpr FunctionInfo FUNCTION_TABLE[] = {
+    {"abs", OpCode::Abs, 1, "abs", [](double a) { return std::abs(a); }, nullptr, false},
+    {"acos", OpCode::Acos, 1, "gc_acos", [](double a) { return std::acos(a); }, nullptr, false},
+    {"acosh", OpCode::Acosh, 1, "gc_acosh", [](double a) { return std::acosh(a); }, nullptr, false},
+    {"asin", OpCode::Asin, 1, "gc_asin", [](double a) { return std::asin(a); }, nullptr, false},
+    {"asinh", OpCode::Asinh, 1, "gc_asinh", [](double a) { return std::asinh(a); }, nullptr, false},
+    {"atan", OpCode::Atan, 1, "gc_atan", [](double a) { return std::atan(a); }, nullptr, false},
+    {"atan2", OpCode::Atan2, 2, "gc_atan2", nullptr, [](double a, double b) { return std::atan2(a, b); }, false},
+    {"atanh", OpCode::Atanh, 1, "gc_atanh", [](double a) { return std::atanh(a); }, nullptr, false},
+    {"ceil", OpCode::Ceil, 1, "ceil", [](double a) { return std::ceil(a); }, nullptr, false},
+    {"cos", OpCode::Cos, 1, "gc_cos", [](double a) { return std::cos(a); }, nullptr, false},
+    {"cosh", OpCode::Cosh, 1, "gc_cosh", [](double a) { return std::cosh(a); }, nullptr, false},
+    {"exp", OpCode::Exp, 1, "gc_exp", [](double a) { return std::exp(a); }, nullptr, false},
+    {"exp2", OpCode::Exp2, 1, "gc_exp2", [](double a) { return std::exp2(a); }, nullptr, false},
+    {"floor", OpCode::Floor, 1, "floor", [](double a) { return std::floor(a); }, nullptr, false},
+    {"hypot", OpCode::Hypot, 2, "gc_hypot", nullptr, [](double a, double b) { return std::hypot(a, b); }, true},
+    // select(c, a, b) is a if c != 0 and b otherwise, gc_select doesn't branch
+    {"if", OpCode::Select, 3, "gc_select", nullptr, nullptr, false, [](double c, double a, double b) { return c != 0.0 ? a : b; }},
+    {"inversesqrt", OpCode::InverseSqrt, 1, "inversesqrt", [](double a) { return 1.0 / std::sqrt(a); }, nullptr, false},
+    {"log", OpCode::Log, 1, "gc_log", [](double a) { return std::log(a); }, nullptr, false},
+    {"log2", OpCode::Log2, 1, "gc_log2", [](double a) { return std::log2(a); }, nullptr, false},
+    {"max", OpCode::Max, 2, "max", nullptr, [](double a, double b) { return std::max(a, b); }, true},
+    {"min", OpCode::Min, 2, "min", nullptr, [](double a, double b) { return std::min(a, b); }, true},
+    // GLSL mod, the result has the sign of the divisor
+    {"mod", OpCode::Mod, 2, "mod", nullptr, [](double a, double b) { return a - b * std::floor(a / b); }, false},
+    {"select", OpCode::Select, 3, "gc_select", nullptr, nullptr, false, [](double c, double a, double b) { return c != 0.0 ? a : b; }},
+    {"sign", OpCode::Sign, 1, "sign", [](double a) { return a > 0.0 ? 1.0 : a < 0.0 ? -1.0 : a; }, nullptr, false},
+    {"sin", OpCode::Sin, 1, "gc_sin", [](double a) { return std::sin(a); }, nullptr, false},
+    {"sinh", OpCode::Sinh, 1, "gc_sinh", [](double a) { return std::sinh(a); }, nullptr, false},
+    {"sqrt", OpCode::Sqrt, 1, "sqrt", [](double a) { return std::sqrt(a); }, nullptr, false},
+    {"tan", OpCode::Tan, 1, "gc_tan", [](double a) { return std::tan(a); }, nullptr, false},
+    {"tanh", OpCode::Tanh, 1, "gc_tanh", [](double a) { return std::tanh(a); }, nullptr, false},
+};
+
+struct ConstantInfo {
+    std::string_view name;
+    // OpCode::Const for numbers, otherwise the opcode loading the variable
+    OpCode op;
+    double value;
+};
+
+// sorted by name, see find_constant
+constexpr ConstantInfo CONSTANT_TABLE[] = {
+    {"e", OpCode::Const, M_E},
+    {"pi", OpCode::Const, M_PI},
+    {"t", OpCode::T, 0.0},
+    {"x", OpCode::X, 0.0},
+    {"y", OpCode::Y, 0.0},
+    {"z", OpCode::Z, 0.0},
+};
+
+template<typename T, size_t N>
+constexpr bool is_sorted_by_name(const T (&table)[N]) {
+    for (size_t i=1; i < N; i++) {
+        if (!(table[i-1].name < table[i].name))
+            return false;
+    }
+    return true;
+}
+
+static_assert(is_sorted_by_name(FUNCTION_TABLE), "FUNCTION_TABLE must be sorted by name");
+static_assert(is_sorted_by_name(CONSTANT_TABLE), "CONSTANT_TABLE must be sorted by name");
+
+// binary search of a table sorted by name, nullptr if not found
+template<typename T, size_t N>
+const T* find_by_name(const T (&table)[N], std::string_view name) {
+    const T* it = std::lower_bound(table, table + N, name, [](const T &entry, std::string_view name) {
+        return entry.name < name;
+    });
+    return it != table + N && it->name == name ? it : nullptr;
+}
+
+const FunctionInfo* find_function(std::string_view name) {
+    return find_by_name(FUNCTION_TABLE, name);
+}
+
+const ConstantInfo* find_constant(std::string_view name) {
+    return find_by_name(CONSTANT_TABLE, name);
+}
+
+constexpr std::array<int8_t, OPCODE_COUNT> build_opcode_functions() {
+    std::array<int8_t, OPCODE_COUNT> result {};
+    for (auto& index: result) {
+        index = -1;
+    }
+    for (size_t i=0; i != std::size(FUNCTION_TABLE); i++) {
+        result[(size_t)FUNCTION_TABLE[i].op] = i;
+    }
+    return result;
+}
+
+// index into FUNCTION_TABLE of the function of each opcode, -1 for other opcodes, the last
+// of aliases sharing an opcode, e.g. select for if
+constexpr std::array<int8_t, OPCODE_COUNT> OPCODE_FUNCTIONS = build_opcode_functions();
+
+// the function of op, nullptr for operators, constants and variables
+const FunctionInfo* function_of(OpCode op) {
+    if ((int32_t)op < 0 || (int32_t)op >= OPCODE_COUNT || OPCODE_FUNCTIONS[(size_t)op] < 0)
+        return nullptr;
+    return &FUNCTION_TABLE[OPCODE_FUNCTIONS[(size_t)op]];
+}
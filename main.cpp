@@ -1,7 +1,13 @@
 #include <glm/ext/matrix_clip_space.hpp>
 #include <glm/ext/matrix_transform.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <vector>
 #include <filesystem>
@@ -23,6 +29,22 @@
 #include "shader_pipeline.hpp"
 #include "mesh_object.hpp"
 #include "expr_parser.hpp"
+#include "expr_bytecode.hpp"
+#include "bytecode_buffer.hpp"
+#include "profiler.hpp"
+#include "marching_cubes.hpp"
+#include "adaptive_mesh.hpp"
+#include "contours.hpp"
+#include "formula_batch.hpp"
+#include "tile_cache.hpp"
+#include "frame_recorder.hpp"
+#include "render_scheduler.hpp"
+#include "render_target.hpp"
+#include "probe.hpp"
+#include "refinement.hpp"
+#include "tile_texture.hpp"
+#include "viewports.hpp"
+#include "value_range.hpp"
 
 // NOTE: partially based on https://github.com/quazuo/grafika-mimuw
 
@@ -57,11 +79,73 @@ public:
 struct GLScene {
     std::vector<std::shared_ptr<GLRenderable>> objects;
     GLCamera camera;
+    // split screen, every view is drawn from its own camera into its part of the viewport (see
+    // split_viewport), sharing the objects and their pipelines, empty for a single view from camera
+    std::vector<GLCamera> views;
+    bool sorted = true;
+    // matrices of all views, created on the first render
+    std::unique_ptr<GLCameraBuffer> cameraBuffer {};
+
+    void add(std::shared_ptr<GLRenderable> object) {
+        objects.push_back(std::move(object));
+        sorted = false;
+    }
+
+    void remove(const std::shared_ptr<GLRenderable> &object) {
+        objects.erase(std::remove(objects.begin(), objects.end(), object), objects.end());
+    }
 
     void render() {
-        for (auto&& r: objects) {
-            r->render(camera.getViewMatrix(), camera.getProjectionMatrix());
+        // group objects sharing a program and polygon mode, so that consecutive draws don't rebind state
+        if (!sorted) {
+            std::stable_sort(objects.begin(), objects.end(), [](auto&& a, auto&& b) {
+                return std::make_pair(a->getShaderPipeline(), a->getPolygonMode()) <
+                    std::make_pair(b->getShaderPipeline(), b->getPolygonMode());
+            });
+            sorted = true;
+        }
+
+        ProfileScope scope("GLScene::render", true);
+
+        GLint bound[4];
+        glGetIntegerv(GL_VIEWPORT, bound);
+        const glm::ivec4 viewport { bound[0], bound[1], bound[2], bound[3] };
+        const size_t count = std::max(views.size(), (size_t)1);
+
+        std::vector<glm::ivec4> rects;
+        std::vector<CameraBlock> blocks;
+        for (size_t i=0; i != count; i++) {
+            GLCamera view = views.empty() ? camera : views[i];
+            glm::ivec4 rect = split_viewport(viewport, i, count);
+            view.setAspectRatio((float)rect.z / (float)rect.w);
+            rects.push_back(rect);
+            blocks.push_back(CameraBlock { view.getViewMatrix(), view.getProjectionMatrix() });
+        }
+        if (!cameraBuffer)
+            cameraBuffer = std::make_unique<GLCameraBuffer>();
+        cameraBuffer->upload(blocks);
+
+        // objects are drawn in the same order in every view, so only the viewport and the range
+        // of the camera buffer change in between, pipelines stay bound from the previous view
+        GLShaderPipeline::invalidateBinding();
+        for (size_t i=0; i != count; i++) {
+            if (count > 1)
+                glViewport(rects[i].x, rects[i].y, rects[i].z, rects[i].w);
+            cameraBuffer->bind(i);
+            for (auto&& r: objects) {
+                r->render(blocks[i].view, blocks[i].projection);
+            }
         }
+        cameraBuffer->fence();
+        if (count > 1)
+            glViewport(viewport.x, viewport.y, viewport.z, viewport.w);
+    }
+
+    // draws into target instead of the bound framebuffer, which is left bound
+    void render(GLRenderTarget &target) {
+        target.bind();
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        render();
     }
 };
 
@@ -77,13 +161,15 @@ struct App {
     double camY = 0.0;
     double radius = 50.0;
     double movementSpeed = 0.5f;
+    RenderScheduler scheduler {};
 
     void tickInputEvents() {
         if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
             double xpos, ypos;
             glfwGetCursorPos(window, &xpos, &ypos);
 
-            if (lastLeftButton) {
+            if (lastLeftButton && (xpos != lastX || ypos != lastY)) {
+                scheduler.invalidateScene();
                 double xoffset = xpos - lastX;
                 double yoffset = ypos - lastY;
 
@@ -116,6 +202,11 @@ struct App {
             lastLeftButton = false;
         }
 
+        updateCamera();
+    }
+
+    // positions the camera from camRx, camRy, camX, camY and radius
+    void updateCamera() {
         scene.camera.where.x = camX;
         scene.camera.where.z = camY;
         scene.camera.position = scene.camera.where + glm::vec3 {
@@ -133,12 +224,24 @@ struct App {
     }
 };
 
+// the window contents were damaged, the last image of the scene is still valid
 void windowRefreshCallback(GLFWwindow *window) {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     App* app = static_cast<App*>(glfwGetWindowUserPointer(window));
-    app->scene.render();
-    glfwSwapBuffers(window);
-    glFinish();
+    app->scheduler.invalidateUi();
+}
+
+// installed before ImGui's callbacks, which chain to them, so that input wakes up the main loop
+void installInputCallbacks(GLFWwindow *window) {
+    static auto invalidate = [](GLFWwindow *window) {
+        static_cast<App*>(glfwGetWindowUserPointer(window))->scheduler.invalidateUi();
+    };
+    glfwSetCursorPosCallback(window, [](GLFWwindow *window, double, double) { invalidate(window); });
+    glfwSetMouseButtonCallback(window, [](GLFWwindow *window, int, int, int) { invalidate(window); });
+    glfwSetScrollCallback(window, [](GLFWwindow *window, double, double) { invalidate(window); });
+    glfwSetKeyCallback(window, [](GLFWwindow *window, int, int, int, int) { invalidate(window); });
+    glfwSetCharCallback(window, [](GLFWwindow *window, unsigned int) { invalidate(window); });
+    glfwSetCursorEnterCallback(window, [](GLFWwindow *window, int) { invalidate(window); });
+    glfwSetWindowFocusCallback(window, [](GLFWwindow *window, int) { invalidate(window); });
 }
 
 void initOpenGL() {
@@ -161,11 +264,607 @@ void initOpenGL() {
 
 // rotate by mouse - kinda works, TODO math
 
+// implicit surface extracted on a worker thread, see update_surface
+struct SurfaceJob {
+    GLMesh mesh;
+    // the mesh spans [-range, range]^3
+    float range;
+};
+
+struct Plot {
+    char buf[1024] = "sin(x)+cos(y)";
+    // GLSL code generated from buf
+    GlslCode glsl {};
+    Bytecode bytecode {};
+    // structural hash of the formula (see Expression::hash), identifies it in caches
+    uint64_t hash = 0;
+    std::shared_ptr<const Expression> expr {};
+    // changed whenever compile replaces the formula by a structurally different one, unique
+    // across plots, so it also tells a plot from the one that was at its index before a removal
+    uint64_t revision = 0;
+    std::string error = "";
+    // formula uses z, drawn as the implicit surface f(x, y, z) = 0 instead of a height field
+    bool implicit = false;
+    std::shared_ptr<GLMeshObject> surface {};
+    // of the mesh of surface, see place_surface
+    float surfaceRange = 1.0f;
+    // extraction running on a worker thread, taken by poll_surface once it's done
+    std::future<SurfaceJob> surfaceJob {};
+    // the formula or the settings changed while surfaceJob was running, it's started again when done
+    bool surfaceStale = false;
+    // samples of the formula reused by every contour level, empty if contours are off
+    std::optional<ContourGrid> contourGrid {};
+    std::vector<ContourLine> contourLines {};
+    std::shared_ptr<GLMeshObject> contours {};
+    // of the formula over the plotted domain, see update_value_ranges
+    ValueRange valueRange {};
+    // of the plane and contours of the plot, identity unless auto scale is on
+    HeightScale heightScale {};
+
+    Plot() {
+        compile();
+    }
+
+    // keeps the last successfully compiled formula on error
+    bool compile() {
+        ProfileScope scope("compile_formula");
+        CompiledFormula compiled = compile_formula<ProfileScope>(buf);
+        if (!compiled.ok) {
+            if (compiled.error.stage == FormulaStage::Compile) {
+                error = "Failed to compile: " + compiled.error.what;
+            } else {
+                error = "Failed to parse: " + compiled.error.what + " in " + std::to_string(compiled.error.pos);
+            }
+            return false;
+        }
+
+        // equal hashes are confirmed by comparing the trees, so a collision can't keep a stale formula
+        if (!expr || compiled.hash != hash || !compiled.expr->equals(*expr)) {
+            static uint64_t revisions = 0;
+            revision = ++revisions;
+        }
+
+        glsl = std::move(compiled.glsl);
+        hash = compiled.hash;
+        expr = std::move(compiled.expr);
+        bytecode = std::move(compiled.bytecode);
+        implicit = is_implicit(bytecode);
+        error = "";
+        return true;
+    }
+};
+
+std::vector<GlslCode> plot_glsl(const std::vector<Plot>& plots) {
+    std::vector<GlslCode> result;
+    for (auto&& plot: plots) {
+        // z isn't available in plane.tese
+        result.push_back(plot.implicit ? GlslCode {} : plot.glsl);
+    }
+    return result;
+}
+
+std::vector<Bytecode> plot_bytecodes(const std::vector<Plot>& plots) {
+    std::vector<Bytecode> result;
+    for (auto&& plot: plots) {
+        result.push_back(plot.bytecode);
+    }
+    return result;
+}
+
+// 0 for implicit plots, which aren't drawn from tiles
+std::vector<uint64_t> plot_hashes(const std::vector<Plot>& plots) {
+    std::vector<uint64_t> result;
+    for (auto&& plot: plots) {
+        result.push_back(plot.implicit ? 0 : plot.hash);
+    }
+    return result;
+}
+
+// lays out plots side by side in a square grid, plot i evaluating formula i
+glm::mat4 plot_model(size_t i, size_t count) {
+    const float spacing = 140.0f;
+    size_t columns = std::ceil(std::sqrt((double)count));
+
+    return glm::translate(glm::mat4(1.0f), glm::vec3(
+        -60.0f + spacing * (i % columns),
+        0.0f,
+        -60.0f + spacing * (i / columns)
+    ));
+}
+
+std::vector<GLMeshInstance> plot_instances(const std::vector<Plot>& plots, glm::vec2 center, bool includeImplicit) {
+    std::vector<GLMeshInstance> result;
+    for (size_t i=0; i != plots.size(); i++) {
+        if (plots[i].implicit && !includeImplicit)
+            continue;
+
+        result.push_back(GLMeshInstance {
+            .model = plot_model(i, plots.size()),
+            .center = center,
+            .formula = (GLint)i,
+        });
+    }
+    return result;
+}
+
+// what the views of the split screen differ in, see update_views
+enum class SplitMode {
+    // view i is centered on plot i, all from the same angle
+    Plots,
+    // every view is centered on the first plot, view i turned by i / views of a full turn
+    Angles,
+};
+
+// sets the cameras of the split screen, one per view, derived from the camera of app (which is
+// centered on plot 0), none if views <= 1
+void update_views(App &app, size_t plotCount, SplitMode mode, int views) {
+    app.scene.views.clear();
+    if (views <= 1)
+        return;
+
+    for (int i=0; i != views; i++) {
+        GLCamera view = app.scene.camera;
+        if (mode == SplitMode::Plots) {
+            size_t plot = i % std::max(plotCount, (size_t)1);
+            glm::vec3 offset = glm::vec3(plot_model(plot, plotCount)[3] - plot_model(0, plotCount)[3]);
+            view.where += offset;
+            view.position += offset;
+        } else {
+            double angle = 2.0 * glm::pi<double>() * i / views;
+            glm::vec3 arm = view.position - view.where;
+            view.position = view.where + glm::vec3 {
+                arm.x * std::cos(angle) - arm.z * std::sin(angle),
+                arm.y,
+                arm.x * std::sin(angle) + arm.z * std::cos(angle),
+            };
+        }
+        app.scene.views.push_back(view);
+    }
+}
+
+void place_surface(Plot &plot, size_t i, size_t count) {
+    if (!plot.surface)
+        return;
+
+    // the plane mesh spans [-1, 127] before plot_model, center the surface on it
+    glm::mat4 model = glm::translate(plot_model(i, count), glm::vec3(63.0f, 0.0f, 63.0f));
+    plot.surface->set_instances({ GLMeshInstance {
+        .model = glm::scale(model, glm::vec3(60.0f / plot.surfaceRange)),
+        .center = glm::vec2 { 0.0f, 0.0f },
+        .formula = (GLint)i,
+    } });
+}
+
+// starts extracting the implicit surface of the plot over the cube [-range, range]^3 on a worker
+// thread, so typing a formula doesn't stall the UI, if an extraction is already running it's
+// started again with the latest formula once that one is done, see poll_surface
+void update_surface(Plot &plot, GLScene &scene, int resolution, float range) {
+    if (!plot.implicit) {
+        if (plot.surface) {
+            scene.remove(plot.surface);
+            plot.surface.reset();
+        }
+        plot.surfaceStale = false;
+        return;
+    }
+
+    if (plot.surfaceJob.valid()) {
+        plot.surfaceStale = true;
+        return;
+    }
+
+    plot.surfaceJob = std::async(std::launch::async, [bytecode = plot.bytecode, resolution, range]() {
+        ProfileScope scope("extract_isosurface");
+        SurfaceJob job {
+            .mesh = extract_isosurface(bytecode, glm::dvec3 { -range, -range, -range }, glm::dvec3 { range, range, range }, resolution),
+            .range = range,
+        };
+        // wakes the main loop if it's waiting for events
+        glfwPostEmptyEvent();
+        return job;
+    });
+}
+
+// shows the surface of plot i once its extraction is done, scaled to fill its grid cell,
+// returns true if the scene changed
+bool poll_surface(Plot &plot, size_t i, size_t count, GLScene &scene,
+        std::shared_ptr<GLShaderPipeline> surfaceShaders, int resolution, float range) {
+    if (!plot.surfaceJob.valid() || plot.surfaceJob.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return false;
+
+    SurfaceJob job = plot.surfaceJob.get();
+    // the outdated surface is still shown until the next one is done
+    if (plot.surfaceStale) {
+        plot.surfaceStale = false;
+        update_surface(plot, scene, resolution, range);
+    }
+    if (!plot.implicit)
+        return false;
+
+    if (!plot.surface) {
+        plot.surface = std::make_shared<GLMeshObject>(GLMesh {}, surfaceShaders);
+        plot.surface->set_name("surface");
+        scene.add(plot.surface);
+    }
+    plot.surface->stream_mesh(std::move(job.mesh));
+    plot.surfaceRange = job.range;
+    place_surface(plot, i, count);
+    return true;
+}
+
+// extent of generate_plane_mesh(128) in x and z before plot_model
+const double PLANE_MIN = -1.0;
+const double PLANE_MAX = 127.0;
+// 0.5 units per cell, see tile_cell
+const int CONTOUR_LOD = 2;
+const float PLANE_TESS_LEVEL = 5.0f;
+
+// y extent of the plane over the plotted domain before the height scale, for culling it in
+// views that don't show it, conservative rather than sampled, so narrow peaks are inside too:
+// the union of the interval bounds of the formulas (see evaluate_interval) over a grid of boxes
+// covering the domain, padded for float evaluation and the approximate math tiers on the GPU,
+// infinite if a formula is animated or unbounded
+glm::vec2 plane_height_bounds(const std::vector<Plot>& plots, glm::vec2 center) {
+    const int BOXES = 16;
+    const double size = (PLANE_MAX - PLANE_MIN) / BOXES;
+    double min = 0.0, max = 0.0;
+    for (auto&& plot: plots) {
+        if (plot.implicit)
+            continue;
+        if (is_animated(plot.bytecode))
+            return glm::vec2 { -INFINITY, INFINITY };
+
+        for (int i=0; i != BOXES; i++) {
+            for (int j=0; j != BOXES; j++) {
+                double x = PLANE_MIN + center.x + size * i;
+                double y = PLANE_MIN + center.y + size * j;
+                Interval bounds = evaluate_interval(plot.bytecode, Interval { x, x + size }, Interval { y, y + size });
+                // NaN bounds (e.g. inf - inf) aren't bounds either
+                if (!(std::isfinite(bounds.lo) && std::isfinite(bounds.hi)))
+                    return glm::vec2 { -INFINITY, INFINITY };
+                min = std::min(min, bounds.lo);
+                max = std::max(max, bounds.hi);
+            }
+        }
+    }
+
+    double padding = (max - min) * 0.01 + 1.0;
+    return glm::vec2 { (float)(min - padding), (float)(max + padding) };
+}
+
+// where plane.tese takes formula values from
+enum class PlaneBackend {
+    // func generated from the formulas, recompiled on every change
+    Glsl,
+    // plane_bytecode.tese
+    Bytecode,
+    // plane_cached.tese
+    Tiles,
+};
+
+void place_contours(Plot &plot, size_t i, size_t count, glm::vec2 center) {
+    if (!plot.contours)
+        return;
+
+    plot.contours->set_instances({ GLMeshInstance {
+        .model = plot_model(i, count) * plot.heightScale.transform(),
+        .center = center,
+        .formula = (GLint)i,
+    } });
+}
+
+// extracts levels contour lines of plot i over the plotted domain, drawn over its plane,
+// the formula is sampled again only if resample is set (formula or center changed)
+void update_contours(Plot &plot, size_t i, size_t count, GLScene &scene, TileCache &cache,
+        std::shared_ptr<GLShaderPipeline> contourShaders, glm::vec2 center, int levels, bool enabled, bool resample) {
+    if (!enabled || plot.implicit) {
+        if (plot.contours) {
+            scene.remove(plot.contours);
+            plot.contours.reset();
+        }
+        plot.contourGrid.reset();
+        plot.contourLines.clear();
+        return;
+    }
+
+    ProfileScope scope("update_contours");
+    if (resample || !plot.contourGrid) {
+        plot.contourGrid.emplace(cache, plot.bytecode, plot.hash,
+            glm::dvec2 { PLANE_MIN + center.x, PLANE_MIN + center.y },
+            glm::dvec2 { PLANE_MAX + center.x, PLANE_MAX + center.y },
+            CONTOUR_LOD);
+    }
+
+    Interval range = plot.contourGrid->get_range();
+    plot.contourLines = plot.contourGrid->extract(contour_levels(range, levels));
+
+    if (!plot.contours) {
+        plot.contours = std::make_shared<GLMeshObject>(GLMesh {}, contourShaders);
+        plot.contours->set_primitive(GL_LINE_STRIP);
+        plot.contours->set_name("contours");
+        scene.add(plot.contours);
+    }
+    plot.contours->stream_mesh(contour_mesh(plot.contourLines, glm::dvec2 { center.x, center.y }, range));
+    place_contours(plot, i, count, center);
+}
+
+// reduces the range of every explicit plot over the plotted domain from the tiles of cache and
+// applies it: the colormap range of plane.frag and the height scale of the plane and contours
+// (auto_height_scale if autoScale is set), CPU sampled like the tiles, so at t = 0. the culling
+// bounds of the plane are updated as well, see plane_height_bounds
+void update_value_ranges(std::vector<Plot> &plots, TileCache &cache, GLValueRanges &valueRanges,
+        GLMeshObject &plane, glm::vec2 center, bool autoScale) {
+    ProfileScope scope("update_value_ranges");
+    std::vector<ValueRange> ranges;
+    for (size_t i=0; i != plots.size(); i++) {
+        Plot &plot = plots[i];
+        plot.valueRange = plot.implicit ? ValueRange {} : tile_value_range(cache, plot.bytecode, plot.hash,
+            glm::dvec2 { PLANE_MIN + center.x, PLANE_MIN + center.y },
+            glm::dvec2 { PLANE_MAX + center.x, PLANE_MAX + center.y },
+            CONTOUR_LOD);
+        plot.heightScale = autoScale ? auto_height_scale(plot.valueRange) : HeightScale {};
+        ranges.push_back(plot.valueRange);
+        place_contours(plot, i, plots.size(), center);
+    }
+    valueRanges.upload(ranges);
+
+    std::vector<GLMeshInstance> instances = plot_instances(plots, center, false);
+    for (auto&& instance: instances) {
+        instance.model = instance.model * plots[instance.formula].heightScale.transform();
+    }
+    plane.set_instances(std::move(instances));
+
+    glm::vec2 heightBounds = plane_height_bounds(plots, center);
+    plane.set_height_bounds(heightBounds.x, heightBounds.y);
+}
+
+// the probed value next to the formula evaluated again on the CPU in double precision at the
+// same point, their difference is the error of what's plotted (float evaluation, tile interpolation)
+void drawProbe(const ProbeSample &sample, const std::vector<Plot> &plots, double time) {
+    if (!sample.hit || sample.formula >= plots.size() || plots[sample.formula].implicit) {
+        ImGui::Text("no plot under the cursor");
+        return;
+    }
+
+    double exact = evaluate(plots[sample.formula].bytecode, sample.domain.x, sample.domain.y, 0.0, time);
+    ImGui::Text("plot %zu  x %.6f  y %.6f", sample.formula, sample.domain.x, sample.domain.y);
+    ImGui::Text("f %.10g  gpu %.7g  error %.3g", exact, sample.value, std::abs(sample.value - exact));
+}
+
+void drawProfilerWindow() {
+    GLProfiler& p = profiler();
+
+    if (ImGui::Begin("Profiler")) {
+        bool enabled = p.isEnabled();
+        if (ImGui::Checkbox("enabled", &enabled))
+            p.setEnabled(enabled);
+
+        ImGui::SameLine();
+        if (ImGui::Button("dump chrome trace")) {
+            try {
+                p.dumpChromeTrace("graphcalc_trace.json");
+                std::cout << "wrote graphcalc_trace.json" << std::endl;
+            } catch (const std::runtime_error& e) {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+
+        if (ImGui::BeginTable("scopes", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit)) {
+            ImGui::TableSetupColumn("scope");
+            ImGui::TableSetupColumn("cpu p50");
+            ImGui::TableSetupColumn("cpu p95");
+            ImGui::TableSetupColumn("cpu p99");
+            ImGui::TableSetupColumn("gpu p50");
+            ImGui::TableSetupColumn("gpu p95");
+            ImGui::TableSetupColumn("gpu p99");
+            ImGui::TableHeadersRow();
+
+            for (auto&& stats: p.getStats()) {
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                ImGui::TextUnformatted(stats.name.c_str());
+                for (auto&& samples: {&stats.cpu, &stats.gpu}) {
+                    for (float q: {0.5f, 0.95f, 0.99f}) {
+                        ImGui::TableNextColumn();
+                        if (samples->empty()) {
+                            ImGui::TextUnformatted("-");
+                        } else {
+                            ImGui::Text("%.3f ms", GLProfiler::percentile(*samples, q));
+                        }
+                    }
+                }
+            }
+
+            ImGui::EndTable();
+        }
+    }
+    ImGui::End();
+}
+
 int fbWidth = 1200, fbHeight = 800;
 bool fbSizeChanged = false;
 
-int main() {
+// deterministic rendering workload, see runBenchmark
+const std::vector<std::string> BENCHMARK_FORMULAS = {
+    "sin(x)+cos(y)",
+    "sin(sqrt(x*x+y*y))/sqrt(x*x+y*y)",
+    "exp(-(x*x+y*y)/1000)*cos(x/4)*10",
+    "x**3/10000-3*x*y**2/10000+sin(x*y/50)",
+};
+const std::vector<float> BENCHMARK_TESS_LEVELS = { 1.0f, 5.0f, 16.0f, 64.0f };
+const std::vector<MathTier> BENCHMARK_MATH_TIERS = { MathTier::Exact, MathTier::Medium, MathTier::Fast };
+const int BENCHMARK_WARMUP_FRAMES = 30;
+const int BENCHMARK_FRAMES = 300;
+
+// renders every formula at every tesselation level and math tier along a scripted camera orbit
+// and pan, writing per-frame CPU frame time and GPU scene render time to csvPath
+int runBenchmark(App &app, std::vector<Plot> &plots, GLShaderPipeline &shaders, GLMeshObject &plane,
+        TileCache &cache, GLValueRanges &valueRanges, const std::string &funcShader, const std::string &csvPath) {
+    std::ofstream csv(csvPath, std::ios::out);
+    if (!csv.is_open()) {
+        std::cerr << "failed to open " << csvPath << std::endl;
+        return -1;
+    }
+    csv << "formula,math,tess_level,frame,frame_ms,gpu_ms" << std::endl;
+
+    std::vector<GLuint> queries(BENCHMARK_FRAMES);
+    glGenQueries(queries.size(), queries.data());
+
+    std::cout << "renderer: " << glGetString(GL_RENDERER) << std::endl;
+    app.scene.camera.setAspectRatio((float)fbWidth/(float)fbHeight);
+
+    for (size_t f=0; f != BENCHMARK_FORMULAS.size(); f++) {
+        Plot& plot = plots.at(0);
+        std::snprintf(plot.buf, sizeof(plot.buf), "%s", BENCHMARK_FORMULAS[f].c_str());
+        if (!plot.compile()) {
+            std::cerr << plot.error << std::endl;
+            return -1;
+        }
+
+        shaders.setTessEvalShader(funcShader + generate_func(plot_glsl(plots)));
+        update_value_ranges(plots, cache, valueRanges, plane, glm::vec2 { 0.0f, 0.0f }, true);
+        for (MathTier tier: BENCHMARK_MATH_TIERS) {
+            shaders.setLibrary(GL_TESS_EVALUATION_SHADER, "fast_math", fast_math_glsl(tier));
+
+            for (float tessLevel: BENCHMARK_TESS_LEVELS) {
+                plane.set_tess_level(tessLevel);
+
+                std::vector<double> frameMs;
+                auto last = std::chrono::steady_clock::now();
+
+                for (int i=-BENCHMARK_WARMUP_FRAMES; i != BENCHMARK_FRAMES; i++) {
+                    // one full orbit while panning around a circle, the same for every workload
+                    double t = (double)std::max(i, 0) / BENCHMARK_FRAMES;
+                    app.camRx = 2.0 * glm::pi<double>() * t;
+                    app.camRy = 0.3 + 0.4 * std::sin(2.0 * glm::pi<double>() * t);
+                    app.camX = 20.0 * std::sin(2.0 * glm::pi<double>() * t);
+                    app.camY = 20.0 * std::cos(2.0 * glm::pi<double>() * t);
+                    app.updateCamera();
+
+                    profiler().beginFrame();
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+                    if (i >= 0)
+                        glBeginQuery(GL_TIME_ELAPSED, queries[i]);
+                    app.scene.render();
+                    if (i >= 0)
+                        glEndQuery(GL_TIME_ELAPSED);
+
+                    glfwSwapBuffers(app.window);
+                    glfwPollEvents();
+
+                    auto now = std::chrono::steady_clock::now();
+                    if (i >= 0)
+                        frameMs.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+                    last = now;
+                }
+
+                // results are read only after the whole run, so that the measured frames never wait on them
+                glFinish();
+                std::vector<float> gpuMs;
+                for (int i=0; i != BENCHMARK_FRAMES; i++) {
+                    GLuint64 ns = 0;
+                    glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &ns);
+                    gpuMs.push_back(ns / 1e6);
+
+                    csv << f << "," << math_tier_name(tier) << "," << tessLevel << "," << i << "," << frameMs[i] << "," << gpuMs.back() << "\n";
+                }
+
+                std::vector<float> cpuMs(frameMs.begin(), frameMs.end());
+                std::printf("formula %zu %-6s tess %5.1f  frame p50 %7.3f p95 %7.3f p99 %7.3f ms  gpu p50 %7.3f p95 %7.3f p99 %7.3f ms\n",
+                    f, math_tier_name(tier), tessLevel,
+                    GLProfiler::percentile(cpuMs, 0.5f), GLProfiler::percentile(cpuMs, 0.95f), GLProfiler::percentile(cpuMs, 0.99f),
+                    GLProfiler::percentile(gpuMs, 0.5f), GLProfiler::percentile(gpuMs, 0.95f), GLProfiler::percentile(gpuMs, 0.99f));
+            }
+        }
+    }
+
+    glDeleteQueries(queries.size(), queries.data());
+    std::cout << "wrote " << csvPath << std::endl;
+    return 0;
+}
+
+const int RECORDING_WIDTH = 1280;
+const int RECORDING_HEIGHT = 720;
+
+// renders frames of plot 0 at t = i / fps into an offscreen framebuffer without vsync and
+// writes them to dir as frame_00000.ppm, ..., the readback of a frame overlaps rendering of
+// the following ones (see GLFrameRecorder), animating only changes the t uniform
+int runRecording(App &app, std::vector<Plot> &plots, GLShaderPipeline &shaders, GLMeshObject &plane,
+        TileCache &cache, GLValueRanges &valueRanges, const std::string &funcShader, const std::string &dir,
+        int frames, double fps, const std::string &formula) {
+    if (!formula.empty()) {
+        Plot& plot = plots.at(0);
+        std::snprintf(plot.buf, sizeof(plot.buf), "%s", formula.c_str());
+        if (!plot.compile()) {
+            std::cerr << plot.error << std::endl;
+            return -1;
+        }
+        shaders.setTessEvalShader(funcShader + generate_func(plot_glsl(plots)));
+        update_value_ranges(plots, cache, valueRanges, plane, glm::vec2 { 0.0f, 0.0f }, true);
+    }
+    shaders.setLibrary(GL_TESS_EVALUATION_SHADER, "fast_math", fast_math_glsl(MathTier::Exact));
+
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    if (error) {
+        std::cerr << "failed to create " << dir << ": " << error.message() << std::endl;
+        return -1;
+    }
+
+    bool failed = false;
+    GLFrameRecorder recorder(RECORDING_WIDTH, RECORDING_HEIGHT, [&](size_t frame, const uint8_t* rgb) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "frame_%05zu.ppm", frame);
+        try {
+            write_ppm((std::filesystem::path(dir) / name).string(), RECORDING_WIDTH, RECORDING_HEIGHT, rgb);
+        } catch (const std::runtime_error& e) {
+            if (!failed)
+                std::cerr << e.what() << std::endl;
+            failed = true;
+        }
+    });
+
+    app.scene.camera.setAspectRatio((float)RECORDING_WIDTH/(float)RECORDING_HEIGHT);
+    app.updateCamera();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i=0; i != frames && !failed; i++) {
+        profiler().beginFrame();
+        plane.set_time(i / fps);
+
+        recorder.bind();
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        app.scene.render();
+        recorder.capture();
+
+        glfwPollEvents();
+    }
+    recorder.finish();
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("recorded %d frames in %.2f s (%.1f fps) to %s\n", frames, seconds, frames / seconds, dir.c_str());
+    return failed ? -1 : 0;
+}
+
+
+int main(int argc, char** argv) {
+    // the trace starts with the process, startup is recorded as an event of it
+    auto startTime = profiler().getStartTime();
+    // --bench [out.csv] renders a fixed workload without vsync and exits, see runBenchmark
+    bool benchmark = argc > 1 && std::string(argv[1]) == "--bench";
+    std::string benchmarkCsv = argc > 2 ? argv[2] : "bench_render.csv";
+    // --record dir [frames] [fps] [formula] renders an animation headless and exits, see runRecording
+    bool recording = argc > 2 && std::string(argv[1]) == "--record";
+    int recordingFrames = argc > 3 ? std::atoi(argv[3]) : 300;
+    double recordingFps = argc > 4 ? std::atof(argv[4]) : 60.0;
+    std::string recordingFormula = argc > 5 ? argv[5] : "";
+    bool headless = benchmark || recording;
+
     initOpenGL();
+    if (headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
     GLFWwindow* window = glfwCreateWindow(1200, 800, "graphcalc", nullptr, nullptr);
     if (!window) {
@@ -176,7 +875,7 @@ int main() {
     }
     glfwMakeContextCurrent(window);
 
-    glfwSwapInterval(1);
+    glfwSwapInterval(headless ? 0 : 1);
 
     glewExperimental = true;
     auto glew_init_result = glewInit();
@@ -186,37 +885,128 @@ int main() {
         return -1;
     }
 
+    // programs are linked on first use, from binaries of the previous runs where possible
+    GLShaderPipeline::enableProgramCache("graphcalc_cache");
+
     glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
     glfwSetInputMode(window, GLFW_STICKY_MOUSE_BUTTONS, GL_TRUE);
     // glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
     glEnable(GL_DEPTH_TEST);
+    glEnable(GL_PRIMITIVE_RESTART);
+    glPrimitiveRestartIndex(PRIMITIVE_RESTART_INDEX);
 
-    std::shared_ptr<GLShaderPipeline> shaders = std::make_shared<GLShaderPipeline>();
-    // shaders->setVertexShader(readFile("shaders/main.vert"));
-    // shaders->setFragmentShader(readFile("shaders/main.frag"));
-    shaders->setVertexShader(readFile("shaders/plane.vert"));
-    shaders->setFragmentShader(readFile("shaders/plane.frag"));
-    shaders->setTessCtrlShader(readFile("shaders/plane.tesc"));
-    std::string tessEvalShader = readFile("shaders/plane.tese");
-    std::string calcFunc = "float func(float x, float y) { return sin(x) + cos(y); }";
-    shaders->setTessEvalShader(tessEvalShader + calcFunc);
+    // separable, so that a formula change compiles only func and relinks only the tess eval stage
+    std::shared_ptr<GLShaderPipeline> shaders = std::make_shared<GLShaderPipeline>(GLShaderPipeline::separableSupported());
+    // shaders->setVertexShader(readShader("shaders/main.vert"));
+    // shaders->setFragmentShader(readShader("shaders/main.frag"));
+    shaders->setVertexShader(readShader("shaders/plane.vert"));
+    shaders->setFragmentShader(readShader("shaders/plane.frag"));
+    shaders->setTessCtrlShader(readShader("shaders/plane.tesc"));
+    // the gc_* wrappers and the math tier are compiled once, the shader of the stage is just func
+    shaders->setLibrary(GL_TESS_EVALUATION_SHADER, "plane", readShader("shaders/plane.tese"));
+    std::string funcShader = readShader("shaders/plane_func.glsl");
+    std::vector<Plot> plots(1);
+    // extractions of removed plots, kept until they're done since destroying the future of a
+    // running std::async blocks until it returns
+    std::vector<std::future<SurfaceJob>> orphanedSurfaces;
+    // approximations of transcendental functions used by the plane pipelines, see fast_math.hpp
+    MathTier mathTier = MathTier::Exact;
+    shaders->setLibrary(GL_TESS_EVALUATION_SHADER, "fast_math", fast_math_glsl(mathTier));
+    shaders->setTessEvalShader(funcShader + generate_func(plot_glsl(plots)));
     shaders->setPatchVertices(3);
 
+    // fixed program interpreting formulas from bytecodeBuffer, formula changes don't recompile it
+    GLBytecodeBuffer bytecodeBuffer;
+    bytecodeBuffer.upload(plot_bytecodes(plots));
+    std::shared_ptr<GLShaderPipeline> bytecode_shaders = std::make_shared<GLShaderPipeline>(GLShaderPipeline::separableSupported());
+    bytecode_shaders->setVertexShader(readShader("shaders/plane.vert"));
+    bytecode_shaders->setFragmentShader(readShader("shaders/plane.frag"));
+    bytecode_shaders->setTessCtrlShader(readShader("shaders/plane.tesc"));
+    bytecode_shaders->setTessEvalShader(readShader("shaders/plane_bytecode.tese"));
+    bytecode_shaders->setLibrary(GL_TESS_EVALUATION_SHADER, "fast_math", fast_math_glsl(mathTier));
+    bytecode_shaders->setPatchVertices(3);
+    bytecodeBuffer.attach(*bytecode_shaders);
+
+    // fixed program reading formula values sampled on the CPU, see tile_texture.hpp
+    TileCache tileCache;
+    GLTileTextures tileTextures;
+    std::shared_ptr<GLShaderPipeline> cached_shaders = std::make_shared<GLShaderPipeline>();
+    cached_shaders->setVertexShader(readShader("shaders/plane.vert"));
+    cached_shaders->setFragmentShader(readShader("shaders/plane.frag"));
+    cached_shaders->setTessCtrlShader(readShader("shaders/plane.tesc"));
+    cached_shaders->setTessEvalShader(readShader("shaders/plane_cached.tese"));
+    cached_shaders->setPatchVertices(3);
+    tileTextures.attach(*cached_shaders);
+
+    PlaneBackend backend = PlaneBackend::Glsl;
+
     std::shared_ptr<GLMeshObject> plane = std::make_shared<GLMeshObject>(generate_plane_mesh(128), shaders);
     plane->set_tesselation(true);
+    plane->set_name("plane");
+    plane->set_tess_level(PLANE_TESS_LEVEL);
 
     std::shared_ptr<GLShaderPipeline> grid_shaders = std::make_shared<GLShaderPipeline>();
-    grid_shaders->setVertexShader(readFile("shaders/grid.vert"));
-    grid_shaders->setFragmentShader(readFile("shaders/grid.frag"));
+    grid_shaders->setVertexShader(readShader("shaders/grid.vert"));
+    grid_shaders->setFragmentShader(readShader("shaders/grid.frag"));
 
     std::shared_ptr<GLMeshObject> grid = std::make_shared<GLMeshObject>(generate_plane_mesh(128), grid_shaders);
     grid->set_wireframe_mode(true);
+    grid->set_name("grid");
+
+    std::shared_ptr<GLShaderPipeline> surface_shaders = std::make_shared<GLShaderPipeline>();
+    surface_shaders->setVertexShader(readShader("shaders/surface.vert"));
+    surface_shaders->setFragmentShader(readShader("shaders/surface.frag"));
+    int surfaceResolution = 96;
+    float surfaceRange = 10.0f;
+
+    std::shared_ptr<GLShaderPipeline> contour_shaders = std::make_shared<GLShaderPipeline>();
+    contour_shaders->setVertexShader(readShader("shaders/grid.vert"));
+    contour_shaders->setFragmentShader(readShader("shaders/contour.frag"));
+    bool showContours = false;
+    int contourLevels = 10;
+    // of the adaptively sampled meshes of explicit plots, see AdaptiveOptions
+    float meshTolerance = 0.01f;
+
+    for (auto&& pipeline: { shaders, bytecode_shaders, cached_shaders, grid_shaders, surface_shaders, contour_shaders })
+        pipeline->setUniformBlock("Camera", CAMERA_BLOCK_BINDING);
+
+    // colors the plane pipelines map values to, see value_range.hpp
+    GLValueRanges valueRanges;
+    GLColormap colormap;
+    for (auto&& pipeline: { shaders, bytecode_shaders, cached_shaders }) {
+        valueRanges.attach(*pipeline);
+        colormap.attach(*pipeline);
+    }
+    // taller plots are scaled down to fit, see auto_height_scale
+    bool autoScale = true;
+    update_value_ranges(plots, tileCache, valueRanges, *plane, glm::vec2 { 0.0f, 0.0f }, autoScale);
+    // split screen, see update_views
+    int splitViews = 1;
+    SplitMode splitMode = SplitMode::Plots;
 
     App app { .window = window };
-    app.scene.objects.push_back(plane);
-    app.scene.objects.push_back(grid);
+    app.scene.add(plane);
+    app.scene.add(grid);
+
+    if (benchmark) {
+        app.updateCamera();
+        int result = runBenchmark(app, plots, *shaders, *plane, tileCache, valueRanges, funcShader, benchmarkCsv);
+        profiler().release();
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return result;
+    }
+
+    if (recording) {
+        int result = runRecording(app, plots, *shaders, *plane, tileCache, valueRanges, funcShader,
+            argv[2], recordingFrames, recordingFps, recordingFormula);
+        profiler().release();
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return result;
+    }
 
     glfwSetWindowRefreshCallback(window, windowRefreshCallback);
     glfwSetWindowUserPointer(window, &app);
@@ -230,6 +1020,24 @@ int main() {
     };
 
     glfwSetFramebufferSizeCallback(window, fbSizeCallback);
+    installInputCallbacks(window);
+
+    // the callback is only called on changes, e.g. not for the initial size on high DPI displays
+    glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+    glViewport(0, 0, fbWidth, fbHeight);
+    app.scene.camera.setAspectRatio((float)fbWidth/(float)fbHeight);
+    // last image of the scene, reused while only the UI changes, and what's under every pixel of it
+    GLRenderTarget sceneTarget(fbWidth, fbHeight, true);
+    GLProbeReader probeReader;
+    std::optional<glm::ivec2> probedPixel;
+    std::optional<ProbeSample> hovered;
+    std::optional<ProbeSample> pinned;
+    // revision of the pinned plot, the pin is dropped when it changes
+    uint64_t pinnedRevision = 0;
+    // the scene is drawn coarse while it changes and refined once it stops
+    RefinementController refinement(PLANE_TESS_LEVEL);
+    GLSceneTimer sceneTimer;
+    float targetFps = 60.0f;
 
     ImGui::CreateContext();
     ImGuiIO& io = ImGui::GetIO();
@@ -237,66 +1045,395 @@ int main() {
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init();
 
-    std::string error_str = "";
-    char buf[1024] = {0};
-
     float center_x = 0;
     float center_y = 0;
 
+    // t of the formulas, advanced by the elapsed time while playing
+    float time = 0.0f;
+    float timeSpeed = 1.0f;
+    bool playing = false;
+    double lastFrameTime = glfwGetTime();
+    bool firstFrame = true;
+
     while (!glfwWindowShouldClose(window)) {
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        double frameTime = glfwGetTime();
+        if (playing) {
+            time += (frameTime - lastFrameTime) * timeSpeed;
+            // the UI shows the time even if no formula depends on it
+            if (std::any_of(plots.begin(), plots.end(), [](const Plot &plot) { return is_animated(plot.bytecode); }))
+                app.scheduler.invalidateScene();
+            else
+                app.scheduler.invalidateUi();
+        }
+        lastFrameTime = frameTime;
+        plane->set_time(time);
+
+        if (fbSizeChanged) {
+            glViewport(0, 0, fbWidth, fbHeight);
+            app.scene.camera.setAspectRatio((float)fbWidth/(float)fbHeight);
+            sceneTarget.resize(fbWidth, fbHeight);
+            app.scheduler.invalidateScene();
+            fbSizeChanged = false;
+        }
 
         if (!ImGui::GetIO().WantCaptureMouse)
             app.tickInputEvents();
 
-        app.scene.render();
+        for (size_t i=0; i != plots.size(); i++) {
+            if (poll_surface(plots[i], i, plots.size(), app.scene, surface_shaders, surfaceResolution, surfaceRange))
+                app.scheduler.invalidateScene();
+        }
+        orphanedSurfaces.erase(std::remove_if(orphanedSurfaces.begin(), orphanedSurfaces.end(), [](auto &job) {
+            return job.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }), orphanedSurfaces.end());
+
+        // nothing changed since the last frame, which stays on screen
+        if (!app.scheduler.needsFrame()) {
+            glfwWaitEventsTimeout(RenderScheduler::IDLE_TIMEOUT);
+            continue;
+        }
+
+        profiler().beginFrame();
+
+        bool sceneDrawn = app.scheduler.needsScene();
+        if (sceneDrawn) {
+            if (app.scheduler.isSceneChanged())
+                refinement.restart();
+            update_views(app, plots.size(), splitMode, splitViews);
+            RefinementLevel level = refinement.level();
+            plane->set_tess_level(level.tessLevel);
+            sceneTarget.set_scale(level.scale);
+
+            sceneTimer.begin(level);
+            app.scene.render(sceneTarget);
+            sceneTimer.end();
+            app.scheduler.sceneDrawn();
+
+            refinement.frameDrawn();
+            if (refinement.isRefining())
+                app.scheduler.refineScene();
+        }
+        sceneTimer.poll([&](RefinementLevel level, float ms) { refinement.measured(level, ms); });
+
+        bool overScene = !ImGui::GetIO().WantCaptureMouse && glfwGetWindowAttrib(window, GLFW_HOVERED);
+        if (overScene) {
+            double cursorX, cursorY;
+            int windowWidth, windowHeight;
+            glfwGetCursorPos(window, &cursorX, &cursorY);
+            glfwGetWindowSize(window, &windowWidth, &windowHeight);
+            // window coordinates from the top left to framebuffer pixels from the bottom left
+            glm::ivec2 pixel {
+                (int)(cursorX * fbWidth / std::max(windowWidth, 1)),
+                fbHeight - 1 - (int)(cursorY * fbHeight / std::max(windowHeight, 1)),
+            };
+            if ((probedPixel != pixel || sceneDrawn) && probeReader.request(sceneTarget, pixel))
+                probedPixel = pixel;
+        }
+        if (auto sample = probeReader.poll())
+            hovered = sample;
+        // keep polling until the reads in flight arrive
+        if (probeReader.pending())
+            app.scheduler.invalidateUi();
+        {
+            ProfileScope scope("GLRenderTarget::blit_to_default", true);
+            sceneTarget.blit_to_default();
+        }
+
+        // the first frame shows only the scene, ImGui builds its font atlas and compiles its
+        // program in the first NewFrame, which is left to the next frame
+        if (firstFrame) {
+            glfwSwapBuffers(window);
+            profiler().record("first frame", startTime, std::chrono::steady_clock::now());
+            firstFrame = false;
+            app.scheduler.frameDrawn();
+            app.scheduler.invalidateUi();
+            glfwPollEvents();
+            continue;
+        }
 
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
+        if (overScene && hovered && hovered->hit) {
+            ImGui::BeginTooltip();
+            drawProbe(*hovered, plots, time);
+            ImGui::EndTooltip();
+        }
+        if (overScene && ImGui::IsMouseClicked(ImGuiMouseButton_Right)) {
+            pinned = hovered;
+            if (pinned && pinned->hit && pinned->formula < plots.size())
+                pinnedRevision = plots[pinned->formula].revision;
+        }
+
         if (ImGui::Begin("GraphCalc")) {
-            if (ImGui::InputText("formula", buf, sizeof(buf))) {
-                try {
-                    std::string calcFunc = Parser(tokenize(buf)).parse()->to_string();
-
-                    calcFunc = "float func(float x, float y) { return float(" + calcFunc + "); }";
-                    std::cout << calcFunc << std::endl;
-                    shaders->setTessEvalShader(tessEvalShader + calcFunc);
-
-                    error_str = "";
-                } catch (ParserError e) {
-                    error_str = "Failed to parse: " + e.what + " in " + std::to_string(e.pos);
-                } catch (TokenizerError e) {
-                    error_str = "Failed to parse: " + e.what + " in " + std::to_string(e.pos);
+            bool formulasChanged = false;
+            bool plotsChanged = false;
+
+            for (size_t i=0; i != plots.size(); i++) {
+                Plot& plot = plots[i];
+                ImGui::PushID(i);
+
+                if (ImGui::InputText("formula", plot.buf, sizeof(plot.buf))) {
+                    bool implicit = plot.implicit;
+                    uint64_t revision = plot.revision;
+                    // edits which don't change the structure (spaces, parentheses, operand order) are skipped
+                    if (plot.compile() && plot.revision != revision) {
+                        formulasChanged = true;
+                        plotsChanged |= implicit != plot.implicit;
+                        update_surface(plot, app.scene, surfaceResolution, surfaceRange);
+                        update_contours(plot, i, plots.size(), app.scene, tileCache, contour_shaders,
+                            glm::vec2{center_x, center_y}, contourLevels, showContours, true);
+                    }
+                }
+
+                if (plots.size() > 1) {
+                    ImGui::SameLine();
+                    if (ImGui::SmallButton("remove")) {
+                        if (plot.surface)
+                            app.scene.remove(plot.surface);
+                        if (plot.contours)
+                            app.scene.remove(plot.contours);
+                        if (plot.surfaceJob.valid())
+                            orphanedSurfaces.push_back(std::move(plot.surfaceJob));
+                        plots.erase(plots.begin() + i);
+                        plotsChanged = true;
+                        ImGui::PopID();
+                        break;
+                    }
+                }
+
+                if (!plot.error.empty())
+                    ImGui::TextColored(ImVec4(1.0f, 0.0f, 0.0f, 1.0f), "%s", plot.error.c_str());
+
+                ImGui::PopID();
+            }
+
+            if (ImGui::Button("add plot")) {
+                plots.emplace_back();
+                plotsChanged = true;
+            }
+
+            bool backendChanged = false;
+            for (auto [value, label]: { std::make_pair(PlaneBackend::Glsl, "glsl"),
+                    std::make_pair(PlaneBackend::Bytecode, "bytecode interpreter"),
+                    std::make_pair(PlaneBackend::Tiles, "tile cache") }) {
+                if (ImGui::RadioButton(label, backend == value) && backend != value) {
+                    backend = value;
+                    backendChanged = true;
+                }
+                if (value != PlaneBackend::Tiles)
+                    ImGui::SameLine();
+            }
+            if (backendChanged) {
+                plane->set_shader_pipeline(
+                    backend == PlaneBackend::Glsl ? shaders :
+                    backend == PlaneBackend::Bytecode ? bytecode_shaders : cached_shaders);
+                app.scene.sorted = false;
+            }
+
+            bool mathChanged = false;
+            if (backend != PlaneBackend::Tiles) {
+                ImGui::Text("math");
+                for (MathTier tier: { MathTier::Exact, MathTier::Medium, MathTier::Fast }) {
+                    ImGui::SameLine();
+                    if (ImGui::RadioButton(math_tier_name(tier), mathTier == tier) && mathTier != tier) {
+                        mathTier = tier;
+                        mathChanged = true;
+                    }
+                }
+            }
+            if (mathChanged) {
+                shaders->setLibrary(GL_TESS_EVALUATION_SHADER, "fast_math", fast_math_glsl(mathTier));
+                bytecode_shaders->setLibrary(GL_TESS_EVALUATION_SHADER, "fast_math", fast_math_glsl(mathTier));
+            }
+
+            if (formulasChanged || plotsChanged) {
+                bytecodeBuffer.upload(plot_bytecodes(plots));
+            }
+
+            if ((formulasChanged || plotsChanged || backendChanged) && backend == PlaneBackend::Glsl) {
+                ProfileScope scope("generate_func");
+                std::string calcFunc = generate_func(plot_glsl(plots));
+                std::cout << calcFunc << std::endl;
+                shaders->setTessEvalShader(funcShader + calcFunc);
+            }
+
+            if (plotsChanged) {
+                grid->set_instances(plot_instances(plots, glm::vec2{center_x, center_y}, true));
+                for (size_t i=0; i != plots.size(); i++) {
+                    place_surface(plots[i], i, plots.size());
+                    update_contours(plots[i], i, plots.size(), app.scene, tileCache, contour_shaders,
+                        glm::vec2{center_x, center_y}, contourLevels, showContours, false);
+                }
+            }
+
+            bool timeChanged = false;
+            if (ImGui::Button(playing ? "pause" : "play"))
+                playing = !playing;
+            ImGui::SameLine();
+            if (ImGui::Button("reset")) {
+                time = 0.0f;
+                timeChanged = true;
+            }
+            ImGui::SameLine();
+            timeChanged |= ImGui::DragFloat("t", &time, 0.01f);
+            ImGui::SameLine();
+            ImGui::SliderFloat("speed", &timeSpeed, -4.0f, 4.0f);
+
+            bool refinementChanged = false;
+            bool progressive = refinement.is_enabled();
+            if (ImGui::Checkbox("progressive", &progressive)) {
+                refinement.set_enabled(progressive);
+                refinementChanged = true;
+            }
+            ImGui::SameLine();
+            if (ImGui::SliderFloat("target fps", &targetFps, 10.0f, 144.0f))
+                refinement.set_target_fps(targetFps);
+            float tessLevel = refinement.get_full_tess_level();
+            if (ImGui::SliderFloat("tess level", &tessLevel, 1.0f, 64.0f)) {
+                refinement.set_full_tess_level(tessLevel);
+                refinementChanged = true;
+            }
+            if (progressive) {
+                const RefinementLevel& interactive = refinement.get_interactive();
+                ImGui::Text("interactive: tess level %.1f, resolution %.0f%%", interactive.tessLevel, interactive.scale * 100.0f);
+            }
+
+            bool viewsChanged = ImGui::SliderInt("views", &splitViews, 1, 9);
+            if (splitViews > 1) {
+                for (auto [value, label]: { std::make_pair(SplitMode::Plots, "a plot per view"),
+                        std::make_pair(SplitMode::Angles, "an angle per view") }) {
+                    ImGui::SameLine();
+                    if (ImGui::RadioButton(label, splitMode == value) && splitMode != value) {
+                        splitMode = value;
+                        viewsChanged = true;
+                    }
                 }
             }
 
-            ImGui::TextColored(ImVec4(1.0f, 0.0f, 0.0f, 1.0f), "%s", error_str.c_str());
+            bool surfaceSettingsChanged = ImGui::SliderInt("surface resolution", &surfaceResolution, 16, 256);
+            surfaceSettingsChanged |= ImGui::SliderFloat("surface range", &surfaceRange, 1.0f, 50.0f);
+            if (surfaceSettingsChanged) {
+                for (size_t i=0; i != plots.size(); i++) {
+                    update_surface(plots[i], app.scene, surfaceResolution, surfaceRange);
+                }
+            }
 
-            if (ImGui::DragFloat("center x", &center_x, 0.01f))
+            bool contourSettingsChanged = ImGui::Checkbox("contours", &showContours);
+            contourSettingsChanged |= ImGui::SliderInt("contour levels", &contourLevels, 1, 64);
+            if (showContours) {
+                ImGui::SameLine();
+                if (ImGui::Button("export svg")) {
+                    for (size_t i=0; i != plots.size(); i++) {
+                        std::string path = "graphcalc_contours_" + std::to_string(i) + ".svg";
+                        try {
+                            write_contours_svg(path, plots[i].contourLines,
+                                glm::dvec2 { PLANE_MIN + center_x, PLANE_MIN + center_y },
+                                glm::dvec2 { PLANE_MAX + center_x, PLANE_MAX + center_y });
+                            std::cout << "wrote " << path << std::endl;
+                        } catch (const std::runtime_error& e) {
+                            std::cerr << e.what() << std::endl;
+                        }
+                    }
+                }
+            }
+
+            if (ImGui::Button("export obj")) {
+                for (size_t i=0; i != plots.size(); i++) {
+                    if (plots[i].implicit || !plots[i].error.empty())
+                        continue;
+                    std::string path = "graphcalc_mesh_" + std::to_string(i) + ".obj";
+                    try {
+                        ProfileScope scope("sample_adaptive");
+                        AdaptiveOptions options { .tolerance = meshTolerance, .t = time };
+                        AdaptiveSampler sampler(plots[i].bytecode,
+                            glm::dvec2 { PLANE_MIN + center_x, PLANE_MIN + center_y },
+                            glm::dvec2 { PLANE_MAX + center_x, PLANE_MAX + center_y }, options);
+                        GLMesh mesh = sampler.extract();
+                        write_mesh_obj(path, mesh);
+                        std::cout << "wrote " << path << ", " << mesh.indices.size() / 3 << " triangles from "
+                            << sampler.get_samples() << " samples" << std::endl;
+                    } catch (const std::runtime_error& e) {
+                        std::cerr << e.what() << std::endl;
+                    }
+                }
+            }
+            ImGui::SameLine();
+            ImGui::DragFloat("tolerance", &meshTolerance, 0.001f, 0.0001f, 1.0f, "%.4f");
+
+            bool scaleChanged = ImGui::Checkbox("auto scale", &autoScale);
+
+            bool centerChanged = false;
+            if (ImGui::DragFloat("center x", &center_x, 0.01f)) {
                 plane->set_center_x(center_x);
+                centerChanged = true;
+            }
 
-            if (ImGui::DragFloat("center y", &center_y, 0.01f))
+            if (ImGui::DragFloat("center y", &center_y, 0.01f)) {
                 plane->set_center_y(center_y);
+                centerChanged = true;
+            }
+
+            if (contourSettingsChanged || centerChanged) {
+                for (size_t i=0; i != plots.size(); i++) {
+                    update_contours(plots[i], i, plots.size(), app.scene, tileCache, contour_shaders,
+                        glm::vec2{center_x, center_y}, contourLevels, showContours, centerChanged);
+                }
+            }
+
+            // after update_contours, which places the contours with the previous height scale
+            if (formulasChanged || plotsChanged || centerChanged || scaleChanged) {
+                update_value_ranges(plots, tileCache, valueRanges, *plane, glm::vec2 { center_x, center_y }, autoScale);
+            }
+
+            if ((formulasChanged || plotsChanged || backendChanged || centerChanged || refinementChanged) && backend == PlaneBackend::Tiles) {
+                glm::dvec2 min { PLANE_MIN + center_x, PLANE_MIN + center_y };
+                glm::dvec2 max { PLANE_MAX + center_x, PLANE_MAX + center_y };
+                // no coarser than the spacing of the tesselated vertices
+                int lod = tile_lod((PLANE_MAX - PLANE_MIN) / 127.0 / refinement.get_full_tess_level());
+                lod = tileTextures.fit_lod(lod, min, max, plots.size());
+                tileTextures.update(tileCache, plot_bytecodes(plots), plot_hashes(plots), min, max, lod);
+            }
+
+            if (formulasChanged || plotsChanged || backendChanged || mathChanged || timeChanged || surfaceSettingsChanged
+                    || contourSettingsChanged || centerChanged || refinementChanged || viewsChanged || scaleChanged) {
+                app.scheduler.invalidateScene();
+            }
+
+            ImGui::Separator();
+            // the pinned value was probed from a formula that was since edited or removed
+            if (pinned && pinned->hit && (pinned->formula >= plots.size() || plots[pinned->formula].revision != pinnedRevision))
+                pinned.reset();
+            if (pinned) {
+                drawProbe(*pinned, plots, time);
+            } else {
+                ImGui::Text("right click a plot to inspect it");
+            }
+
+            if (backend == PlaneBackend::Tiles || showContours) {
+                ImGui::Text("tile cache: %zu tiles, %zu hits, %zu misses, %zu resident on gpu",
+                    tileCache.size(), tileCache.get_hits(), tileCache.get_misses(), tileTextures.resident());
+            }
 
             ImGui::End();
         }
 
-        ImGui::EndFrame();
-        ImGui::Render();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        drawProfilerWindow();
+
+        {
+            ProfileScope scope("ImGui", true);
+            ImGui::EndFrame();
+            ImGui::Render();
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
 
         glfwSwapBuffers(window);
+        app.scheduler.frameDrawn();
         glfwPollEvents();
-
-        if (fbSizeChanged) {
-            glViewport(0, 0, fbWidth, fbHeight);
-            app.scene.camera.setAspectRatio((float)fbWidth/(float)fbHeight);
-            fbSizeChanged = false;
-        }
     }
 
+    profiler().release();
     glfwDestroyWindow(window);
     glfwTerminate();
     return 0;
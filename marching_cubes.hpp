@@ -0,0 +1,272 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "expr_bytecode.hpp"
+#include "parallel.hpp"
+#include "utils.hpp"
+
+// extraction of implicit surfaces f(x, y, z) = 0 from a uniform grid
+//
+// each cube of the grid is split into six tetrahedra along its main diagonal (marching
+// tetrahedra), which needs no 256-case tables and has no ambiguous cases, and the split is
+// the same in neighbouring cubes, so the surface is crack-free
+// http://paulbourke.net/geometry/polygonise/
+//
+// the grid is processed in blocks of ISOSURFACE_BLOCK^3 cells spread across threads, blocks
+// whose interval bounds exclude 0 are skipped without sampling, so the work and memory are
+// proportional to the size of the surface rather than to the volume. vertices on the faces of
+// a block are welded with those of its neighbours when the blocks are merged
+
+const size_t ISOSURFACE_BLOCK = 8;
+
+const int CUBE_CORNERS[8][3] = {
+    {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
+    {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1},
+};
+
+// all share the 0-6 diagonal
+const int CUBE_TETRAHEDRA[6][4] = {
+    {0, 5, 1, 6},
+    {0, 1, 2, 6},
+    {0, 2, 3, 6},
+    {0, 3, 7, 6},
+    {0, 7, 4, 6},
+    {0, 4, 5, 6},
+};
+
+class IsosurfaceExtractor {
+    const Bytecode& bytecode;
+    glm::dvec3 min;
+    glm::dvec3 cell;
+    size_t resolution;
+    size_t blocks;
+
+    struct Block {
+        std::vector<Vertex> vertices;
+        std::vector<GLuint> indices;
+        // vertices on grid edges in the faces of the block, which neighbouring blocks share,
+        // with the keys of their edges
+        std::vector<std::pair<GLuint, uint64_t>> seam;
+    };
+
+    glm::dvec3 grid_point(size_t x, size_t y, size_t z) const {
+        return glm::dvec3 { min.x + x * cell.x, min.y + y * cell.y, min.z + z * cell.z };
+    }
+
+    uint64_t point_id(size_t x, size_t y, size_t z) const {
+        return ((uint64_t)z * (resolution + 1) + y) * (resolution + 1) + x;
+    }
+
+    // colors the vertices by their normals, taken from the gradient by central differences
+    void shade(std::vector<Vertex>& vertices) const {
+        const size_t n = vertices.size();
+        std::vector<double> xs(6 * n), ys(6 * n), zs(6 * n), values(6 * n);
+        const double h = std::min({cell.x, cell.y, cell.z}) * 0.5;
+
+        for (size_t i=0; i != n; i++) {
+            for (size_t axis=0; axis != 3; axis++) {
+                for (size_t side=0; side != 2; side++) {
+                    size_t j = i * 6 + axis * 2 + side;
+                    glm::vec3 p = vertices[i].position;
+                    p[axis] += side ? h : -h;
+                    xs[j] = p.x;
+                    ys[j] = p.y;
+                    zs[j] = p.z;
+                }
+            }
+        }
+
+        evaluate_batch(bytecode, xs.data(), ys.data(), zs.data(), values.data(), 6 * n);
+
+        for (size_t i=0; i != n; i++) {
+            glm::vec3 gradient {
+                values[i * 6 + 1] - values[i * 6 + 0],
+                values[i * 6 + 3] - values[i * 6 + 2],
+                values[i * 6 + 5] - values[i * 6 + 4],
+            };
+            float length = glm::length(gradient);
+            glm::vec3 normal = length > 0.0f && std::isfinite(length) ? gradient / length : glm::vec3 { 0.0f, 1.0f, 0.0f };
+            vertices[i].color = normal * 0.5f + glm::vec3 { 0.5f, 0.5f, 0.5f };
+        }
+    }
+
+    Block extract_block(size_t bx, size_t by, size_t bz) const {
+        Block result {};
+
+        const size_t x0 = bx * ISOSURFACE_BLOCK, y0 = by * ISOSURFACE_BLOCK, z0 = bz * ISOSURFACE_BLOCK;
+        const size_t cx = std::min(ISOSURFACE_BLOCK, resolution - x0);
+        const size_t cy = std::min(ISOSURFACE_BLOCK, resolution - y0);
+        const size_t cz = std::min(ISOSURFACE_BLOCK, resolution - z0);
+
+        glm::dvec3 lo = grid_point(x0, y0, z0);
+        glm::dvec3 hi = grid_point(x0 + cx, y0 + cy, z0 + cz);
+        Interval bounds = evaluate_interval(bytecode,
+            Interval { lo.x, hi.x }, Interval { lo.y, hi.y }, Interval { lo.z, hi.z });
+        if (bounds.lo > 0.0 || bounds.hi < 0.0)
+            return result;
+
+        // sample the corners of all cells of the block at once
+        const size_t px = cx + 1, py = cy + 1, pz = cz + 1;
+        std::vector<double> xs(px * py * pz), ys(px * py * pz), zs(px * py * pz), values(px * py * pz);
+        for (size_t z=0; z != pz; z++) {
+            for (size_t y=0; y != py; y++) {
+                for (size_t x=0; x != px; x++) {
+                    size_t i = (z * py + y) * px + x;
+                    glm::dvec3 p = grid_point(x0 + x, y0 + y, z0 + z);
+                    xs[i] = p.x;
+                    ys[i] = p.y;
+                    zs[i] = p.z;
+                }
+            }
+        }
+        evaluate_batch(bytecode, xs.data(), ys.data(), zs.data(), values.data(), values.size());
+
+        // vertices are shared between triangles, keyed by the grid edge they lie on
+        std::unordered_map<uint64_t, GLuint> edgeVertices;
+        const uint64_t points = point_id(0, 0, resolution + 1);
+
+        auto edge_vertex = [&](size_t a, size_t b, const size_t (&local)[8][3]) -> GLuint {
+            uint64_t ida = point_id(x0 + local[a][0], y0 + local[a][1], z0 + local[a][2]);
+            uint64_t idb = point_id(x0 + local[b][0], y0 + local[b][1], z0 + local[b][2]);
+            uint64_t key = std::min(ida, idb) * points + std::max(ida, idb);
+
+            auto it = edgeVertices.find(key);
+            if (it != edgeVertices.end())
+                return it->second;
+
+            size_t ia = (local[a][2] * py + local[a][1]) * px + local[a][0];
+            size_t ib = (local[b][2] * py + local[b][1]) * px + local[b][0];
+            double t = values[ia] / (values[ia] - values[ib]);
+            glm::dvec3 pa { xs[ia], ys[ia], zs[ia] };
+            glm::dvec3 pb { xs[ib], ys[ib], zs[ib] };
+
+            result.vertices.push_back(Vertex {
+                .position = glm::vec3 { pa.x + (pb.x - pa.x) * t, pa.y + (pb.y - pa.y) * t, pa.z + (pb.z - pa.z) * t },
+                .color = glm::vec3 { 1.0f, 1.0f, 1.0f },
+            });
+            GLuint index = result.vertices.size() - 1;
+            edgeVertices.emplace(key, index);
+
+            auto on_face = [&](size_t c, int axis, size_t cells) {
+                return local[c][axis] == 0 || local[c][axis] == cells;
+            };
+            bool seam = false;
+            for (int axis=0; axis != 3; axis++) {
+                size_t cells = axis == 0 ? cx : axis == 1 ? cy : cz;
+                seam |= local[a][axis] == local[b][axis] && on_face(a, axis, cells);
+            }
+            if (seam)
+                result.seam.emplace_back(index, key);
+            return index;
+        };
+
+        for (size_t z=0; z != cz; z++) {
+            for (size_t y=0; y != cy; y++) {
+                for (size_t x=0; x != cx; x++) {
+                    size_t local[8][3];
+                    double v[8];
+                    for (size_t c=0; c != 8; c++) {
+                        local[c][0] = x + CUBE_CORNERS[c][0];
+                        local[c][1] = y + CUBE_CORNERS[c][1];
+                        local[c][2] = z + CUBE_CORNERS[c][2];
+                        v[c] = values[(local[c][2] * py + local[c][1]) * px + local[c][0]];
+                    }
+
+                    for (auto&& tet: CUBE_TETRAHEDRA) {
+                        int inside[4], outside[4];
+                        int ni = 0, no = 0;
+                        bool defined = true;
+                        for (int k=0; k != 4; k++) {
+                            double value = v[tet[k]];
+                            if (std::isnan(value)) {
+                                defined = false;
+                                break;
+                            }
+                            if (value < 0.0) {
+                                inside[ni++] = tet[k];
+                            } else {
+                                outside[no++] = tet[k];
+                            }
+                        }
+
+                        if (!defined || ni == 0 || no == 0)
+                            continue;
+
+                        if (ni == 1 || no == 1) {
+                            // a single corner separated from the other three
+                            int lone = ni == 1 ? inside[0] : outside[0];
+                            int* others = ni == 1 ? outside : inside;
+                            result.indices.push_back(edge_vertex(lone, others[0], local));
+                            result.indices.push_back(edge_vertex(lone, others[1], local));
+                            result.indices.push_back(edge_vertex(lone, others[2], local));
+                        } else {
+                            // two and two, the surface crosses four edges forming a quad
+                            GLuint ac = edge_vertex(inside[0], outside[0], local);
+                            GLuint ad = edge_vertex(inside[0], outside[1], local);
+                            GLuint bd = edge_vertex(inside[1], outside[1], local);
+                            GLuint bc = edge_vertex(inside[1], outside[0], local);
+                            result.indices.insert(result.indices.end(), { ac, ad, bd, ac, bd, bc });
+                        }
+                    }
+                }
+            }
+        }
+
+        shade(result.vertices);
+        return result;
+    }
+
+public:
+    IsosurfaceExtractor(const Bytecode& bytecode, glm::dvec3 min, glm::dvec3 max, size_t resolution):
+        bytecode(bytecode), min(min), cell((max - min) / (double)resolution), resolution(resolution),
+        blocks((resolution + ISOSURFACE_BLOCK - 1) / ISOSURFACE_BLOCK) {
+    }
+
+    // threads = 0 uses all hardware threads
+    GLMesh extract(size_t threads = 0) const {
+        const size_t total = blocks * blocks * blocks;
+        std::vector<Block> results(total);
+
+        parallel_for(total, threads, [&](size_t i) {
+            results[i] = extract_block(i % blocks, (i / blocks) % blocks, i / (blocks * blocks));
+        });
+
+        // blocks are merged in order, so the output doesn't depend on scheduling
+        GLMesh mesh;
+        std::unordered_map<uint64_t, GLuint> seamVertices;
+        for (auto&& block: results) {
+            const GLuint UNMAPPED = ~(GLuint)0;
+            std::vector<GLuint> remap(block.vertices.size(), UNMAPPED);
+            for (auto&& [index, key]: block.seam) {
+                auto it = seamVertices.find(key);
+                if (it != seamVertices.end())
+                    remap[index] = it->second;
+            }
+
+            for (size_t i=0; i != block.vertices.size(); i++) {
+                if (remap[i] == UNMAPPED) {
+                    remap[i] = mesh.vertices.size();
+                    mesh.vertices.push_back(block.vertices[i]);
+                }
+            }
+            for (auto&& [index, key]: block.seam) {
+                seamVertices.emplace(key, remap[index]);
+            }
+
+            for (GLuint index: block.indices) {
+                mesh.indices.push_back(remap[index]);
+            }
+        }
+
+        return mesh;
+    }
+};
+
+GLMesh extract_isosurface(const Bytecode& bytecode, glm::dvec3 min, glm::dvec3 max, size_t resolution, size_t threads = 0) {
+    return IsosurfaceExtractor(bytecode, min, max, resolution).extract(threads);
+}
@@ -1,5 +1,7 @@
 #pragma once
+#include <cmath>
 #include <memory>
+#include <optional>
 #include <vector>
 
 #include <glm/ext/matrix_transform.hpp>
@@ -8,7 +10,10 @@
 
 #include "vertex.hpp"
 #include "shader_pipeline.hpp"
+#include "stream_buffer.hpp"
 #include "utils.hpp"
+#include "profiler.hpp"
+#include "viewports.hpp"
 
 class GLMeshObject: public GLRenderable {
     // vertex array object - storespalące mnie pytanie calls to glEnableVertexAttribArray, vertex attribute configurations (glVertexAttribPointer) and vertex buffer objects associated with vertex attributes by calls to glVertexAttribPointer
@@ -17,17 +22,108 @@ class GLMeshObject: public GLRenderable {
     GLuint vbo;
     // element buffer - stores vertex indices that OpenGL uses to decide what vertices to draw
     GLuint ebo;
+    // instance buffer - per-instance model matrix, center and formula id
+    GLuint instanceVbo;
+    // replace vbo and ebo once the geometry is streamed, see stream_mesh
+    std::unique_ptr<GLStreamBuffer> vertexStream {};
+    std::unique_ptr<GLStreamBuffer> indexStream {};
+    // byte offset of the indices in the element buffer
+    size_t indexOffset = 0;
 
-    float center_x = 0;
-    float center_y = 0;
     bool wireframe_mode = false;
     bool tesselation = false;
+    float tess_level = 5.0f;
+    // the t of formulas, only a uniform, so animating never recompiles shaders
+    float time = 0.0f;
+    // used when tesselation is off
+    GLenum primitive = GL_TRIANGLES;
+
+    std::vector<GLMeshInstance> instances {
+        GLMeshInstance {
+            .model = glm::translate(glm::mat4(1.0f), glm::vec3(-60.0f, 0.0f, -60.0f)),
+            .center = glm::vec2{0.0f, 0.0f},
+            .formula = 0,
+        }
+    };
+    bool instancesDirty = true;
+
+    // bounding box of the mesh, y replaced by heightBounds if set, see set_height_bounds
+    glm::vec3 boundsMin { 0.0f, 0.0f, 0.0f };
+    glm::vec3 boundsMax { 0.0f, 0.0f, 0.0f };
+    std::optional<glm::vec2> heightBounds {};
+    bool culling = true;
+    // instances inside the frustum of the view being drawn, see render
+    std::vector<bool> visible {};
 
     std::shared_ptr<GLShaderPipeline> shaderPipeline;
     GLMesh mesh;
+    // shown in the profiler
+    std::string name = "GLMeshObject::render";
+
+    // points the position and color attributes at the vertices starting at offset of buffer,
+    // the vertex array object must be bound
+    void bind_vertices(GLuint buffer, size_t offset) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+            reinterpret_cast<void *>(offset + offsetof(Vertex, position)));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+            reinterpret_cast<void *>(offset + offsetof(Vertex, color)));
+    }
+
+    // points the per-instance attributes at the instances starting at first, emulates the base
+    // instance of glDrawElementsInstancedBaseInstance, which needs 4.2, the vertex array object
+    // must be bound
+    void bind_instances(size_t first) {
+        const size_t offset = sizeof(GLMeshInstance) * first;
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+        // mat4 takes up four consecutive attribute locations, one per column
+        for (GLuint i=0; i != 4; i++) {
+            glVertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE, sizeof(GLMeshInstance),
+                reinterpret_cast<void *>(offset + offsetof(GLMeshInstance, model) + sizeof(glm::vec4) * i));
+        }
+        glVertexAttribPointer(6, 2, GL_FLOAT, GL_FALSE, sizeof(GLMeshInstance),
+            reinterpret_cast<void *>(offset + offsetof(GLMeshInstance, center)));
+        // converted to float, so it can be passed through the tesselation stages as a regular varying
+        glVertexAttribPointer(7, 1, GL_INT, GL_FALSE, sizeof(GLMeshInstance),
+            reinterpret_cast<void *>(offset + offsetof(GLMeshInstance, formula)));
+    }
+
+    void update_bounds() {
+        if (mesh.vertices.empty()) {
+            boundsMin = boundsMax = glm::vec3 { 0.0f, 0.0f, 0.0f };
+            return;
+        }
+        boundsMin = boundsMax = mesh.vertices[0].position;
+        for (auto&& vertex: mesh.vertices) {
+            boundsMin = glm::min(boundsMin, vertex.position);
+            boundsMax = glm::max(boundsMax, vertex.position);
+        }
+    }
+
+    // marks the instances inside the frustum, false if there are none
+    bool cull(const glm::mat4 &viewMatrix, const glm::mat4 &projectionMatrix) {
+        visible.assign(instances.size(), true);
+        glm::vec3 min = boundsMin;
+        glm::vec3 max = boundsMax;
+        if (heightBounds.has_value()) {
+            min.y = heightBounds->x;
+            max.y = heightBounds->y;
+        }
+        if (!culling || !std::isfinite(min.y) || !std::isfinite(max.y))
+            return true;
+
+        Frustum frustum(projectionMatrix * viewMatrix);
+        bool any = false;
+        for (size_t i=0; i != instances.size(); i++) {
+            visible[i] = frustum.intersects(instances[i].model, min, max);
+            any |= visible[i];
+        }
+        return any;
+    }
 
 public:
     GLMeshObject(GLMesh mesh, std::shared_ptr<GLShaderPipeline> shaderPipeline): mesh(mesh), shaderPipeline{shaderPipeline} {
+        update_bounds();
         // create vertex array
         // number of vertex array objects, array where array names are stored
         // https://registry.khronos.org/OpenGL-Refpages/gl4/html/glGenVertexArrays.xhtml
@@ -74,14 +170,104 @@ public:
             reinterpret_cast<void *>(offsetof(Vertex, color))
         );
         glEnableVertexAttribArray(1);
+
+        // per-instance attributes, advanced once per instance instead of once per vertex
+        // https://registry.khronos.org/OpenGL-Refpages/gl4/html/glVertexAttribDivisor.xhtml
+        glGenBuffers(1, &instanceVbo);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+
+        bind_instances(0);
+        for (GLuint i=2; i != 8; i++) {
+            glEnableVertexAttribArray(i);
+            glVertexAttribDivisor(i, 1);
+        }
+
+        glBindVertexArray(0);
+    }
+
+    // replaces the geometry, e.g. after re-extracting an implicit surface
+    void set_mesh(GLMesh mesh) {
+        this->mesh = std::move(mesh);
+        update_bounds();
+
+        glBindVertexArray(vao);
+        if (vertexStream) {
+            vertexStream.reset();
+            indexStream.reset();
+            indexOffset = 0;
+            bind_vertices(vbo, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * this->mesh.vertices.size(),
+                this->mesh.vertices.data(), GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * this->mesh.indices.size(),
+                this->mesh.indices.data(), GL_STATIC_DRAW);
+        glBindVertexArray(0);
+    }
+
+    // replaces geometry which is going to be replaced again soon (e.g. contours following the
+    // center), through stream buffers instead of reallocating vbo and ebo, see GLStreamBuffer
+    void stream_mesh(GLMesh mesh) {
+        this->mesh = std::move(mesh);
+        update_bounds();
+        const size_t vertexBytes = sizeof(Vertex) * this->mesh.vertices.size();
+        const size_t indexBytes = sizeof(GLuint) * this->mesh.indices.size();
+        if (!vertexStream) {
+            vertexStream = std::make_unique<GLStreamBuffer>(vertexBytes);
+            indexStream = std::make_unique<GLStreamBuffer>(indexBytes);
+        }
+
+        size_t vertexOffset = vertexStream->upload(this->mesh.vertices.data(), vertexBytes);
+        indexOffset = indexStream->upload(this->mesh.indices.data(), indexBytes);
+
+        // the offsets change with every upload, and the buffers when they grow
+        glBindVertexArray(vao);
+        bind_vertices(vertexStream->get_buffer(), vertexOffset);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexStream->get_buffer());
+        glBindVertexArray(0);
     }
 
     void set_center_x(float x) {
-        center_x = x;
+        for (auto&& instance: instances) {
+            instance.center.x = x;
+        }
+        instancesDirty = true;
     }
 
     void set_center_y(float y) {
-        center_y = y;
+        for (auto&& instance: instances) {
+            instance.center.y = y;
+        }
+        instancesDirty = true;
+    }
+
+    const std::vector<GLMeshInstance>& get_instances() const {
+        return instances;
+    }
+
+    void set_instances(std::vector<GLMeshInstance> instances) {
+        this->instances = std::move(instances);
+        instancesDirty = true;
+    }
+
+    size_t add_instance(const GLMeshInstance &instance) {
+        instances.push_back(instance);
+        instancesDirty = true;
+        return instances.size() - 1;
+    }
+
+    void set_instance(size_t i, const GLMeshInstance &instance) {
+        instances.at(i) = instance;
+        instancesDirty = true;
+    }
+
+    void set_name(const std::string &name) {
+        this->name = "GLMeshObject::render " + name;
+    }
+
+    void set_shader_pipeline(std::shared_ptr<GLShaderPipeline> shaderPipeline) {
+        this->shaderPipeline = shaderPipeline;
     }
 
     void set_wireframe_mode(bool wireframe_mode) {
@@ -92,35 +278,100 @@ public:
         this->tesselation = tesselation;
     }
 
+    // e.g. GL_LINE_STRIP for meshes separated by PRIMITIVE_RESTART_INDEX
+    void set_primitive(GLenum primitive) {
+        this->primitive = primitive;
+    }
+
+    const GLShaderPipeline* getShaderPipeline() const override {
+        return shaderPipeline.get();
+    }
+
+    GLenum getPolygonMode() const override {
+        return wireframe_mode ? GL_LINE : GL_FILL;
+    }
+
+    // y extent of the drawn geometry for meshes displaced by the shaders, like the plane, whose
+    // vertices all lie at y = 0, infinite if unknown, which disables culling
+    void set_height_bounds(float min, float max) {
+        heightBounds = glm::vec2 { min, max };
+    }
+
+    // instances outside the frustum of a view aren't drawn in it, see Frustum
+    void set_culling(bool culling) {
+        this->culling = culling;
+    }
+
+    void set_tess_level(float tess_level) {
+        this->tess_level = tess_level;
+    }
+
+    void set_time(float time) {
+        this->time = time;
+    }
+
     void render(const glm::mat4 &viewMatrix, const glm::mat4 &projectionMatrix) override {
+        if (instances.empty() || mesh.indices.empty())
+            return;
+        if (!cull(viewMatrix, projectionMatrix))
+            return;
+
+        ProfileScope scope(name, true);
         shaderPipeline->enable();
 
-        // translation matrix
-        shaderPipeline->setUniform("model", glm::translate(
-            glm::mat4(1.0f),
-            glm::vec3(-60.0f, 0.0f, -60.0f)
-        ));
-        shaderPipeline->setUniform("view", viewMatrix);
-        shaderPipeline->setUniform("projection", projectionMatrix);
-        shaderPipeline->setUniform("center", glm::vec2{center_x, center_y});
+        // view and projection come from the Camera block, see GLCameraBuffer
+        if (tesselation)
+            shaderPipeline->setUniform("tess_level", tess_level);
+        if (tesselation && shaderPipeline->hasUniform("t"))
+            shaderPipeline->setUniform("t", time);
+
+        glBindVertexArray(vao);
+
+        if (instancesDirty) {
+            glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(GLMeshInstance) * instances.size(),
+                    instances.data(), GL_DYNAMIC_DRAW);
+            instancesDirty = false;
+        }
 
         // wireframe mode
-        if (this->wireframe_mode) {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-        } else {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        glPolygonMode(GL_FRONT_AND_BACK, getPolygonMode());
+
+        // one draw per run of consecutive visible instances, usually all of them
+        // https://registry.khronos.org/OpenGL-Refpages/gl4/html/glDrawElementsInstanced.xhtml
+        bool rebound = false;
+        for (size_t first=0; first != instances.size();) {
+            if (!visible[first]) {
+                first++;
+                continue;
+            }
+            size_t last = first;
+            while (last != instances.size() && visible[last])
+                last++;
+
+            if (first != 0) {
+                bind_instances(first);
+                rebound = true;
+            }
+            glDrawElementsInstanced(tesselation ? GL_PATCHES : primitive, mesh.indices.size(),
+                    GL_UNSIGNED_INT, reinterpret_cast<void *>(indexOffset), last - first);
+            first = last;
         }
+        if (rebound)
+            bind_instances(0);
 
-        if (tesselation) {
-            glDrawElements(GL_PATCHES, mesh.indices.size(), GL_UNSIGNED_INT, 0);
-        } else {
-            glDrawElements(GL_TRIANGLES, mesh.indices.size(), GL_UNSIGNED_INT, 0);
+        if (vertexStream) {
+            vertexStream->fence();
+            indexStream->fence();
         }
+
+        glBindVertexArray(0);
     }
 
     virtual ~GLMeshObject() {
         glDeleteBuffers(1, &vbo);
         glDeleteVertexArrays(1, &vao);
         glDeleteBuffers(1, &ebo);
+        glDeleteBuffers(1, &instanceVbo);
     }
 };
@@ -0,0 +1,30 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// calls f(i) for every i in [0, n), spread across threads pulling indices from a shared counter,
+// threads = 0 uses all hardware threads, the calling thread takes part as well
+template<typename F>
+void parallel_for(size_t n, size_t threads, F&& f) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, n);
+
+    std::atomic<size_t> next { 0 };
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            f(i);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i=1; i < threads; i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto&& t: workers) {
+        t.join();
+    }
+}
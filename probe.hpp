@@ -0,0 +1,148 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <optional>
+
+#include <glm/glm.hpp>
+#include "GL/glew.h"
+
+#include "render_target.hpp"
+#include "profiler.hpp"
+
+// what the plane shows under a pixel, see plane.frag
+struct ProbeSample {
+    // framebuffer pixel the sample was requested at, origin bottom left
+    glm::ivec2 pixel {};
+    // false if no plane covers the pixel or its neighbourhood
+    bool hit = false;
+    glm::dvec2 domain {};
+    // as computed by the shader, in single precision
+    double value = 0.0;
+    size_t formula = 0;
+};
+
+// reads the probe attachment of a GLRenderTarget around a pixel without stalling the pipeline
+//
+// each request reads a small square into one of a ring of pixel pack buffers and puts a fence
+// after it, poll only maps buffers whose fence has already signaled, and requests made while
+// every buffer is in flight are dropped, so the render loop never waits for the GPU
+// https://www.khronos.org/opengl/wiki/Pixel_Buffer_Object
+class GLProbeReader {
+public:
+    // the square read around the pixel, the covered texel nearest to it is used, so that
+    // hovering thin gaps between triangles or the edge of the plane still hits
+    static const int RADIUS = 2;
+    static const int SIDE = 2 * RADIUS + 1;
+    static const size_t RING = 3;
+
+private:
+    GLuint pbos[RING];
+    GLsync fences[RING] = {};
+    glm::ivec2 pixels[RING] {};
+    glm::ivec2 origins[RING] {};
+    // pixel in the drawn part of the target
+    glm::ivec2 centers[RING] {};
+    size_t submitted = 0;
+    size_t completed = 0;
+
+    // texels are RGBA32F, domain x, domain y, value, formula id + 1 or 0 if not covered
+    static ProbeSample resolve(const float* texels, glm::ivec2 pixel, glm::ivec2 center, glm::ivec2 origin) {
+        ProbeSample result { .pixel = pixel };
+        int best = -1;
+        for (int i=0; i != SIDE * SIDE; i++) {
+            const float* texel = texels + 4 * i;
+            if (texel[3] < 0.5f)
+                continue;
+
+            glm::ivec2 d = origin + glm::ivec2 { i % SIDE, i / SIDE } - center;
+            int distance = d.x * d.x + d.y * d.y;
+            if (best < 0 || distance < best) {
+                best = distance;
+                result.hit = true;
+                result.domain = glm::dvec2 { texel[0], texel[1] };
+                result.value = texel[2];
+                result.formula = (size_t)(texel[3] - 0.5f);
+            }
+        }
+        return result;
+    }
+
+public:
+    GLProbeReader() {
+        glGenBuffers(RING, pbos);
+        for (size_t i=0; i != RING; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(float) * 4 * SIDE * SIDE, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    GLProbeReader(GLProbeReader&&) = delete;
+    GLProbeReader(GLProbeReader&) = delete;
+
+    // queues a read of the probe attachment of target around pixel, false if dropped because
+    // all buffers are still in flight
+    bool request(GLRenderTarget &target, glm::ivec2 pixel) {
+        if (!target.has_probe() || submitted - completed == RING)
+            return false;
+
+        ProfileScope scope("GLProbeReader::request");
+        size_t slot = submitted % RING;
+        // the target may be drawn at a lower resolution, see GLRenderTarget::set_scale
+        glm::ivec2 viewport = target.get_viewport();
+        glm::ivec2 scaled = glm::ivec2(glm::vec2(pixel) * target.get_scale());
+        glm::ivec2 origin {
+            std::clamp(scaled.x - RADIUS, 0, std::max(viewport.x - SIDE, 0)),
+            std::clamp(scaled.y - RADIUS, 0, std::max(viewport.y - SIDE, 0)),
+        };
+
+        target.bind_probe_read();
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+        glReadPixels(origin.x, origin.y, SIDE, SIDE, GL_RGBA, GL_FLOAT, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        pixels[slot] = pixel;
+        centers[slot] = scaled;
+        origins[slot] = origin;
+        submitted++;
+        return true;
+    }
+
+    // the newest of the reads that finished since the last poll, doesn't wait for the others
+    std::optional<ProbeSample> poll() {
+        std::optional<ProbeSample> result;
+        while (completed != submitted) {
+            size_t slot = completed % RING;
+            GLenum status = glClientWaitSync(fences[slot], 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                break;
+            glDeleteSync(fences[slot]);
+            fences[slot] = 0;
+
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+            const void* texels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(float) * 4 * SIDE * SIDE, GL_MAP_READ_BIT);
+            if (texels != nullptr) {
+                result = resolve(static_cast<const float*>(texels), pixels[slot], centers[slot], origins[slot]);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            completed++;
+        }
+        return result;
+    }
+
+    // reads are in flight, poll has to be called again in a later frame
+    bool pending() const {
+        return completed != submitted;
+    }
+
+    ~GLProbeReader() {
+        for (size_t i=0; i != RING; i++) {
+            if (fences[i] != 0)
+                glDeleteSync(fences[i]);
+        }
+        glDeleteBuffers(RING, pbos);
+    }
+};
@@ -0,0 +1,364 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "GL/glew.h"
+
+// CPU and GPU frame instrumentation
+//
+// GPU times are measured with GL_TIMESTAMP query pairs rather than GL_TIME_ELAPSED, since
+// elapsed time queries can't be nested (GLScene::render contains GLMeshObject::render).
+// Results are read FRAMES_IN_FLIGHT frames later and dropped if still not available,
+// so reading them never stalls the pipeline.
+// https://www.khronos.org/opengl/wiki/Query_Object#Timer_queries
+//
+// CPU scopes can be opened from any thread, each thread keeps its own stack of open scopes and
+// gets its own row in the trace. GPU scopes are only timed on the thread which created the
+// profiler, the one of the GL context, elsewhere they're timed on the CPU only.
+class GLProfiler {
+public:
+    static const size_t HISTORY = 256;
+    static const size_t FRAMES_IN_FLIGHT = 2;
+    static const size_t MAX_TRACE_EVENTS = 100000;
+
+    struct Stats {
+        std::string name;
+        // rolling window of the last HISTORY samples, in milliseconds
+        std::vector<float> cpu {};
+        std::vector<float> gpu {};
+        size_t cpuNext = 0;
+        size_t gpuNext = 0;
+    };
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct OpenScope {
+        size_t stats;
+        clock::time_point start;
+        bool gpu;
+        GLuint startQuery;
+    };
+
+    struct PendingQuery {
+        size_t stats;
+        GLuint startQuery;
+        GLuint endQuery;
+    };
+
+    struct TraceEvent {
+        size_t stats;
+        bool gpu;
+        // row of the trace, see threadRow
+        int tid;
+        // microseconds since the profiler was created
+        double ts;
+        double dur;
+    };
+
+    std::atomic<bool> enabled = true;
+    clock::time_point startTime = clock::now();
+    std::thread::id glThread = std::this_thread::get_id();
+
+    // guards everything below, scopes of worker threads are recorded concurrently
+    mutable std::mutex mutex;
+    // GPU timestamp taken at gpuBaseCpu, used to put GPU events on the CPU timeline
+    GLint64 gpuBase = 0;
+    double gpuBaseCpu = 0;
+    bool gpuSynced = false;
+
+    std::map<std::string, size_t, std::less<>> statsIds {};
+    std::vector<Stats> stats {};
+    // trace rows of the threads which recorded events, 0 is the GL thread and 1 the GPU
+    std::map<std::thread::id, int> threadRows {};
+    std::vector<GLuint> freeQueries {};
+    std::array<std::vector<PendingQuery>, FRAMES_IN_FLIGHT> pending {};
+    size_t frame = 0;
+    std::deque<TraceEvent> trace {};
+
+    size_t getStatsId(std::string_view name) {
+        auto it = statsIds.find(name);
+        if (it != statsIds.end())
+            return it->second;
+
+        stats.push_back(Stats { .name = std::string(name) });
+        statsIds.emplace(std::string(name), stats.size() - 1);
+        return stats.size() - 1;
+    }
+
+    // scopes opened by the calling thread and not ended yet
+    static std::vector<OpenScope>& openScopes() {
+        thread_local std::vector<OpenScope> open;
+        return open;
+    }
+
+    int threadRow(std::thread::id thread) {
+        if (thread == glThread)
+            return 0;
+
+        auto it = threadRows.find(thread);
+        if (it != threadRows.end())
+            return it->second;
+
+        int row = (int)threadRows.size() + 2;
+        threadRows.emplace(thread, row);
+        return row;
+    }
+
+    // s as the contents of a JSON string
+    static std::string escapeJson(std::string_view s) {
+        std::string result;
+        for (char c: s) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            } else if ((unsigned char)c < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+                result += escaped;
+            } else {
+                result += c;
+            }
+        }
+        return result;
+    }
+
+    GLuint allocQuery() {
+        if (freeQueries.empty()) {
+            GLuint query;
+            glGenQueries(1, &query);
+            return query;
+        }
+
+        GLuint query = freeQueries.back();
+        freeQueries.pop_back();
+        return query;
+    }
+
+    double sinceStartUs(clock::time_point t) const {
+        return std::chrono::duration<double, std::micro>(t - startTime).count();
+    }
+
+    static void addSample(std::vector<float> &samples, size_t &next, float value) {
+        if (samples.size() < HISTORY) {
+            samples.push_back(value);
+        } else {
+            samples[next] = value;
+        }
+        next = (next + 1) % HISTORY;
+    }
+
+    void addTraceEvent(size_t id, bool gpu, double ts, double dur) {
+        int tid = gpu ? 1 : threadRow(std::this_thread::get_id());
+        trace.push_back(TraceEvent { .stats = id, .gpu = gpu, .tid = tid, .ts = ts, .dur = dur });
+        if (trace.size() > MAX_TRACE_EVENTS)
+            trace.pop_front();
+    }
+
+    // collects queries issued FRAMES_IN_FLIGHT frames ago
+    void collect(std::vector<PendingQuery> &queries) {
+        for (auto&& q: queries) {
+            GLint available = GL_FALSE;
+            glGetQueryObjectiv(q.endQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+
+            if (available) {
+                GLuint64 start, end;
+                glGetQueryObjectui64v(q.startQuery, GL_QUERY_RESULT, &start);
+                glGetQueryObjectui64v(q.endQuery, GL_QUERY_RESULT, &end);
+
+                double durUs = (end - start) / 1000.0;
+                addSample(stats[q.stats].gpu, stats[q.stats].gpuNext, durUs / 1000.0);
+                addTraceEvent(q.stats, true, gpuBaseCpu + ((GLint64)start - gpuBase) / 1000.0, durUs);
+            }
+
+            freeQueries.push_back(q.startQuery);
+            freeQueries.push_back(q.endQuery);
+        }
+        queries.clear();
+    }
+
+public:
+    GLProfiler() {
+    }
+
+    GLProfiler(GLProfiler&&) = delete;
+    GLProfiler(GLProfiler&) = delete;
+
+    bool isEnabled() const {
+        return enabled;
+    }
+
+    void setEnabled(bool enabled) {
+        this->enabled = enabled;
+    }
+
+    // must be called once per frame by the GL thread, outside of any scope
+    void beginFrame() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!gpuSynced) {
+            glGetInteger64v(GL_TIMESTAMP, &gpuBase);
+            gpuBaseCpu = sinceStartUs(clock::now());
+            gpuSynced = true;
+        }
+
+        frame = (frame + 1) % FRAMES_IN_FLIGHT;
+        collect(pending[frame]);
+    }
+
+    // returns false if nothing was started and end must not be called
+    bool begin(std::string_view name, bool gpu) {
+        if (!enabled)
+            return false;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        gpu &= std::this_thread::get_id() == glThread;
+        OpenScope scope { .stats = getStatsId(name), .start = clock::now(), .gpu = gpu, .startQuery = 0 };
+        if (gpu) {
+            scope.startQuery = allocQuery();
+            glQueryCounter(scope.startQuery, GL_TIMESTAMP);
+        }
+        openScopes().push_back(scope);
+        return true;
+    }
+
+    void end() {
+        std::vector<OpenScope>& open = openScopes();
+        if (open.empty())
+            return;
+
+        OpenScope scope = open.back();
+        open.pop_back();
+
+        auto now = clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        double durUs = std::chrono::duration<double, std::micro>(now - scope.start).count();
+        addSample(stats[scope.stats].cpu, stats[scope.stats].cpuNext, durUs / 1000.0);
+        addTraceEvent(scope.stats, false, sinceStartUs(scope.start), durUs);
+
+        if (scope.gpu) {
+            GLuint endQuery = allocQuery();
+            glQueryCounter(endQuery, GL_TIMESTAMP);
+            pending[frame].push_back(PendingQuery {
+                .stats = scope.stats,
+                .startQuery = scope.startQuery,
+                .endQuery = endQuery,
+            });
+        }
+    }
+
+    // adds a CPU event which wasn't timed by a scope, e.g. since before the profiler existed
+    void record(std::string_view name, clock::time_point start, clock::time_point end) {
+        if (!enabled)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t id = getStatsId(name);
+        double durUs = std::chrono::duration<double, std::micro>(end - start).count();
+        addSample(stats[id].cpu, stats[id].cpuNext, durUs / 1000.0);
+        addTraceEvent(id, false, sinceStartUs(start), durUs);
+    }
+
+    // origin of the trace timeline
+    clock::time_point getStartTime() const {
+        return startTime;
+    }
+
+    // a copy, the scopes of other threads may add samples meanwhile
+    std::vector<Stats> getStats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    // p in [0, 1], returns 0 for an empty window
+    static float percentile(const std::vector<float> &samples, float p) {
+        if (samples.empty())
+            return 0;
+
+        std::vector<float> sorted = samples;
+        size_t n = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5f));
+        std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+        return sorted[n];
+    }
+
+    // writes recorded events in the Chrome trace event format, viewable in chrome://tracing or Perfetto
+    // https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+    void dumpChromeTrace(const std::string &path) const {
+        std::ofstream stream(path, std::ios::out);
+        if (!stream.is_open()) {
+            throw std::runtime_error("failed to open trace file " + path);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        stream << "{\"traceEvents\":[\n";
+        stream << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"CPU\"}},\n";
+        stream << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":1,\"args\":{\"name\":\"GPU\"}}";
+        for (auto&& [thread, row]: threadRows) {
+            stream << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << row
+                << ",\"args\":{\"name\":\"worker " << row - 1 << "\"}}";
+        }
+        for (auto&& event: trace) {
+            stream << ",\n{\"name\":\"" << escapeJson(stats[event.stats].name)
+                << "\",\"cat\":\"" << (event.gpu ? "gpu" : "cpu")
+                << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.tid
+                << ",\"ts\":" << event.ts
+                << ",\"dur\":" << event.dur << "}";
+        }
+        stream << "\n]}\n";
+    }
+
+    // deletes query objects, must be called by the GL thread while the GL context is still current
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<OpenScope>& open = openScopes();
+        for (auto&& queries: pending) {
+            for (auto&& q: queries) {
+                freeQueries.push_back(q.startQuery);
+                freeQueries.push_back(q.endQuery);
+            }
+            queries.clear();
+        }
+        for (auto&& scope: open) {
+            if (scope.gpu)
+                freeQueries.push_back(scope.startQuery);
+        }
+        open.clear();
+
+        if (!freeQueries.empty())
+            glDeleteQueries(freeQueries.size(), freeQueries.data());
+        freeQueries.clear();
+    }
+};
+
+GLProfiler& profiler() {
+    static GLProfiler instance;
+    return instance;
+}
+
+// times the enclosing block, on the GPU as well if gpu is set
+class ProfileScope {
+    bool active;
+
+public:
+    ProfileScope(std::string_view name, bool gpu = false): active(profiler().begin(name, gpu)) {
+    }
+
+    ProfileScope(ProfileScope&&) = delete;
+    ProfileScope(ProfileScope&) = delete;
+
+    ~ProfileScope() {
+        if (active)
+            profiler().end();
+    }
+};
@@ -0,0 +1,180 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include "GL/glew.h"
+
+// quality a frame of the scene is drawn at
+struct RefinementLevel {
+    // tess_level of the plane, see plane.tesc
+    float tessLevel;
+    // fraction of the resolution, see GLRenderTarget::set_scale
+    float scale;
+};
+
+// progressive rendering of expensive formulas
+//
+// after the scene changes it is drawn at the interactive level first, then again at
+// increasing levels until it reaches the full one, which then stays on screen (see
+// RenderScheduler::refineScene), so dragging the camera over a heavy formula stays smooth
+// and the image still ends up at full quality once it stops
+//
+// the interactive level adapts to the GPU time of the frames drawn at it, to hold the frame
+// time budget, the tesselation is lowered first, since the work grows with its square, and
+// the resolution only once the tesselation is at its minimum
+class RefinementController {
+public:
+    // frames from the interactive to the full level
+    static const int STEPS = 4;
+    static constexpr float MIN_TESS_LEVEL = 1.0f;
+    static constexpr float MIN_SCALE = 0.5f;
+
+private:
+    float fullTessLevel;
+    float budgetMs;
+    RefinementLevel interactive;
+    int step = 0;
+    bool enabled = true;
+
+public:
+    RefinementController(float fullTessLevel, float targetFps = 60.0f):
+            fullTessLevel(fullTessLevel), budgetMs(1000.0f / targetFps),
+            interactive(RefinementLevel { fullTessLevel, 1.0f }) {
+    }
+
+    // the scene changed, start again from the interactive level
+    void restart() {
+        step = 0;
+    }
+
+    // the level to draw the next frame at
+    RefinementLevel level() const {
+        if (!enabled)
+            return RefinementLevel { fullTessLevel, 1.0f };
+
+        float t = (float)step / STEPS;
+        return RefinementLevel {
+            interactive.tessLevel + (fullTessLevel - interactive.tessLevel) * t,
+            interactive.scale + (1.0f - interactive.scale) * t,
+        };
+    }
+
+    // a frame was drawn at level()
+    void frameDrawn() {
+        if (step < STEPS)
+            step++;
+    }
+
+    // another frame has to be drawn to reach the full level
+    bool isRefining() const {
+        return enabled && step < STEPS;
+    }
+
+    // GPU time of a frame drawn at level, only frames at the interactive level adapt it
+    void measured(RefinementLevel level, float ms) {
+        if (!enabled || ms <= 0.0f || level.tessLevel != interactive.tessLevel || level.scale != interactive.scale)
+            return;
+
+        // the work is roughly proportional to the square of both, the adjustment is damped
+        // and bounded so that a single slow frame doesn't drop the quality all at once
+        float factor = std::clamp(std::sqrt(budgetMs / ms), 0.7f, 1.25f);
+        if (factor < 1.0f && interactive.tessLevel > MIN_TESS_LEVEL) {
+            interactive.tessLevel = std::max(MIN_TESS_LEVEL, interactive.tessLevel * factor);
+        } else if (factor < 1.0f) {
+            interactive.scale = std::max(MIN_SCALE, interactive.scale * factor);
+        } else if (interactive.scale < 1.0f) {
+            interactive.scale = std::min(1.0f, interactive.scale * factor);
+        } else {
+            interactive.tessLevel = std::min(fullTessLevel, interactive.tessLevel * factor);
+        }
+    }
+
+    void set_enabled(bool enabled) {
+        this->enabled = enabled;
+    }
+
+    bool is_enabled() const {
+        return enabled;
+    }
+
+    void set_full_tess_level(float tessLevel) {
+        fullTessLevel = tessLevel;
+        interactive.tessLevel = std::min(interactive.tessLevel, fullTessLevel);
+    }
+
+    float get_full_tess_level() const {
+        return fullTessLevel;
+    }
+
+    void set_target_fps(float fps) {
+        budgetMs = 1000.0f / fps;
+    }
+
+    const RefinementLevel& get_interactive() const {
+        return interactive;
+    }
+};
+
+// GPU time of scene frames, read without waiting a few frames later
+// https://www.khronos.org/opengl/wiki/Query_Object#Timer_queries
+class GLSceneTimer {
+    static const size_t RING = 4;
+
+    GLuint queries[RING];
+    RefinementLevel levels[RING] {};
+    size_t submitted = 0;
+    size_t completed = 0;
+    bool running = false;
+
+public:
+    GLSceneTimer() {
+        glGenQueries(RING, queries);
+    }
+
+    GLSceneTimer(GLSceneTimer&&) = delete;
+    GLSceneTimer(GLSceneTimer&) = delete;
+
+    // false if all queries are in flight, then the frame isn't measured
+    bool begin(RefinementLevel level) {
+        if (submitted - completed == RING)
+            return false;
+        levels[submitted % RING] = level;
+        glBeginQuery(GL_TIME_ELAPSED, queries[submitted % RING]);
+        running = true;
+        return true;
+    }
+
+    void end() {
+        if (!running)
+            return;
+        glEndQuery(GL_TIME_ELAPSED);
+        running = false;
+        submitted++;
+    }
+
+    // calls f(level, ms) for the measured frames whose results are available
+    template<typename F>
+    void poll(F&& f) {
+        while (completed != submitted) {
+            GLuint query = queries[completed % RING];
+            GLint available = 0;
+            glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+            f(levels[completed % RING], (float)(ns / 1e6));
+            completed++;
+        }
+    }
+
+    bool pending() const {
+        return completed != submitted;
+    }
+
+    ~GLSceneTimer() {
+        glDeleteQueries(RING, queries);
+    }
+};
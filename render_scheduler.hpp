@@ -0,0 +1,66 @@
+#pragma once
+
+// decides which frames have to be drawn at all, so that an idle window doesn't keep a CPU core
+// and the GPU busy
+//
+// the scene is drawn again only after invalidateScene (camera, formula, center, resize...),
+// otherwise its last image is reused and only the UI is drawn over it, for a few frames after
+// every input event so that ImGui can settle hover and focus changes, and nothing at all
+// once those run out
+class RenderScheduler {
+public:
+    // frames of UI drawn after an input event
+    static const int UI_FRAMES = 3;
+    // upper bound of the sleep in glfwWaitEventsTimeout while idle, in seconds
+    static constexpr double IDLE_TIMEOUT = 0.25;
+
+private:
+    bool sceneDirty = true;
+    // the scene itself changed, rather than only being drawn again at a higher quality
+    bool sceneChanged = true;
+    int uiFrames = UI_FRAMES;
+
+public:
+    void invalidateScene() {
+        sceneDirty = true;
+        sceneChanged = true;
+        uiFrames = UI_FRAMES;
+    }
+
+    // draws the unchanged scene again in the next frame, see RefinementController
+    void refineScene() {
+        sceneDirty = true;
+    }
+
+    void invalidateUi() {
+        uiFrames = UI_FRAMES;
+    }
+
+    bool needsScene() const {
+        return sceneDirty;
+    }
+
+    bool isSceneChanged() const {
+        return sceneChanged;
+    }
+
+    bool needsFrame() const {
+        return sceneDirty || uiFrames > 0;
+    }
+
+    // invalidations after this (e.g. by the UI of the same frame) apply to the next frame
+    void sceneDrawn() {
+        sceneDirty = false;
+        sceneChanged = false;
+    }
+
+    void frameDrawn() {
+        if (uiFrames > 0)
+            uiFrames--;
+    }
+
+    // how long the main loop may block waiting for events, 0 to poll
+    double waitTimeout() const {
+        return needsFrame() ? 0.0 : IDLE_TIMEOUT;
+    }
+};
@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include <glm/glm.hpp>
+#include "GL/glew.h"
+
+// offscreen framebuffer with a color texture and a depth buffer, which keeps the image of the
+// scene between frames, so frames that only change the UI copy it instead of drawing the scene
+//
+// with probe set, a second RGBA32F attachment receives the out_probe output of the fragment
+// shaders (see plane.frag), the domain coordinates and value under every pixel for GLProbeReader
+//
+// with a scale below 1 only the bottom left part of that size is drawn into and stretched over
+// the whole window by blit_to_default, which is cheaper than reallocating the attachments
+// https://www.khronos.org/opengl/wiki/Framebuffer_Object
+class GLRenderTarget {
+    GLuint fbo;
+    GLuint colorTexture;
+    GLuint depthBuffer;
+    GLuint probeBuffer = 0;
+    int width = 0;
+    int height = 0;
+    float scale = 1.0f;
+
+public:
+    GLRenderTarget(int width, int height, bool probe = false) {
+        glGenFramebuffers(1, &fbo);
+        glGenTextures(1, &colorTexture);
+        glGenRenderbuffers(1, &depthBuffer);
+        if (probe)
+            glGenRenderbuffers(1, &probeBuffer);
+        resize(width, height);
+    }
+
+    GLRenderTarget(GLRenderTarget&&) = delete;
+    GLRenderTarget(GLRenderTarget&) = delete;
+
+    // reallocates the attachments if the size changed, their contents are undefined afterwards
+    void resize(int width, int height) {
+        if (width == this->width && height == this->height)
+            return;
+        this->width = width;
+        this->height = height;
+
+        glBindTexture(GL_TEXTURE_2D, colorTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        if (probeBuffer != 0) {
+            glBindRenderbuffer(GL_RENDERBUFFER, probeBuffer);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA32F, width, height);
+        }
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        if (probeBuffer != 0) {
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_RENDERBUFFER, probeBuffer);
+            const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+            glDrawBuffers(2, drawBuffers);
+        }
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (status != GL_FRAMEBUFFER_COMPLETE)
+            throw std::runtime_error("incomplete render target " + std::to_string(status));
+    }
+
+    // fraction of the width and height drawn into, in (0, 1]
+    void set_scale(float scale) {
+        this->scale = std::clamp(scale, 0.0f, 1.0f);
+    }
+
+    float get_scale() const {
+        return scale;
+    }
+
+    // size of the part drawn into
+    glm::ivec2 get_viewport() const {
+        return glm::ivec2 {
+            std::max(1, (int)std::round(width * scale)),
+            std::max(1, (int)std::round(height * scale)),
+        };
+    }
+
+    // directs rendering into the target
+    void bind() {
+        glm::ivec2 viewport = get_viewport();
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glViewport(0, 0, viewport.x, viewport.y);
+    }
+
+    // makes the probe attachment the source of glReadPixels
+    void bind_probe_read() {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glReadBuffer(GL_COLOR_ATTACHMENT1);
+    }
+
+    bool has_probe() const {
+        return probeBuffer != 0;
+    }
+
+    // copies the color attachment to the whole default framebuffer, which is left bound
+    void blit_to_default() {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glm::ivec2 viewport = get_viewport();
+        glBlitFramebuffer(0, 0, viewport.x, viewport.y, 0, 0, width, height, GL_COLOR_BUFFER_BIT,
+            viewport.x == width && viewport.y == height ? GL_NEAREST : GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+    }
+
+    int get_width() const {
+        return width;
+    }
+
+    int get_height() const {
+        return height;
+    }
+
+    ~GLRenderTarget() {
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteTextures(1, &colorTexture);
+        glDeleteRenderbuffers(1, &depthBuffer);
+        if (probeBuffer != 0)
+            glDeleteRenderbuffers(1, &probeBuffer);
+    }
+};
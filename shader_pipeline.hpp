@@ -1,6 +1,12 @@
 #pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <optional>
 #include <stdexcept>
+#include <string>
 #include <vector>
 #include <map>
 #include <iostream>
@@ -8,6 +14,8 @@
 #include <glm/glm.hpp>
 #include "GL/glew.h"
 
+#include "profiler.hpp"
+
 void checkShader(GLint id) {
     GLint result = GL_FALSE;
     int infoLogLength;
@@ -38,20 +46,144 @@ void checkProgram(GLint id) {
     }
 }
 
+// program binaries saved after linking, keyed by a hash of the driver and the sources, so the
+// next start restores them with glProgramBinary instead of compiling and linking again
+// https://www.khronos.org/opengl/wiki/Shader_Compilation#Binary_upload
+class GLProgramCache {
+    std::filesystem::path dir;
+
+    std::filesystem::path path(uint64_t key) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+        return dir / name;
+    }
+
+public:
+    GLProgramCache(std::filesystem::path dir): dir(std::move(dir)) {
+        std::error_code error;
+        std::filesystem::create_directories(this->dir, error);
+    }
+
+    // false if some drivers can't retrieve binaries, e.g. with their own shader cache
+    static bool supported() {
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        return formats > 0;
+    }
+
+    // FNV-1a of the driver, which may reject binaries of other versions, and the sources
+    static uint64_t key(const std::vector<std::string> &sources) {
+        static const std::string driver = std::string((const char*)glGetString(GL_VENDOR)) + "\n"
+            + (const char*)glGetString(GL_RENDERER) + "\n" + (const char*)glGetString(GL_VERSION);
+        uint64_t hash = 0xcbf29ce484222325ull;
+        auto mix = [&](const std::string &data) {
+            for (unsigned char c: data)
+                hash = (hash ^ c) * 0x100000001b3ull;
+            // separator, so that moving text between sources changes the key
+            hash = (hash ^ 0xff) * 0x100000001b3ull;
+        };
+        mix(driver);
+        for (auto&& source: sources)
+            mix(source);
+        return hash;
+    }
+
+    // false if there's no binary or the driver rejected it, program must then be linked from source
+    bool load(GLuint program, uint64_t key) const {
+        ProfileScope scope("GLProgramCache::load");
+        std::ifstream stream(path(key), std::ios::in | std::ios::binary);
+        GLenum format;
+        if (!stream.read(reinterpret_cast<char*>(&format), sizeof(format)))
+            return false;
+        std::vector<char> binary((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+        glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        return status == GL_TRUE;
+    }
+
+    // program must have been linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+    void save(GLuint program, uint64_t key) const {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+        std::vector<char> binary(length);
+        GLenum format;
+        glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+        std::ofstream stream(path(key), std::ios::out | std::ios::binary | std::ios::trunc);
+        stream.write(reinterpret_cast<const char*>(&format), sizeof(format));
+        stream.write(binary.data(), binary.size());
+    }
+};
+
 
 class GLShaderPipeline {
-    GLuint id;
-    bool linked = false;
-    std::map<std::string, GLint> uniformIds {};
-    std::optional<GLuint> vertexShaderId {};
-    std::optional<GLuint> fragmentShaderId {};
-    std::optional<GLuint> tessCtrlShaderId {};
-    std::optional<GLuint> tessEvalShaderId {};
+    // pipeline currently bound, used to skip redundant binds
+    static inline const GLShaderPipeline* bound = nullptr;
+    // set by enableProgramCache
+    static inline std::optional<GLProgramCache> programCache {};
+
+    enum StageIndex { Vertex, TessCtrl, TessEval, Fragment, STAGE_COUNT };
+
+    // source of a shader object, compiled only when a program using it has to be linked from
+    // source, not when its binary is restored from the program cache
+    struct ShaderObject {
+        std::string source;
+        // 0 until compiled
+        GLuint id = 0;
+    };
+
+    struct Stage {
+        GLenum kind;
+        GLbitfield bit;
+        const char* name;
+        std::optional<ShaderObject> shader {};
+        // separately compiled objects linked with the shader, see setLibrary
+        std::map<std::string, ShaderObject> libraries {};
+        // program of the stage alone, only for separable pipelines
+        GLuint program = 0;
+        bool linked = false;
+
+        bool empty() const {
+            return !shader.has_value() && libraries.empty();
+        }
+    };
+
+    // location of a uniform in one of the programs
+    struct UniformLocation {
+        GLuint program;
+        GLint location;
+    };
+
+    // without separable programs, every stage is linked into the program id, otherwise each
+    // stage has its own program and id is the program pipeline combining them
+    bool separable;
+    GLuint id = 0;
+    Stage stages[STAGE_COUNT] {
+        { GL_VERTEX_SHADER, GL_VERTEX_SHADER_BIT, "vertex" },
+        { GL_TESS_CONTROL_SHADER, GL_TESS_CONTROL_SHADER_BIT, "tess ctrl" },
+        { GL_TESS_EVALUATION_SHADER, GL_TESS_EVALUATION_SHADER_BIT, "tess eval" },
+        { GL_FRAGMENT_SHADER, GL_FRAGMENT_SHADER_BIT, "fragment" },
+    };
+    std::map<std::string, std::vector<UniformLocation>> uniformIds {};
+    // uniform block name -> binding point, see setUniformBlock
+    std::map<std::string, GLuint> uniformBlocks {};
     std::optional<GLuint> patchVertices;
-    // tesselation shaders...
+
+    struct TextureBinding {
+        std::string sampler;
+        GLenum target;
+        GLuint texture;
+    };
+    // texture unit -> texture bound to it whenever the pipeline is enabled
+    std::map<GLuint, TextureBinding> textures {};
     // compute shaders?
 
     GLuint compileShader(const GLuint shaderKind, const std::string &shader) const {
+        ProfileScope scope("GLShaderPipeline::compileShader");
         GLuint shaderID = glCreateShader(shaderKind);
 
         char const *vertexSourcePointer = shader.c_str();
@@ -59,146 +191,365 @@ class GLShaderPipeline {
         glShaderSource(shaderID, 1, &vertexSourcePointer, nullptr);
         glCompileShader(shaderID);
 
-        checkShader(shaderID);
+        try {
+            checkShader(shaderID);
+        } catch (...) {
+            glDeleteShader(shaderID);
+            throw;
+        }
         return shaderID;
     }
 
-    GLint getUniformID(const std::string &name) {
-        const auto it = uniformIds.find(name);
+    Stage& stageOf(GLenum kind) {
+        for (auto&& stage: stages) {
+            if (stage.kind == kind)
+                return stage;
+        }
+        throw std::runtime_error("unsupported shader stage: " + std::to_string(kind));
+    }
+
+    // false if object already has that source, shader objects are never attached outside of
+    // linkStages, so they can be deleted right away
+    static bool replaceSource(ShaderObject &object, const std::string &source) {
+        if (object.source == source)
+            return false;
+        if (object.id != 0)
+            glDeleteShader(object.id);
+        object = ShaderObject { .source = source };
+        return true;
+    }
+
+    void setShader(Stage &stage, const std::string &source) {
+        if (!stage.shader.has_value()) {
+            stage.shader = ShaderObject { .source = source };
+        } else if (!replaceSource(*stage.shader, source)) {
+            return;
+        }
+        stage.linked = false;
+    }
+
+    bool isLinked() const {
+        for (auto&& stage: stages) {
+            if (!stage.linked)
+                return false;
+        }
+        return true;
+    }
+
+    // a new program from the shaders of stages, restored from the program cache if possible
+    GLuint linkStages(const std::vector<Stage*> &linked) const {
+        std::vector<std::string> sources { separable ? "separable" : "" };
+        for (Stage* stage: linked) {
+            sources.push_back(std::to_string(stage->kind));
+            if (stage->shader.has_value())
+                sources.push_back(stage->shader->source);
+            for (auto&& [name, library]: stage->libraries)
+                sources.push_back(library.source);
+        }
+
+        GLuint program = glCreateProgram();
+        if (separable)
+            glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+        const uint64_t key = GLProgramCache::key(sources);
+        auto start = std::chrono::steady_clock::now();
+        if (programCache.has_value() && programCache->load(program, key)) {
+            // counted in the profiler rather than printed for every cached program on each start
+            profiler().record("restored cached program", start, std::chrono::steady_clock::now());
+            return program;
+        }
+
+        std::vector<GLuint> attached;
+        try {
+            for (Stage* stage: linked) {
+                std::vector<ShaderObject*> objects;
+                if (stage->shader.has_value())
+                    objects.push_back(&*stage->shader);
+                for (auto&& [name, library]: stage->libraries)
+                    objects.push_back(&library);
+
+                for (ShaderObject* object: objects) {
+                    if (object->id == 0) {
+                        std::cout << "compiling " << stage->name << " shader" << std::endl;
+                        object->id = compileShader(stage->kind, object->source);
+                    }
+                    glAttachShader(program, object->id);
+                    attached.push_back(object->id);
+                }
+            }
+
+            if (programCache.has_value())
+                glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            glLinkProgram(program);
+            checkProgram(program);
+        } catch (...) {
+            glDeleteProgram(program);
+            throw;
+        }
+        // the program keeps working without them, and they can be attached to the next one
+        for (GLuint shader: attached)
+            glDetachShader(program, shader);
+
+        if (programCache.has_value())
+            programCache->save(program, key);
+        return program;
+    }
+
+    const std::vector<UniformLocation>& getUniformLocations(const std::string &name) {
+        auto it = uniformIds.find(name);
         if (it != uniformIds.end())
             return it->second;
+        // a separable uniform is set in every stage program declaring it, e.g. view and projection
+        // of the tess eval stage and a fragment shader
+        std::vector<UniformLocation> locations;
+        for (GLuint program: programs()) {
+            const GLint location = glGetUniformLocation(program, name.c_str());
+            if (location != -1)
+                locations.push_back(UniformLocation { program, location });
+        }
+        return uniformIds.emplace(name, std::move(locations)).first->second;
+    }
 
-        const GLint uniformId = glGetUniformLocation(id, name.c_str());
-        if (uniformId == -1) {
+    const std::vector<UniformLocation>& getUniformID(const std::string &name) {
+        const bool known = uniformIds.count(name) != 0;
+        const auto& locations = getUniformLocations(name);
+        if (!known && locations.empty()) {
             // throw std::runtime_error("failed to get uniform with name: " + name);
             std::cerr << "failed to get uniform with name: " << name << std::endl;
         }
+        return locations;
+    }
+
+    std::vector<GLuint> programs() const {
+        if (!separable)
+            return id != 0 ? std::vector<GLuint> { id } : std::vector<GLuint> {};
+        std::vector<GLuint> result;
+        for (auto&& stage: stages) {
+            if (stage.program != 0)
+                result.push_back(stage.program);
+        }
+        return result;
+    }
 
-        uniformIds.emplace(name, uniformId);
-        return uniformId;
+    void bindUniformBlocks(GLuint program) const {
+        for (auto&& [name, binding]: uniformBlocks) {
+            GLuint index = glGetUniformBlockIndex(program, name.c_str());
+            if (index != GL_INVALID_INDEX)
+                glUniformBlockBinding(program, index, binding);
+        }
     }
 
 public:
-    GLShaderPipeline() {
-        id = glCreateProgram();
+    // separable pipelines link every stage into its own program, so that replacing the shader
+    // of one stage relinks only that stage, see separableSupported
+    GLShaderPipeline(bool separable = false): separable(separable) {
+        if (separable)
+            glGenProgramPipelines(1, &id);
     }
 
     GLShaderPipeline(GLShaderPipeline&&) = delete;
     GLShaderPipeline(GLShaderPipeline&) = delete;
 
+    // restores programs from binaries saved in dir and saves them there after linking, unless the
+    // driver doesn't support program binaries, see GLProgramCache
+    static void enableProgramCache(const std::filesystem::path &dir) {
+        if (GLProgramCache::supported())
+            programCache.emplace(dir);
+    }
+
+    // program pipeline objects are core since 4.1, older contexts may expose the extension
+    static bool separableSupported() {
+        return GLEW_VERSION_4_1 || GLEW_ARB_separate_shader_objects;
+    }
+
+    bool isSeparable() const {
+        return separable;
+    }
+
     void setVertexShader(const std::string &vertexShader) {
-        auto oldShaderId = vertexShaderId;
-        std::cout << "compiling vertex shader" << std::endl;
-        vertexShaderId = compileShader(GL_VERTEX_SHADER, vertexShader);
-        if (oldShaderId.has_value()) {
-            glDetachShader(id, *oldShaderId);
-            glDeleteShader(*oldShaderId);
-        }
-        linked = false;
+        setShader(stages[Vertex], vertexShader);
     }
 
     void setFragmentShader(const std::string &fragmentShader) {
-        auto oldShaderId = fragmentShaderId;
-        std::cout << "compiling fragment shader" << std::endl;
-        fragmentShaderId = compileShader(GL_FRAGMENT_SHADER, fragmentShader);
-        if (oldShaderId.has_value()) {
-            glDetachShader(id, *oldShaderId);
-            glDeleteShader(*oldShaderId);
-        }
-        linked = false;
+        setShader(stages[Fragment], fragmentShader);
     }
 
     void setTessCtrlShader(const std::string &tessCtrlShader) {
-        auto oldShaderId = tessCtrlShaderId;
-        std::cout << "compiling tess ctrl shader" << std::endl;
-        tessCtrlShaderId = compileShader(GL_TESS_CONTROL_SHADER, tessCtrlShader);
-        if (oldShaderId.has_value()) {
-            glDetachShader(id, *oldShaderId);
-            glDeleteShader(*oldShaderId);
-        }
-        linked = false;
+        setShader(stages[TessCtrl], tessCtrlShader);
     }
 
     void setTessEvalShader(const std::string &tessEvalShader) {
-        auto oldShaderId = tessEvalShaderId;
-        std::cout << "compiling tess eval shader" << std::endl;
-        tessEvalShaderId = compileShader(GL_TESS_EVALUATION_SHADER, tessEvalShader);
-        if (oldShaderId.has_value()) {
-            glDetachShader(id, *oldShaderId);
-            glDeleteShader(*oldShaderId);
+        setShader(stages[TessEval], tessEvalShader);
+    }
+
+    // source as a separate shader object of the stage (GL_VERTEX_SHADER, ...), linked together
+    // with the stage's shader, replacing the library of the same name, a library declaring the
+    // functions a small shader calls is compiled once and reused by every shader set afterwards,
+    // see plane.tese and plane_func.glsl
+    void setLibrary(GLenum kind, const std::string &name, const std::string &source) {
+        Stage& stage = stageOf(kind);
+        auto it = stage.libraries.find(name);
+        if (it == stage.libraries.end()) {
+            stage.libraries.emplace(name, ShaderObject { .source = source });
+        } else if (!replaceSource(it->second, source)) {
+            return;
+        }
+        stage.linked = false;
+    }
+
+    // the uniform block name of every stage declaring it reads the buffer bound to binding with
+    // glBindBufferRange(GL_UNIFORM_BUFFER, ...), e.g. the Camera block of viewports.hpp
+    void setUniformBlock(const std::string &name, GLuint binding) {
+        uniformBlocks[name] = binding;
+        // programs linked later bind it after linking
+        if (isLinked()) {
+            for (GLuint program: programs())
+                bindUniformBlocks(program);
         }
-        linked = false;
     }
 
     void setPatchVertices(int newPatchVertices) {
         patchVertices = newPatchVertices;
     }
 
+    void setTexture(const std::string &sampler, GLuint unit, GLenum target, GLuint texture) {
+        textures[unit] = TextureBinding { .sampler = sampler, .target = target, .texture = texture };
+        if (bound == this)
+            bound = nullptr;
+    }
+
     void enable() {
-        if (!linked) {
+        if (!isLinked()) {
             linkProgram();
-            linked = true;
+            // locations may change after relinking
+            uniformIds.clear();
+            bound = nullptr;
         }
+        if (bound == this)
+            return;
         if (patchVertices.has_value())
             glPatchParameteri(GL_PATCH_VERTICES, *patchVertices);
-        glUseProgram(id);
+        if (separable) {
+            // a program in use takes precedence over the bound pipeline
+            glUseProgram(0);
+            glBindProgramPipeline(id);
+        } else {
+            glUseProgram(id);
+        }
+        bound = this;
+
+        for (auto&& [unit, binding]: textures) {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(binding.target, binding.texture);
+            setUniform(binding.sampler, (GLint)unit);
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // must be called when something else (e.g. ImGui) may have changed the bound program
+    static void invalidateBinding() {
+        bound = nullptr;
+    }
+
+    // false for uniforms the program doesn't declare or the compiler removed as unused,
+    // which can then be skipped without getUniformID complaining
+    bool hasUniform(const std::string &name) {
+        return !getUniformLocations(name).empty();
     }
 
+    // uniforms are set with glProgramUniform*, on every program declaring them
     void setUniform(const std::string &name, const GLint value) {
-        glUniform1i(getUniformID(name), value);
+        for (auto&& u: getUniformID(name))
+            glProgramUniform1i(u.program, u.location, value);
     }
 
     void setUniform(const std::string &name, const float value) {
-        glUniform1f(getUniformID(name), value);
+        for (auto&& u: getUniformID(name))
+            glProgramUniform1f(u.program, u.location, value);
     }
 
     void setUniform(const std::string &name, const glm::vec2 &value) {
-        glUniform2f(getUniformID(name), value.x, value.y);
+        for (auto&& u: getUniformID(name))
+            glProgramUniform2f(u.program, u.location, value.x, value.y);
     }
 
     void setUniform(const std::string &name, const glm::vec3 &value) {
-        glUniform3f(getUniformID(name), value.x, value.y, value.z);
+        for (auto&& u: getUniformID(name))
+            glProgramUniform3f(u.program, u.location, value.x, value.y, value.z);
     }
 
     void setUniform(const std::string &name, const glm::vec4 &value) {
-        glUniform4f(getUniformID(name), value.x, value.y, value.z, value.w);
+        for (auto&& u: getUniformID(name))
+            glProgramUniform4f(u.program, u.location, value.x, value.y, value.z, value.w);
     }
 
     void setUniform(const std::string &name, const glm::mat4 &value) {
-        glUniformMatrix4fv(getUniformID(name), 1, GL_FALSE, &value[0][0]);
+        for (auto&& u: getUniformID(name))
+            glProgramUniformMatrix4fv(u.program, u.location, 1, GL_FALSE, &value[0][0]);
     }
 
     void setUniform(const std::string &name, const std::vector<GLint> &value) {
-        glUniform1iv(getUniformID(name), static_cast<GLint>(value.size()), value.data());
+        for (auto&& u: getUniformID(name))
+            glProgramUniform1iv(u.program, u.location, static_cast<GLint>(value.size()), value.data());
     }
 
     void setUniform(const std::string &name, const std::vector<float> &value) {
-        glUniform1fv(getUniformID(name), static_cast<GLint>(value.size()), value.data());
+        for (auto&& u: getUniformID(name))
+            glProgramUniform1fv(u.program, u.location, static_cast<GLint>(value.size()), value.data());
     }
 
-    void linkProgram() const {
-        if (vertexShaderId.has_value())
-            glAttachShader(id, *vertexShaderId);
-        if (tessCtrlShaderId.has_value())
-            glAttachShader(id, *tessCtrlShaderId);
-        if (tessEvalShaderId.has_value())
-            glAttachShader(id, *tessEvalShaderId);
-        if (fragmentShaderId.has_value())
-            glAttachShader(id, *fragmentShaderId);
-        glLinkProgram(id);
-        checkProgram(id);
+    // links the stages changed since the last link, all of them unless separable, shaders are
+    // compiled here, so pipelines which are never enabled are never compiled
+    void linkProgram() {
+        ProfileScope scope("GLShaderPipeline::linkProgram");
+        if (!separable) {
+            std::vector<Stage*> linked;
+            for (auto&& stage: stages) {
+                stage.linked = true;
+                if (!stage.empty())
+                    linked.push_back(&stage);
+            }
+            // a new program rather than relinking the old one, which stays usable if linking fails
+            GLuint program = linkStages(linked);
+            if (id != 0)
+                glDeleteProgram(id);
+            id = program;
+            bindUniformBlocks(id);
+            return;
+        }
+
+        for (auto&& stage: stages) {
+            if (stage.linked)
+                continue;
+            stage.linked = true;
+            if (stage.empty())
+                continue;
+
+            GLuint program = linkStages({ &stage });
+            bindUniformBlocks(program);
+            glUseProgramStages(id, stage.bit, program);
+            if (stage.program != 0)
+                glDeleteProgram(stage.program);
+            stage.program = program;
+        }
     }
 
     ~GLShaderPipeline() {
-        glDeleteProgram(id);
-        if (fragmentShaderId.has_value())
-            glDeleteShader(*fragmentShaderId);
-        if (vertexShaderId.has_value())
-            glDeleteShader(*vertexShaderId);
-        if (tessCtrlShaderId.has_value())
-            glDeleteShader(*tessCtrlShaderId);
-        if (tessEvalShaderId.has_value())
-            glDeleteShader(*tessEvalShaderId);
+        if (bound == this)
+            bound = nullptr;
+        if (separable) {
+            glDeleteProgramPipelines(1, &id);
+        } else if (id != 0) {
+            glDeleteProgram(id);
+        }
+        for (auto&& stage: stages) {
+            if (stage.program != 0)
+                glDeleteProgram(stage.program);
+            if (stage.shader.has_value() && stage.shader->id != 0)
+                glDeleteShader(stage.shader->id);
+            for (auto&& [name, library]: stage.libraries) {
+                if (library.id != 0)
+                    glDeleteShader(library.id);
+            }
+        }
     }
 };
-
@@ -0,0 +1,15 @@
+#version 410
+
+in vec3 color;
+in vec3 position;
+
+layout (location = 0) out vec4 out_color;
+// nothing to probe, see plane.frag
+layout (location = 1) out vec4 out_probe;
+
+void main() {
+    out_color = vec4(color, 1.0f);
+    // the lines lie on the plotted surface, pull them slightly towards the camera so they aren't hidden by it
+    gl_FragDepth = gl_FragCoord.z - 0.0002;
+    out_probe = vec4(0.0);
+}
@@ -3,16 +3,14 @@
 in vec3 color;
 in vec3 position;
 
-out vec4 out_color;
-
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform vec2 center;
+layout (location = 0) out vec4 out_color;
+// nothing to probe, see plane.frag
+layout (location = 1) out vec4 out_probe;
 
 void main() {
     out_color = vec4(
         vec3(0.5, 0.5, 0.5),
         1.0f
     );
+    out_probe = vec4(0.0);
 }
@@ -2,17 +2,22 @@
 
 layout (location = 0) in vec3 in_position;
 layout (location = 1) in vec3 in_color;
+// per-instance attributes, see GLMeshInstance
+layout (location = 2) in mat4 in_model;
+layout (location = 6) in vec2 in_center;
+layout (location = 7) in float in_formula;
 
 out vec3 color;
 out vec3 position;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform vec2 center;
+// matrices of the view being drawn, see GLCameraBuffer
+layout (std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+};
 
 void main() {
     position = in_position;
-    gl_Position = projection * view * model * vec4(position, 1.0);
+    gl_Position = projection * view * in_model * vec4(position, 1.0);
     color = in_color;
 }
@@ -7,8 +7,11 @@ out vec3 color;
 out vec3 position;
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// matrices of the view being drawn, see GLCameraBuffer
+layout (std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+};
 
 void main() {
     position = in_position;
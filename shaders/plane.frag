@@ -2,13 +2,16 @@
 
 in vec3 color;
 in vec3 position;
+in vec4 probe;
 
-out vec4 out_color;
+layout (location = 0) out vec4 out_color;
+// domain coordinates and value of the fragment, read back by GLProbeReader
+layout (location = 1) out vec4 out_probe;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform vec2 center;
+// per formula id the values (lo, hi) mapped onto the colormap, see GLValueRanges
+uniform samplerBuffer value_ranges;
+// colors of lo to hi, see GLColormap
+uniform sampler1D colormap;
 
 // uniform vec3 camera_position;
 // struct DirectionalLight {
@@ -35,11 +38,15 @@ uniform vec2 center;
 // }
 
 void main() {
-    vec3 c = mix(vec3(0.0, 0.0, 1.0), vec3(1.0, 1.0, 0.0), sin(position.y));
+    // colored by the value before the height scale, probe.w is formula id + 1
+    vec2 range = texelFetch(value_ranges, int(probe.w - 0.5)).rg;
+    float v = range.y > range.x ? (probe.z - range.x) / (range.y - range.x) : 0.5;
+    vec3 c = texture(colormap, clamp(v, 0.0, 1.0)).rgb;
 
     out_color = vec4(
         // calc_directional_light(),
         c,
         1.0f
     );
+    out_probe = probe;
 }
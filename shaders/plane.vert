@@ -2,14 +2,21 @@
 
 layout (location = 0) in vec3 in_position;
 layout (location = 1) in vec3 in_color;
+// per-instance attributes, see GLMeshInstance
+layout (location = 2) in mat4 in_model;
+layout (location = 6) in vec2 in_center;
+layout (location = 7) in float in_formula;
+
+// redeclared, separable programs must declare the built-in blocks they use
+out gl_PerVertex {
+    vec4 gl_Position;
+};
 
 out vec3 color;
 out vec3 position;
-
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform vec2 center;
+out mat4 instance_model;
+out vec2 instance_center;
+out float instance_formula;
 
 void main() {
     position = in_position;
@@ -19,4 +26,8 @@ void main() {
     // gl_Position = vec4(in_position, 1.0);
     color = in_color;
     position = in_position;
+
+    instance_model = in_model;
+    instance_center = in_center;
+    instance_formula = in_formula;
 }
@@ -0,0 +1,11 @@
+#version 410 core
+
+// prefix of the func generated by generate_func (expr_parser.hpp), compiled as its own tess eval
+// shader object and linked with plane.tese, which defines the gc_ functions declared by
+// glsl_declarations from FUNCTION_TABLE
+
+#define pi 3.14159265358979323846lf
+#define e  2.7182818284590452354lf
+
+// animation time in seconds, the t of formulas, see GLMeshObject::set_time
+uniform float t;
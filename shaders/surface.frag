@@ -0,0 +1,19 @@
+#version 410
+
+in vec3 color;
+in vec3 position;
+in vec3 normal;
+
+layout (location = 0) out vec4 out_color;
+// nothing to probe, see plane.frag
+layout (location = 1) out vec4 out_probe;
+
+void main() {
+    vec3 light_direction = normalize(vec3(0.3, 1.0, 0.5));
+    // two sided, triangles from marching_cubes.hpp have no consistent winding
+    float diffuse = abs(dot(normalize(normal), light_direction));
+
+    vec3 base_color = mix(vec3(0.0, 0.0, 1.0), vec3(1.0, 1.0, 0.0), sin(position.y) * 0.5 + 0.5);
+    out_color = vec4(base_color * (0.2 + 0.8 * diffuse), 1.0f);
+    out_probe = vec4(0.0);
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "GL/glew.h"
+
+#include "profiler.hpp"
+
+// buffer for data rewritten often, e.g. meshes extracted on the CPU or tile samples on their way
+// to a texture
+//
+// the buffer is split into REGIONS regions written in turn, a fence after the commands reading a
+// region tells when it can be written again, so writing never waits for the GPU unless it's more
+// than REGIONS updates behind, and the buffer isn't reallocated unless the data outgrows a region
+//
+// with GL_ARB_buffer_storage the buffer is mapped once, persistently and coherently, otherwise
+// every region is mapped with GL_MAP_UNSYNCHRONIZED_BIT, which is safe since its fence has
+// signaled, and GL_MAP_INVALIDATE_RANGE_BIT, so the driver doesn't preserve the old contents
+// https://www.khronos.org/opengl/wiki/Buffer_Object_Streaming
+class GLStreamBuffer {
+public:
+    static const size_t REGIONS = 3;
+
+private:
+    // written through a binding point no other code uses, binding GL_ELEMENT_ARRAY_BUFFER
+    // would change the vertex array object bound at the time
+    static const GLenum target = GL_COPY_WRITE_BUFFER;
+
+    GLuint buffer = 0;
+    size_t regionSize = 0;
+    bool persistent;
+    // whole buffer while persistently mapped
+    uint8_t* mapped = nullptr;
+
+    GLsync fences[REGIONS] = {};
+    // region being written or last written
+    size_t region = REGIONS - 1;
+    bool writing = false;
+
+    void allocate(size_t size) {
+        release();
+        // regions start at offsets aligned for any vertex attribute or pixel type
+        regionSize = (std::max(size, (size_t)1) + 255) / 256 * 256;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(target, buffer);
+        if (persistent) {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(target, regionSize * REGIONS, nullptr, flags);
+            mapped = static_cast<uint8_t*>(glMapBufferRange(target, 0, regionSize * REGIONS, flags));
+        } else {
+            glBufferData(target, regionSize * REGIONS, nullptr, GL_STREAM_DRAW);
+        }
+        glBindBuffer(target, 0);
+    }
+
+    // the old buffer is only deleted by the GL once commands using it have finished
+    void release() {
+        for (auto&& fence: fences) {
+            if (fence != 0)
+                glDeleteSync(fence);
+            fence = 0;
+        }
+        if (buffer == 0)
+            return;
+
+        if (mapped != nullptr) {
+            glBindBuffer(target, buffer);
+            glUnmapBuffer(target);
+            glBindBuffer(target, 0);
+            mapped = nullptr;
+        }
+        glDeleteBuffers(1, &buffer);
+        buffer = 0;
+    }
+
+public:
+    // the buffer can be bound to any target for reading
+    GLStreamBuffer(size_t regionSize): persistent(GLEW_ARB_buffer_storage) {
+        allocate(regionSize);
+    }
+
+    GLStreamBuffer(GLStreamBuffer&&) = delete;
+    GLStreamBuffer(GLStreamBuffer&) = delete;
+
+    // memory for size bytes in the next region, valid until unmap, a larger size reallocates
+    // the buffer, so get_buffer has to be checked again
+    void* map(size_t size) {
+        ProfileScope scope("GLStreamBuffer::map");
+        if (size > regionSize)
+            allocate(std::max(size, regionSize * 2));
+
+        region = (region + 1) % REGIONS;
+        if (fences[region] != 0) {
+            // only waits if the GPU is REGIONS updates behind
+            glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(fences[region]);
+            fences[region] = 0;
+        }
+
+        if (persistent)
+            return mapped + region * regionSize;
+        // mapping an empty range is an error
+        if (size == 0)
+            return nullptr;
+
+        glBindBuffer(target, buffer);
+        void* result = glMapBufferRange(target, region * regionSize, size,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        glBindBuffer(target, 0);
+        // nullptr if mapping failed, then there's nothing to unmap
+        writing = result != nullptr;
+        return result;
+    }
+
+    // ends writing the region, returns its offset in the buffer for the commands reading it
+    size_t unmap() {
+        if (!persistent && writing) {
+            glBindBuffer(target, buffer);
+            glUnmapBuffer(target);
+            glBindBuffer(target, 0);
+        }
+        writing = false;
+        return region * regionSize;
+    }
+
+    // map, copy and unmap
+    size_t upload(const void* data, size_t size) {
+        void* out = map(size);
+        if (out != nullptr && size != 0)
+            std::memcpy(out, data, size);
+        return unmap();
+    }
+
+    // must be called after the last command reading the current region was issued, so that the
+    // region isn't overwritten before the GPU is done with it
+    void fence() {
+        if (fences[region] != 0)
+            glDeleteSync(fences[region]);
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    GLuint get_buffer() const {
+        return buffer;
+    }
+
+    bool is_persistent() const {
+        return persistent;
+    }
+
+    ~GLStreamBuffer() {
+        release();
+    }
+};
@@ -0,0 +1,247 @@
+// checks of the formula pipeline: parser, bytecode compiler, verifier and library format
+// build and run with `make test && ./test [filter]`, exits with 1 if a check fails
+
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "expr_parser.hpp"
+#include "expr_bytecode.hpp"
+#include "bytecode_format.hpp"
+#include "formula_batch.hpp"
+
+struct Test {
+    std::string name;
+    std::function<bool()> run;
+};
+
+// true if verify_bytecode rejects code
+bool rejected(const Bytecode& bytecode) {
+    try {
+        verify_bytecode(bytecode);
+    } catch (const BytecodeError&) {
+        return true;
+    }
+    return false;
+}
+
+// value of formula at (x, y, z, t) evaluated from its bytecode
+double evaluate_formula(const std::string& formula, double x, double y, double z = 0.0, double t = 0.0) {
+    auto expr = Parser(tokenize(formula)).parse();
+    return evaluate(compile_bytecode(*expr), x, y, z, t);
+}
+
+// true if formula doesn't parse
+bool parse_fails(const std::string& formula) {
+    try {
+        Parser(tokenize(formula)).parse();
+    } catch (const ParserError&) {
+        return true;
+    }
+    return false;
+}
+
+std::vector<Test> tests() {
+    return {
+        {"evaluate computes the formula", []() {
+            double x = 1.5, y = -0.75;
+            double expected = std::sin(x) * y + std::pow(x, 2.0) - 3.0 / y + std::abs(y);
+            return std::abs(evaluate_formula("sin(x)*y + x**2 - 3/y + abs(y)", x, y) - expected) < 1e-12;
+        }},
+        {"compiled bytecode passes verify_bytecode", []() {
+            for (const char* formula: { "x", "-(x*y)", "sin(x)*cos(y)", "hypot(x, y)/(1 + x**2)", "x*y*x*y*x*y - 2" }) {
+                if (rejected(compile_bytecode(*Parser(tokenize(formula)).parse())))
+                    return false;
+            }
+            return true;
+        }},
+        {"evaluate_batch matches evaluate", []() {
+            Bytecode bytecode = compile_bytecode(*Parser(tokenize("sin(x*y) + exp(-x*x) - y/3")).parse());
+            // not a multiple of BATCH_SIZE, so the last batch is partial
+            const size_t n = BATCH_SIZE * 3 + 5;
+            std::vector<double> xs(n), ys(n), out(n);
+            for (size_t i=0; i != n; i++) {
+                xs[i] = -4.0 + 8.0 * i / n;
+                ys[i] = 3.0 - 0.5 * i / n;
+            }
+            evaluate_batch(bytecode, xs.data(), ys.data(), nullptr, out.data(), n);
+            for (size_t i=0; i != n; i++) {
+                if (out[i] != evaluate(bytecode, xs[i], ys[i]))
+                    return false;
+            }
+            return true;
+        }},
+        {"hash and equals ignore formatting and operand order", []() {
+            auto a = Parser(tokenize("x*y + 1")).parse();
+            auto b = Parser(tokenize("(1.0 + (y * x))")).parse();
+            return a->hash == b->hash && a->equals(*b) && b->equals(*a) && a->canonical() == b->canonical();
+        }},
+        {"hash and equals tell different formulas apart", []() {
+            for (auto [first, second]: { std::make_pair("x - y", "y - x"), std::make_pair("x / 2", "2 / x"),
+                    std::make_pair("sin(x)", "cos(x)"), std::make_pair("atan2(x, y)", "atan2(y, x)"), std::make_pair("x + 1", "x + 1.5") }) {
+                auto a = Parser(tokenize(first)).parse();
+                auto b = Parser(tokenize(second)).parse();
+                if (a->hash == b->hash || a->equals(*b) || a->canonical() == b->canonical())
+                    return false;
+            }
+            return true;
+        }},
+        {"parameter shadows x", []() {
+            return evaluate_formula("f(x)=x*x; f(y)", 2.0, 3.0) == 9.0;
+        }},
+        {"parameter shadows t", []() {
+            auto expr = Parser(tokenize("f(t)=sin(t)*t; f(x)")).parse();
+            Bytecode bytecode = compile_bytecode(*expr);
+            return !is_animated(bytecode) && evaluate(bytecode, 2.0, 0.0, 0.0, 5.0) == std::sin(2.0) * 2.0;
+        }},
+        {"let shadows z", []() {
+            auto expr = Parser(tokenize("let z = 2 in z*x")).parse();
+            Bytecode bytecode = compile_bytecode(*expr);
+            return !is_implicit(bytecode) && evaluate(bytecode, 3.0, 0.0, 7.0, 0.0) == 6.0;
+        }},
+        {"let shadows pi", []() {
+            return evaluate_formula("let pi = 3 in pi*x", 2.0, 0.0) == 6.0;
+        }},
+        {"built-in functions are reserved", []() {
+            return parse_fails("let sin = 2 in sin") && parse_fails("sin(a)=a; sin(x)") && parse_fails("f(cos)=cos; f(x)");
+        }},
+        {"verify_bytecode accepts compiled select", []() {
+            auto expr = Parser(tokenize("if(x < y, x, y)")).parse();
+            return !rejected(compile_bytecode(*expr));
+        }},
+        {"verify_bytecode rejects select underflow", []() {
+            Bytecode bytecode {
+                .code = {
+                    Instruction { .op = OpCode::X, .value = 0.0 },
+                    Instruction { .op = OpCode::Y, .value = 0.0 },
+                    Instruction { .op = OpCode::Select, .value = 0.0 },
+                    Instruction { .op = OpCode::X, .value = 0.0 },
+                },
+                .stack_size = 2,
+            };
+            return rejected(bytecode);
+        }},
+        {"BytecodeLibraryView rejects formula out of bounds", []() {
+            auto expr = Parser(tokenize("x*y")).parse();
+            std::vector<uint8_t> library = write_bytecode_library({ compile_bytecode(*expr) }, { expr->hash });
+            BytecodeLibraryView view(library.data(), library.size());
+            try {
+                view.load(1);
+            } catch (const BytecodeFormatError&) {
+                return view.load(0).code.size() == 3;
+            }
+            return false;
+        }},
+        {"fold_constants folds exact arithmetic", []() {
+            auto expr = Parser(tokenize("2*pi*x + max(1, 3) - abs(-2)")).parse();
+            Bytecode bytecode = compile_bytecode(*expr);
+            Bytecode folded = fold_constants(bytecode);
+            // (Const 2pi, X, Mul, Const 3, Add, Const 2, Sub)
+            return folded.code.size() == 7 && evaluate(folded, 1.5, 0.0, 0.0, 0.0) == evaluate(bytecode, 1.5, 0.0, 0.0, 0.0);
+        }},
+        {"fold_constants keeps functions the GPU approximates", []() {
+            for (const char* formula: { "sin(1)*x", "2**0.5*x", "exp(1)*x", "1/3*x", "sqrt(2)*x" }) {
+                auto expr = Parser(tokenize(formula)).parse();
+                Bytecode bytecode = compile_bytecode(*expr);
+                if (fold_constants(bytecode).code.size() != bytecode.code.size())
+                    return false;
+            }
+            return true;
+        }},
+        {"compile_formulas returns errors with their stage and position", []() {
+            std::vector<CompiledFormula> compiled = compile_formulas({ "x*y", "x + 1.2.3", "x + * y", "foo(x)" });
+            return compiled[0].ok && compiled[0].bytecode.code.size() == 3 && !compiled[0].glsl.statements.empty()
+                && !compiled[1].ok && compiled[1].error.stage == FormulaStage::Tokenize && compiled[1].error.pos == 7
+                && !compiled[2].ok && compiled[2].error.stage == FormulaStage::Parse && compiled[2].error.pos == 2
+                && !compiled[3].ok && compiled[3].error.stage == FormulaStage::Parse;
+        }},
+        {"compile_formulas is independent of the thread count", []() {
+            std::vector<std::string> sources;
+            for (int i=0; i != 100; i++) {
+                sources.push_back(i % 3 ? "x*" + std::to_string(i) + " + sin(y)" : "x +* " + std::to_string(i));
+            }
+            std::vector<CompiledFormula> single = compile_formulas(sources, FormulaOptions { .threads = 1 });
+            std::vector<CompiledFormula> multi = compile_formulas(sources, FormulaOptions { .threads = 4 });
+            for (size_t i=0; i != sources.size(); i++) {
+                if (single[i].ok != multi[i].ok || single[i].ok != (i % 3 != 0) || single[i].hash != multi[i].hash
+                        || single[i].error.what != multi[i].error.what)
+                    return false;
+            }
+            return true;
+        }},
+        {"out of range literals compile", []() {
+            std::string huge = "1" + std::string(400, '9');
+            std::string tiny = "0." + std::string(400, '0') + "1";
+            std::vector<CompiledFormula> compiled = compile_formulas({ huge + "*x", tiny + "*x" }, FormulaOptions { .threads = 2 });
+            return compiled[0].ok && compiled[1].ok
+                && std::isinf(evaluate(compiled[0].bytecode, 1.0, 0.0, 0.0, 0.0))
+                && std::abs(evaluate(compiled[1].bytecode, 1.0, 0.0, 0.0, 0.0)) < 1e-300;
+        }},
+        {"fast_math_batch matches the scalar approximations", []() {
+            // in range values and some of every fallback: huge, NaN, infinite, negative, zero, subnormal
+            std::vector<float> values { 0.5f, -3.0f, 100.0f, -100.0f, 1e4f, 1e30f, NAN, INFINITY, -INFINITY,
+                -1.0f, 0.0f, 1e-40f, 2.0f, 7.25f, 90.0f, -200.0f, 1e-3f };
+            for (OpCode op: { OpCode::Sin, OpCode::Cos, OpCode::Tan, OpCode::Exp, OpCode::Exp2, OpCode::Log, OpCode::Log2 }) {
+                std::vector<double> batch(values.begin(), values.end());
+                fast_math_batch(MathTier::Medium, op, nullptr, batch.data(), batch.size());
+                for (size_t i=0; i != values.size(); i++) {
+                    float x = values[i];
+                    float expected = op == OpCode::Sin ? fm_sin<MathTier::Medium>(x) : op == OpCode::Cos ? fm_cos<MathTier::Medium>(x)
+                        : op == OpCode::Tan ? fm_tan<MathTier::Medium>(x) : op == OpCode::Exp ? fm_exp<MathTier::Medium>(x)
+                        : op == OpCode::Exp2 ? fm_exp2<MathTier::Medium>(x) : op == OpCode::Log ? fm_log<MathTier::Medium>(x)
+                        : fm_log2<MathTier::Medium>(x);
+                    if (!((float)batch[i] == expected || (std::isnan(batch[i]) && std::isnan(expected))))
+                        return false;
+                }
+            }
+
+            std::vector<double> a(values.begin(), values.end()), b(values.rbegin(), values.rend());
+            fast_math_batch(MathTier::Fast, OpCode::Pow, a.data(), b.data(), a.size());
+            for (size_t i=0; i != values.size(); i++) {
+                float expected = fm_pow<MathTier::Fast>(values[i], values[values.size() - 1 - i]);
+                if (!((float)a[i] == expected || (std::isnan(a[i]) && std::isnan(expected))))
+                    return false;
+            }
+            return true;
+        }},
+        {"generate_func declares every gc_ function once", []() {
+            std::string func = generate_func({ generate_glsl(*Parser(tokenize("if(x < y, x**2, atan2(y, x))")).parse()) });
+            for (const char* declaration: { "double gc_pow(double a0, double a1);", "double gc_sin(double a0);",
+                    "double gc_select(double a0, double a1, double a2);" }) {
+                size_t first = func.find(declaration);
+                if (first == std::string::npos || func.find(declaration, first + 1) != std::string::npos)
+                    return false;
+            }
+            return true;
+        }},
+    };
+}
+
+int main(int argc, char** argv) {
+    std::string filter = argc > 1 ? argv[1] : "";
+    int failed = 0;
+
+    for (auto&& test: tests()) {
+        if (!filter.empty() && test.name.find(filter) == std::string::npos)
+            continue;
+
+        bool ok = false;
+        std::string error;
+        try {
+            ok = test.run();
+        } catch (const TokenizerError& e) {
+            error = ": " + e.what;
+        } catch (const ParserError& e) {
+            error = ": " + e.what;
+        } catch (const BytecodeError& e) {
+            error = ": " + e.what;
+        }
+
+        std::printf("%s %s%s\n", ok ? "ok  " : "FAIL", test.name.c_str(), error.c_str());
+        failed += !ok;
+    }
+
+    return failed ? 1 : 0;
+}
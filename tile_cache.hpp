@@ -0,0 +1,233 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "expr_bytecode.hpp"
+#include "parallel.hpp"
+
+// cache of formula samples in square tiles on a fixed lattice, so that panning only samples
+// the newly exposed tiles
+//
+// tile (x, y) of level of detail lod holds the samples at ((x * TILE_SIZE + i) * cell, (y * TILE_SIZE + j) * cell)
+// for i, j in [0, TILE_SIZE], where cell = TILE_BASE_CELL * 2^lod, neighbouring tiles share their borders
+
+const int TILE_SIZE = 64;
+const int TILE_SAMPLES = TILE_SIZE + 1;
+const double TILE_BASE_CELL = 1.0 / 8.0;
+
+double tile_cell(int lod) {
+    return std::ldexp(TILE_BASE_CELL, lod);
+}
+
+double tile_span(int lod) {
+    return TILE_SIZE * tile_cell(lod);
+}
+
+// the coarsest level whose cell isn't larger than spacing
+int tile_lod(double spacing) {
+    return std::max(0, (int)std::floor(std::log2(spacing / TILE_BASE_CELL)));
+}
+
+struct TileKey {
+    // hash of the formula, see Plot::hash
+    uint64_t formula;
+    glm::ivec2 tile;
+    int lod;
+
+    bool operator==(const TileKey &other) const {
+        return formula == other.formula && tile == other.tile && lod == other.lod;
+    }
+};
+
+struct TileKeyHash {
+    size_t operator()(const TileKey &key) const {
+        uint64_t h = key.formula;
+        for (uint64_t v: { (uint64_t)(uint32_t)key.tile.x, (uint64_t)(uint32_t)key.tile.y, (uint64_t)(uint32_t)key.lod }) {
+            h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        }
+        return h;
+    }
+};
+
+// least recently used order of tiles, entries used at the current stamp are never evicted
+template<typename V>
+class TileLru {
+    struct Entry {
+        TileKey key;
+        V value;
+        uint64_t stamp;
+    };
+
+    // most recently used first
+    std::list<Entry> order {};
+    std::unordered_map<TileKey, typename std::list<Entry>::iterator, TileKeyHash> index {};
+
+public:
+    // marks the entry as used at stamp, nullptr if not present
+    V* find(const TileKey &key, uint64_t stamp) {
+        auto it = index.find(key);
+        if (it == index.end())
+            return nullptr;
+
+        order.splice(order.begin(), order, it->second);
+        it->second->stamp = stamp;
+        return &it->second->value;
+    }
+
+    void insert(const TileKey &key, V value, uint64_t stamp) {
+        order.push_front(Entry { .key = key, .value = value, .stamp = stamp });
+        index[key] = order.begin();
+    }
+
+    // removes the least recently used entry, returns false if there is none not used at stamp
+    bool evict(uint64_t stamp, V &value) {
+        if (order.empty() || order.back().stamp == stamp)
+            return false;
+
+        value = order.back().value;
+        index.erase(order.back().key);
+        order.pop_back();
+        return true;
+    }
+
+    size_t size() const {
+        return index.size();
+    }
+};
+
+// fixed size blocks of TILE_SAMPLES^2 floats, carved out of larger slabs and recycled through
+// a free list, so that evicting and loading tiles doesn't go through the general purpose allocator
+class TileSlab {
+    static const size_t BLOCKS_PER_SLAB = 64;
+    static const size_t BLOCK_SIZE = TILE_SAMPLES * TILE_SAMPLES;
+
+    std::vector<std::unique_ptr<float[]>> slabs {};
+    std::vector<float*> freeBlocks {};
+
+public:
+    float* allocate() {
+        if (freeBlocks.empty()) {
+            slabs.push_back(std::make_unique<float[]>(BLOCKS_PER_SLAB * BLOCK_SIZE));
+            for (size_t i=BLOCKS_PER_SLAB; i != 0; i--) {
+                freeBlocks.push_back(slabs.back().get() + (i - 1) * BLOCK_SIZE);
+            }
+        }
+
+        float* block = freeBlocks.back();
+        freeBlocks.pop_back();
+        return block;
+    }
+
+    void release(float* block) {
+        freeBlocks.push_back(block);
+    }
+
+    size_t capacity() const {
+        return slabs.size() * BLOCKS_PER_SLAB;
+    }
+};
+
+class TileCache {
+    TileSlab slab {};
+    TileLru<float*> lru {};
+    size_t capacity;
+    uint64_t stamp = 0;
+
+    size_t hits = 0;
+    size_t misses = 0;
+
+    static void sample_tile(const Bytecode &bytecode, const TileKey &key, float* out) {
+        const double cell = tile_cell(key.lod);
+        const size_t n = TILE_SAMPLES * TILE_SAMPLES;
+        std::vector<double> xs(n), ys(n), values(n);
+
+        for (int j=0; j != TILE_SAMPLES; j++) {
+            for (int i=0; i != TILE_SAMPLES; i++) {
+                xs[j * TILE_SAMPLES + i] = (key.tile.x * TILE_SIZE + i) * cell;
+                ys[j * TILE_SAMPLES + i] = (key.tile.y * TILE_SIZE + j) * cell;
+            }
+        }
+        evaluate_batch(bytecode, xs.data(), ys.data(), nullptr, values.data(), n);
+
+        for (size_t i=0; i != n; i++) {
+            out[i] = values[i];
+        }
+    }
+
+public:
+    // capacity in tiles, exceeded only if a single fetch needs more
+    TileCache(size_t capacity = 2048): capacity(capacity) {
+    }
+
+    TileCache(TileCache&&) = delete;
+    TileCache(TileCache&) = delete;
+
+    // samples of the given tiles of formula, TILE_SAMPLES^2 floats row by row each, valid until
+    // the next fetch, missing tiles are sampled in parallel, threads = 0 uses all hardware threads
+    std::vector<const float*> fetch(const Bytecode &bytecode, uint64_t formula, int lod,
+            const std::vector<glm::ivec2> &tiles, size_t threads = 0) {
+        stamp++;
+
+        std::vector<const float*> result(tiles.size());
+        std::vector<std::pair<TileKey, float*>> missing;
+        for (size_t i=0; i != tiles.size(); i++) {
+            TileKey key { .formula = formula, .tile = tiles[i], .lod = lod };
+            if (float** cached = lru.find(key, stamp)) {
+                result[i] = *cached;
+                hits++;
+            } else {
+                float* block = slab.allocate();
+                lru.insert(key, block, stamp);
+                missing.emplace_back(key, block);
+                result[i] = block;
+                misses++;
+            }
+        }
+
+        parallel_for(missing.size(), threads, [&](size_t i) {
+            sample_tile(bytecode, missing[i].first, missing[i].second);
+        });
+
+        float* evicted;
+        while (lru.size() > capacity && lru.evict(stamp, evicted)) {
+            slab.release(evicted);
+        }
+
+        return result;
+    }
+
+    size_t size() const {
+        return lru.size();
+    }
+
+    size_t get_hits() const {
+        return hits;
+    }
+
+    size_t get_misses() const {
+        return misses;
+    }
+};
+
+// tiles of level lod covering [min, max]
+std::vector<glm::ivec2> tiles_covering(glm::dvec2 min, glm::dvec2 max, int lod) {
+    const double span = tile_span(lod);
+    glm::ivec2 first { (int)std::floor(min.x / span), (int)std::floor(min.y / span) };
+    glm::ivec2 last { (int)std::floor(max.x / span), (int)std::floor(max.y / span) };
+
+    std::vector<glm::ivec2> result;
+    for (int y=first.y; y <= last.y; y++) {
+        for (int x=first.x; x <= last.x; x++) {
+            result.push_back(glm::ivec2 { x, y });
+        }
+    }
+    return result;
+}
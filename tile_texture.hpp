@@ -0,0 +1,191 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include "GL/glew.h"
+
+#include "expr_bytecode.hpp"
+#include "shader_pipeline.hpp"
+#include "stream_buffer.hpp"
+#include "tile_cache.hpp"
+#include "profiler.hpp"
+
+// GPU copy of TileCache tiles, read by plane_cached.tese
+//
+// tiles are layers of a TILE_SAMPLES^2 R32F texture array, reused in least recently used
+// order, and a page table in a texture buffer maps the tiles covering the plotted domain
+// of every formula to their layers
+//
+// samples are copied into a GLStreamBuffer and uploaded from there as a pixel unpack buffer, so
+// glTexSubImage3D returns without copying them or waiting for draws still reading the texture
+// https://www.khronos.org/opengl/wiki/Array_Texture
+class GLTileTextures {
+    // number of ints before the page table entries, see plane_cached.tese
+    static const size_t PAGES_HEADER = 4;
+    static const size_t TILE_BYTES = sizeof(float) * TILE_SAMPLES * TILE_SAMPLES;
+
+    GLuint texture;
+    GLint layers;
+    GLuint pagesBuffer;
+    GLuint pagesTexture;
+
+    TileLru<GLint> lru {};
+    uint64_t stamp = 0;
+    // grows to the largest number of tiles uploaded at once
+    GLStreamBuffer staging { 64 * TILE_BYTES };
+
+    // tiles per side of a square covering [min, max] at lod
+    static int tiles_per_side(glm::dvec2 min, glm::dvec2 max, int lod) {
+        const double span = tile_span(lod);
+        return std::max(
+            (int)std::floor(max.x / span) - (int)std::floor(min.x / span),
+            (int)std::floor(max.y / span) - (int)std::floor(min.y / span)
+        ) + 1;
+    }
+
+    void upload_pages(const std::vector<GLint> &pages) {
+        glBindBuffer(GL_TEXTURE_BUFFER, pagesBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(GLint) * pages.size(), pages.data(), GL_DYNAMIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, pagesTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, pagesBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+public:
+    GLTileTextures(GLint maxLayers = 1024) {
+        GLint limit;
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &limit);
+        layers = std::min(maxLayers, limit);
+
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, TILE_SAMPLES, TILE_SAMPLES, layers, 0, GL_RED, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        glGenBuffers(1, &pagesBuffer);
+        glGenTextures(1, &pagesTexture);
+        upload_pages(std::vector<GLint>(PAGES_HEADER, 0));
+    }
+
+    GLTileTextures(GLTileTextures&&) = delete;
+    GLTileTextures(GLTileTextures&) = delete;
+
+    // the finest level not below lod at which count formulas covering [min, max] fit into the layers
+    int fit_lod(int lod, glm::dvec2 min, glm::dvec2 max, size_t count) const {
+        while (count * tiles_per_side(min, max, lod) * tiles_per_side(min, max, lod) > (size_t)layers) {
+            lod++;
+        }
+        return lod;
+    }
+
+    // makes the tiles covering [min, max] of every formula resident, formulas[i] is the hash of
+    // bytecodes[i] (see Plot::hash), or 0 for formulas which aren't drawn from tiles,
+    // only tiles that weren't resident are uploaded and only those missing from cache are sampled
+    void update(TileCache &cache, const std::vector<Bytecode> &bytecodes, const std::vector<uint64_t> &formulas,
+            glm::dvec2 min, glm::dvec2 max, int lod) {
+        ProfileScope scope("GLTileTextures::update");
+        stamp++;
+
+        const double span = tile_span(lod);
+        const glm::ivec2 origin { (int)std::floor(min.x / span), (int)std::floor(min.y / span) };
+        const int side = tiles_per_side(min, max, lod);
+
+        std::vector<GLint> pages(PAGES_HEADER + formulas.size() * side * side, -1);
+        pages[0] = origin.x;
+        pages[1] = origin.y;
+        pages[2] = side;
+        pages[3] = lod;
+
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        for (size_t f=0; f != formulas.size(); f++) {
+            if (formulas[f] == 0)
+                continue;
+
+            std::vector<glm::ivec2> missing;
+            for (int y=0; y != side; y++) {
+                for (int x=0; x != side; x++) {
+                    glm::ivec2 tile { origin.x + x, origin.y + y };
+                    if (GLint* layer = lru.find(TileKey { .formula = formulas[f], .tile = tile, .lod = lod }, stamp)) {
+                        pages[PAGES_HEADER + (f * side + y) * side + x] = *layer;
+                    } else {
+                        missing.push_back(tile);
+                    }
+                }
+            }
+
+            if (missing.empty())
+                continue;
+
+            std::vector<const float*> samples = cache.fetch(bytecodes[f], formulas[f], lod, missing);
+            std::vector<GLint> uploaded;
+            for (size_t i=0; i != missing.size(); i++) {
+                GLint layer;
+                if (lru.size() < (size_t)layers) {
+                    layer = lru.size();
+                } else if (!lru.evict(stamp, layer)) {
+                    // everything is in use, see fit_lod
+                    break;
+                }
+
+                lru.insert(TileKey { .formula = formulas[f], .tile = missing[i], .lod = lod }, layer, stamp);
+                uploaded.push_back(layer);
+
+                glm::ivec2 page { missing[i].x - origin.x, missing[i].y - origin.y };
+                pages[PAGES_HEADER + (f * side + page.y) * side + page.x] = layer;
+            }
+
+            if (uploaded.empty())
+                continue;
+
+            uint8_t* out = static_cast<uint8_t*>(staging.map(TILE_BYTES * uploaded.size()));
+            for (size_t i=0; out != nullptr && i != uploaded.size(); i++) {
+                std::memcpy(out + TILE_BYTES * i, samples[i], TILE_BYTES);
+            }
+            size_t offset = staging.unmap();
+
+            if (out == nullptr) {
+                // mapping failed, uploads from the samples synchronously instead
+                for (size_t i=0; i != uploaded.size(); i++) {
+                    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, uploaded[i], TILE_SAMPLES, TILE_SAMPLES, 1,
+                        GL_RED, GL_FLOAT, samples[i]);
+                }
+                continue;
+            }
+
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.get_buffer());
+            for (size_t i=0; i != uploaded.size(); i++) {
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, uploaded[i], TILE_SAMPLES, TILE_SAMPLES, 1,
+                    GL_RED, GL_FLOAT, reinterpret_cast<void *>(offset + TILE_BYTES * i));
+            }
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            staging.fence();
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        upload_pages(pages);
+    }
+
+    // makes the tiles and page table visible to the tiles and pages samplers of the pipeline
+    void attach(GLShaderPipeline &pipeline, GLuint tilesUnit = 1, GLuint pagesUnit = 2) {
+        pipeline.setTexture("tiles", tilesUnit, GL_TEXTURE_2D_ARRAY, texture);
+        pipeline.setTexture("pages", pagesUnit, GL_TEXTURE_BUFFER, pagesTexture);
+    }
+
+    size_t resident() const {
+        return lru.size();
+    }
+
+    ~GLTileTextures() {
+        glDeleteTextures(1, &texture);
+        glDeleteTextures(1, &pagesTexture);
+        glDeleteBuffers(1, &pagesBuffer);
+    }
+};
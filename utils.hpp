@@ -7,6 +7,14 @@
 #include <glm/glm.hpp>
 #include "GLFW/glfw3.h"
 
+#if __has_include("embedded_shaders.hpp")
+#include "embedded_shaders.hpp"
+#else
+#include <map>
+#include <string_view>
+const std::map<std::string_view, std::string_view> EMBEDDED_SHADERS {};
+#endif
+
 struct Vertex {
     glm::vec3 position;
     glm::vec3 color;
@@ -17,8 +25,31 @@ struct GLMesh {
     std::vector<GLuint> indices;
 };
 
+// separates line strips in a single index buffer, enabled with glPrimitiveRestartIndex in main
+const GLuint PRIMITIVE_RESTART_INDEX = 0xFFFFFFFF;
+
+// per-instance attributes, one entry per plot drawn from a shared mesh
+struct GLMeshInstance {
+    glm::mat4 model;
+    glm::vec2 center;
+    // index of the formula evaluated for this instance (see generate_func)
+    GLint formula;
+};
+
+class GLShaderPipeline;
+
 struct GLRenderable {
     virtual void render(const glm::mat4 &viewMatrix, const glm::mat4 &projectionMatrix) = 0;
+
+    // GLScene groups renderables by these to minimize program and raster state changes
+    virtual const GLShaderPipeline* getShaderPipeline() const {
+        return nullptr;
+    }
+
+    virtual GLenum getPolygonMode() const {
+        return GL_FILL;
+    }
+
     virtual ~GLRenderable() {}
 };
 
@@ -62,15 +93,26 @@ GLMesh generate_plane_mesh(int side_len) {
 
 
 std::string readFile(const std::filesystem::path &path) {
-    std::ifstream stream(path, std::ios::in);
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
     if (!stream.is_open()) {
         throw std::runtime_error("failed to open shader " + path.string());
     }
 
-    std::stringstream sstr;
-    sstr << stream.rdbuf();
-    std::string data = sstr.str();
-    stream.close();
+    // read straight into the result, without copying through a stringstream
+    std::string data;
+    stream.seekg(0, std::ios::end);
+    data.resize((size_t)stream.tellg());
+    stream.seekg(0, std::ios::beg);
+    stream.read(data.data(), data.size());
 
     return data;
 }
+
+// source of a shader under shaders/, compiled into the binary by the Makefile (see
+// embedded_shaders.hpp), only read from path if it wasn't, e.g. when built some other way
+std::string readShader(const std::string &path) {
+    auto it = EMBEDDED_SHADERS.find(path);
+    if (it != EMBEDDED_SHADERS.end())
+        return std::string(it->second);
+    return readFile(path);
+}
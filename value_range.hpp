@@ -0,0 +1,251 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/ext/matrix_transform.hpp>
+#include "GL/glew.h"
+
+#include "expr_bytecode.hpp"
+#include "parallel.hpp"
+#include "shader_pipeline.hpp"
+#include "tile_cache.hpp"
+
+// range of the values of a formula over the plotted domain, and what it drives: the vertical
+// scale of the plot (HeightScale) and the colormap of plane.frag (GLValueRanges, GLColormap)
+//
+// the range is reduced from the samples of the tile cache, so the tiles shared with the contours
+// aren't sampled again, and only when the formula or the domain changes, not every frame
+
+struct ValueRange {
+    // of the finite samples, lo > hi if there are none
+    Interval range { INFINITY, -INFINITY };
+    // no sample was NaN or infinite
+    bool finite = true;
+
+    void merge(const ValueRange &other) {
+        range.lo = std::min(range.lo, other.range.lo);
+        range.hi = std::max(range.hi, other.range.hi);
+        finite &= other.finite;
+    }
+};
+
+// min and max of n samples, skipping the non finite ones, the samples are split over
+// REDUCE_LANES independent accumulators without branches, so the loop vectorizes
+const size_t REDUCE_LANES = 8;
+
+ValueRange reduce_range(const float* samples, size_t n) {
+    float lo[REDUCE_LANES], hi[REDUCE_LANES];
+    int finite[REDUCE_LANES];
+    for (size_t l=0; l != REDUCE_LANES; l++) {
+        lo[l] = INFINITY;
+        hi[l] = -INFINITY;
+        finite[l] = 1;
+    }
+
+    size_t i = 0;
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+        for (size_t l=0; l != REDUCE_LANES; l++) {
+            float v = samples[i + l];
+            // false for NaN and infinities
+            bool ok = v - v == 0.0f;
+            lo[l] = ok ? std::min(lo[l], v) : lo[l];
+            hi[l] = ok ? std::max(hi[l], v) : hi[l];
+            finite[l] &= ok;
+        }
+    }
+    for (size_t l=0; i != n; i++, l++) {
+        float v = samples[i];
+        bool ok = v - v == 0.0f;
+        lo[l] = ok ? std::min(lo[l], v) : lo[l];
+        hi[l] = ok ? std::max(hi[l], v) : hi[l];
+        finite[l] &= ok;
+    }
+
+    ValueRange result;
+    for (size_t l=0; l != REDUCE_LANES; l++) {
+        result.range.lo = std::min(result.range.lo, (double)lo[l]);
+        result.range.hi = std::max(result.range.hi, (double)hi[l]);
+        result.finite &= finite[l] != 0;
+    }
+    return result;
+}
+
+// range of formula over the lattice points of level lod inside [min, max], only tiles missing
+// from cache are sampled, the tiles are reduced in parallel, threads = 0 uses all hardware threads
+ValueRange tile_value_range(TileCache &cache, const Bytecode &bytecode, uint64_t formula,
+        glm::dvec2 min, glm::dvec2 max, int lod, size_t threads = 0) {
+    const double c = tile_cell(lod);
+    glm::ivec2 first { (int)std::ceil(min.x / c), (int)std::ceil(min.y / c) };
+    glm::ivec2 last { (int)std::floor(max.x / c), (int)std::floor(max.y / c) };
+    last = glm::max(last, first);
+
+    std::vector<glm::ivec2> tiles = tiles_covering(glm::dvec2 { first.x * c, first.y * c },
+        glm::dvec2 { last.x * c, last.y * c }, lod);
+    std::vector<const float*> samples = cache.fetch(bytecode, formula, lod, tiles, threads);
+
+    std::vector<ValueRange> ranges(tiles.size());
+    parallel_for(tiles.size(), threads, [&](size_t t) {
+        // lattice points of the tile inside [min, max], reduced row by row
+        glm::ivec2 origin = tiles[t] * TILE_SIZE;
+        glm::ivec2 lo = glm::max(first, origin);
+        glm::ivec2 hi = glm::min(last, origin + TILE_SIZE);
+
+        for (int y=lo.y; y <= hi.y; y++) {
+            const float* row = samples[t] + (y - origin.y) * TILE_SAMPLES + (lo.x - origin.x);
+            ranges[t].merge(reduce_range(row, hi.x - lo.x + 1));
+        }
+    });
+
+    ValueRange result;
+    for (auto&& range: ranges) {
+        result.merge(range);
+    }
+    return result;
+}
+
+// height of the tallest plot after auto scaling, the plane is 128 units wide
+const float AUTO_SCALE_HEIGHT = 64.0f;
+
+// maps a value to the height of the plane, (value - offset) * scale
+struct HeightScale {
+    float scale = 1.0f;
+    float offset = 0.0f;
+
+    // applied to the model matrix of a plot, plane.tese and the probe keep the unscaled value
+    glm::mat4 transform() const {
+        return glm::translate(glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, scale, 1.0f)),
+            glm::vec3(0.0f, -offset, 0.0f));
+    }
+};
+
+// shrinks ranges taller than AUTO_SCALE_HEIGHT to it, lower ones keep their true height, and
+// centers the range on 0 only if it would be out of [-AUTO_SCALE_HEIGHT, AUTO_SCALE_HEIGHT],
+// so plots near the grid stay on it
+HeightScale auto_height_scale(const ValueRange &value) {
+    HeightScale result;
+    const Interval &range = value.range;
+    if (!(range.lo <= range.hi))
+        return result;
+
+    double span = range.hi - range.lo;
+    if (span > AUTO_SCALE_HEIGHT)
+        result.scale = (float)(AUTO_SCALE_HEIGHT / span);
+    if (range.lo * result.scale < -AUTO_SCALE_HEIGHT || range.hi * result.scale > AUTO_SCALE_HEIGHT)
+        result.offset = (float)(0.5 * (range.lo + range.hi));
+    return result;
+}
+
+// per formula id the range mapped onto the colormap by plane.frag, one RG32F texel (lo, hi)
+// of a texture buffer like the formulas of GLBytecodeBuffer
+class GLValueRanges {
+    GLuint buffer;
+    GLuint texture;
+
+public:
+    GLValueRanges() {
+        glGenBuffers(1, &buffer);
+        glGenTextures(1, &texture);
+
+        upload({});
+    }
+
+    GLValueRanges(GLValueRanges&&) = delete;
+    GLValueRanges(GLValueRanges&) = delete;
+
+    // formula id i is mapped by ranges[i], formulas without finite values to the middle of the colormap
+    void upload(const std::vector<ValueRange> &ranges) {
+        std::vector<glm::vec2> texels;
+        for (auto&& value: ranges) {
+            bool empty = !(value.range.lo <= value.range.hi);
+            texels.push_back(empty ? glm::vec2 { 0.0f, 0.0f } : glm::vec2 { value.range.lo, value.range.hi });
+        }
+
+        // texture buffers can't be empty
+        if (texels.empty())
+            texels.push_back(glm::vec2 { 0.0f, 0.0f });
+
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::vec2) * texels.size(), texels.data(), GL_DYNAMIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32F, buffer);
+
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    void attach(GLShaderPipeline &pipeline, GLuint unit = 3) {
+        pipeline.setTexture("value_ranges", unit, GL_TEXTURE_BUFFER, texture);
+    }
+
+    ~GLValueRanges() {
+        glDeleteTextures(1, &texture);
+        glDeleteBuffers(1, &buffer);
+    }
+};
+
+// colors of values from lo to hi, evenly spaced stops of viridis
+// https://bids.github.io/colormap/
+const std::vector<glm::vec3> VIRIDIS {
+    { 0.267f, 0.005f, 0.329f },
+    { 0.282f, 0.157f, 0.471f },
+    { 0.243f, 0.290f, 0.537f },
+    { 0.192f, 0.408f, 0.557f },
+    { 0.149f, 0.510f, 0.557f },
+    { 0.122f, 0.620f, 0.537f },
+    { 0.208f, 0.718f, 0.475f },
+    { 0.427f, 0.804f, 0.349f },
+    { 0.706f, 0.871f, 0.173f },
+    { 0.992f, 0.906f, 0.145f },
+};
+
+// lookup texture of plane.frag, the stops interpolated into a 1D texture, filtered linearly
+class GLColormap {
+    GLuint texture;
+
+public:
+    static const int SIZE = 256;
+
+    GLColormap(const std::vector<glm::vec3> &stops = VIRIDIS) {
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_1D, texture);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_1D, 0);
+
+        upload(stops);
+    }
+
+    GLColormap(GLColormap&&) = delete;
+    GLColormap(GLColormap&) = delete;
+
+    void upload(const std::vector<glm::vec3> &stops) {
+        // RGBA8
+        std::vector<uint8_t> texels(SIZE * 4, 255);
+        for (int i=0; i != SIZE && !stops.empty(); i++) {
+            float x = (float)i / (SIZE - 1) * (stops.size() - 1);
+            size_t stop = std::min((size_t)x, stops.size() - 1);
+            size_t next = std::min(stop + 1, stops.size() - 1);
+            glm::vec3 color = glm::mix(stops[stop], stops[next], x - (float)stop);
+            for (int c=0; c != 3; c++) {
+                texels[i * 4 + c] = (uint8_t)(std::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+        }
+
+        glBindTexture(GL_TEXTURE_1D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+        glBindTexture(GL_TEXTURE_1D, 0);
+    }
+
+    void attach(GLShaderPipeline &pipeline, GLuint unit = 4) {
+        pipeline.setTexture("colormap", unit, GL_TEXTURE_1D, texture);
+    }
+
+    ~GLColormap() {
+        glDeleteTextures(1, &texture);
+    }
+};
@@ -0,0 +1,130 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include "GL/glew.h"
+
+#include "stream_buffer.hpp"
+
+// split screen views of one scene, see GLScene::views
+//
+// every view draws the same objects with the same pipelines, only the camera differs, so the
+// matrices of all views are written once per frame into a uniform buffer, one std140 Camera
+// block per view (see plane.tese), and each view just binds its range of it, without setting
+// uniforms of every program again
+
+// binding point of the Camera uniform block, see GLShaderPipeline::setUniformBlock
+const GLuint CAMERA_BLOCK_BINDING = 0;
+
+// layout (std140) uniform Camera
+struct CameraBlock {
+    glm::mat4 view;
+    glm::mat4 projection;
+};
+
+class GLCameraBuffer {
+    GLStreamBuffer buffer;
+    // distance between the blocks of consecutive views
+    size_t stride;
+    size_t offset = 0;
+
+public:
+    GLCameraBuffer(): buffer(sizeof(CameraBlock)), stride(sizeof(CameraBlock)) {
+        GLint alignment = 1;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        stride = (sizeof(CameraBlock) + alignment - 1) / alignment * alignment;
+    }
+
+    GLCameraBuffer(GLCameraBuffer&&) = delete;
+    GLCameraBuffer(GLCameraBuffer&) = delete;
+
+    // blocks of all views of the frame, the buffer grows with their count
+    void upload(const std::vector<CameraBlock> &blocks) {
+        uint8_t* out = static_cast<uint8_t*>(buffer.map(stride * blocks.size()));
+        for (size_t i=0; i != blocks.size() && out != nullptr; i++)
+            std::memcpy(out + stride * i, &blocks[i], sizeof(CameraBlock));
+        offset = buffer.unmap();
+    }
+
+    // makes the block of view the Camera block of every program
+    void bind(size_t view) const {
+        glBindBufferRange(GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, buffer.get_buffer(),
+            offset + stride * view, sizeof(CameraBlock));
+    }
+
+    // must be called after the last draw reading the uploaded blocks, see GLStreamBuffer::fence
+    void fence() {
+        buffer.fence();
+    }
+};
+
+// x, y, width, height of view i of count, laid out row by row from the top left in a grid as
+// square as possible, covering the viewport
+glm::ivec4 split_viewport(const glm::ivec4 &viewport, size_t i, size_t count) {
+    int columns = std::max(1, (int)std::ceil(std::sqrt((double)count)));
+    int rows = std::max(1, ((int)count + columns - 1) / columns);
+    int column = i % columns;
+    int row = i / columns;
+
+    // edges rounded the same way for neighbours, so the views neither overlap nor leave gaps
+    int x0 = viewport.x + viewport.z * column / columns;
+    int x1 = viewport.x + viewport.z * (column + 1) / columns;
+    int y0 = viewport.y + viewport.w * (rows - 1 - row) / rows;
+    int y1 = viewport.y + viewport.w * (rows - row) / rows;
+    return glm::ivec4 { x0, y0, std::max(1, x1 - x0), std::max(1, y1 - y0) };
+}
+
+// planes of the view frustum in world space, extracted from the combined matrix
+// https://www.gamedevs.org/uploads/fast-extraction-viewing-frustum-planes-from-world-view-projection-matrix.pdf
+struct Frustum {
+    // xyz - normal pointing inside, w - distance
+    glm::vec4 planes[6];
+
+    Frustum(const glm::mat4 &viewProjection) {
+        // glm matrices are column major, m[column][row]
+        auto row = [&](int r) {
+            return glm::vec4 { viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r] };
+        };
+        for (int axis=0; axis != 3; axis++) {
+            planes[axis * 2] = row(3) + row(axis);
+            planes[axis * 2 + 1] = row(3) - row(axis);
+        }
+    }
+
+    // false only if the box is entirely outside one of the planes, boxes near the corners may
+    // pass although they're outside, which only costs a draw
+    bool intersects(const glm::vec3 &min, const glm::vec3 &max) const {
+        for (auto&& plane: planes) {
+            // corner furthest along the normal
+            glm::vec3 corner {
+                plane.x >= 0.0f ? max.x : min.x,
+                plane.y >= 0.0f ? max.y : min.y,
+                plane.z >= 0.0f ? max.z : min.z,
+            };
+            if (plane.x * corner.x + plane.y * corner.y + plane.z * corner.z + plane.w < 0.0f)
+                return false;
+        }
+        return true;
+    }
+
+    // the box min, max transformed by model
+    bool intersects(const glm::mat4 &model, const glm::vec3 &min, const glm::vec3 &max) const {
+        glm::vec3 worldMin { INFINITY, INFINITY, INFINITY };
+        glm::vec3 worldMax { -INFINITY, -INFINITY, -INFINITY };
+        for (int i=0; i != 8; i++) {
+            glm::vec4 corner = model * glm::vec4 {
+                (i & 1) ? max.x : min.x,
+                (i & 2) ? max.y : min.y,
+                (i & 4) ? max.z : min.z,
+                1.0f,
+            };
+            worldMin = glm::min(worldMin, glm::vec3(corner));
+            worldMax = glm::max(worldMax, glm::vec3(corner));
+        }
+        return intersects(worldMin, worldMax);
+    }
+};